@@ -0,0 +1,32 @@
+-- Full collections with a chain of ephemeron entries, e[k1] = k2,
+-- e[k2] = k3, ..., where only k1 is reachable from outside. Each key
+-- is marked only through the previous entry, so a collector that
+-- re-traverses the table until nothing changes does one pass per link.
+-- Time per link should not grow with the chain length.
+-- Usage: lua ephemeron.lua [maxlinks]
+
+local MAXN = tonumber(arg and arg[1]) or 64000
+
+local function count (t)
+  local n = 0
+  for _ in pairs(t) do n = n + 1 end
+  return n
+end
+
+local n = MAXN // 16
+while n <= MAXN do
+  local e = setmetatable({}, {__mode = "k"})
+  local first = {}
+  local k = first
+  for _ = 1, n do local nk = {}; e[k] = nk; k = nk end
+  collectgarbage()
+  local t0 = os.clock()
+  collectgarbage()
+  local t = os.clock() - t0
+  assert(count(e) == n)   -- the whole chain survives
+  first = nil; k = nil
+  collectgarbage()
+  assert(next(e) == nil)  -- and goes away with its head
+  print(string.format("%6d links: %.3fs (%.2fus/link)", n, t, t / n * 1e6))
+  n = n * 2
+end
@@ -0,0 +1,26 @@
+-- Full collections of a large live heap with 0 to 'maxthreads' mark
+-- helper threads (collectgarbage "setmarkthreads"). Reports wall-clock
+-- time ('event.now') and CPU time of all threads ('os.clock').
+-- Usage: lua gcmark.lua [objects] [maxthreads]
+
+local N = tonumber(arg and arg[1]) or 2000000
+local MAXT = tonumber(arg and arg[2]) or 4
+
+-- a live heap of small tables linked in a tree, with some strings
+local heap = {}
+for i = 1, N do
+  heap[i] = {i, tostring(i), parent = heap[i // 2]}
+end
+
+local base
+local n = 0
+while n <= MAXT do
+  collectgarbage("setmarkthreads", n)
+  collectgarbage()
+  local t0, w0 = os.clock(), event.now()
+  for _ = 1, 5 do collectgarbage() end
+  print(string.format("%d helper threads: 5 full GCs in %.3fs (%.3fs CPU)",
+                      n, event.now() - w0, os.clock() - t0))
+  n = (n == 0) and 1 or n * 2
+end
+collectgarbage("setmarkthreads", 0)
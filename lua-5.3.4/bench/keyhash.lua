@@ -0,0 +1,38 @@
+-- Hash-part lookups with key patterns that defeat low-bit hashing:
+-- strided integers, integers in the high half, floats and table
+-- (pointer) keys, against random integers as the reference.
+-- Usage: lua keyhash.lua [keys] [rounds]
+
+local N = tonumber(arg and arg[1]) or 50000
+local R = tonumber(arg and arg[2]) or 10
+
+local function keys (f)
+  local k = {}
+  for i = 1, N do k[i] = f(i) end
+  return k
+end
+
+math.randomseed(42)
+local sets = {
+  {"random", keys(function () return math.random(1 << 62) end)},
+  {"i*1024", keys(function (i) return i * 1024 end)},
+  {"i<<32", keys(function (i) return i << 32 end)},
+  {"-i", keys(function (i) return -i end)},
+  {"i+0.5", keys(function (i) return i + 0.5 end)},
+  {"i/1024", keys(function (i) return i / 1024 + 0.0 end)},
+  {"tables", keys(function () return {} end)},
+}
+
+local base
+for _, s in ipairs(sets) do
+  local k = s[2]
+  local t0 = os.clock()
+  local t = {}
+  for i = 1, N do t[k[i]] = i end
+  for _ = 1, R do
+    for i = 1, N do assert(t[k[i]] == i) end
+  end
+  local e = os.clock() - t0
+  base = base or e
+  print(string.format("%-7s %.3fs (%.1fx random)", s[1], e, e / base))
+end
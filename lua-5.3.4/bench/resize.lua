@@ -0,0 +1,26 @@
+-- Insert latency while a big hash part grows. Keys are inserted in
+-- batches and the slowest batch is reported next to the median; with
+-- incremental resizing no batch pays for a whole rehash. To compare
+-- with one-shot resizing, build with -DLUAI_HASHMIGRATEMIN=0x40000000.
+-- Usage: lua resize.lua [keys] [batch]
+
+local N = tonumber(arg and arg[1]) or 4000000
+local B = tonumber(arg and arg[2]) or 1000
+
+local clock = os.clock
+local t, times = {}, {}
+local total = clock()
+for b = 0, N // B - 1 do
+  local t0 = clock()
+  for i = b * B + 1, (b + 1) * B do t[-i] = i end
+  times[#times + 1] = clock() - t0
+end
+total = clock() - total
+for i = 1, N, 997 do assert(t[-i] == i) end
+
+local maxt = 0
+for i = 1, #times do maxt = math.max(maxt, times[i]) end
+table.sort(times)
+local med = times[#times // 2 + 1]
+print(string.format("%d inserts in %.2fs; batch of %d: median %.1fus, " ..
+                    "max %.1fus", N, total, B, med * 1e6, maxt * 1e6))
@@ -0,0 +1,81 @@
+-- serialize.encode/decode against an encoder written in Lua with
+-- string.pack (same kind of tagged binary format, no shared tables).
+-- Usage: lua serialize.lua [rounds]
+
+local N = tonumber(arg and arg[1]) or 200
+
+local pack, unpack, concat = string.pack, string.unpack, table.concat
+local mtype = math.type
+
+local function lencode (v, buf)
+  local t = type(v)
+  if t == "number" then
+    if mtype(v) == "integer" then buf[#buf + 1] = pack("<Bj", 1, v)
+    else buf[#buf + 1] = pack("<Bn", 2, v)
+    end
+  elseif t == "string" then buf[#buf + 1] = pack("<Bs4", 3, v)
+  elseif t == "boolean" then buf[#buf + 1] = pack("B", v and 4 or 5)
+  elseif t == "table" then
+    local n = 0
+    for _ in pairs(v) do n = n + 1 end
+    buf[#buf + 1] = pack("<BI4", 6, n)
+    for k, x in pairs(v) do lencode(k, buf); lencode(x, buf) end
+  else buf[#buf + 1] = pack("B", 0)
+  end
+end
+
+local ldecode
+ldecode = function (s, pos)
+  local tag
+  tag, pos = unpack("B", s, pos)
+  if tag == 1 then return unpack("<j", s, pos)
+  elseif tag == 2 then return unpack("<n", s, pos)
+  elseif tag == 3 then return unpack("<s4", s, pos)
+  elseif tag == 4 then return true, pos
+  elseif tag == 5 then return false, pos
+  elseif tag == 6 then
+    local n, k, x
+    n, pos = unpack("<I4", s, pos)
+    local t = {}
+    for _ = 1, n do
+      k, pos = ldecode(s, pos)
+      x, pos = ldecode(s, pos)
+      t[k] = x
+    end
+    return t, pos
+  else return nil, pos
+  end
+end
+
+local function luaencode (v)
+  local buf = {}
+  lencode(v, buf)
+  return concat(buf)
+end
+
+local function luadecode (s) return (ldecode(s, 1)) end
+
+
+-- a record-like data set: an array of small tables
+local data = {}
+for i = 1, 2000 do
+  data[i] = {id = i, name = "item" .. i, price = i * 0.25,
+             tags = {"a", "b", "c"}, active = i % 2 == 0}
+end
+
+local function bench (name, enc, dec)
+  local s
+  local t0 = os.clock()
+  for _ = 1, N do s = enc(data) end
+  local te = os.clock() - t0
+  t0 = os.clock()
+  for _ = 1, N do assert(#dec(s) == #data) end
+  local td = os.clock() - t0
+  print(string.format("%-10s encode %.3fs  decode %.3fs  (%d bytes)",
+                      name, te, td, #s))
+  return te, td
+end
+
+local se, sd = bench("serialize", serialize.encode, serialize.decode)
+local le, ld = bench("Lua", luaencode, luadecode)
+print(string.format("speedup: encode %.1fx, decode %.1fx", le / se, ld / sd))
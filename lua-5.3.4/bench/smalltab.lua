@@ -0,0 +1,36 @@
+-- Creating and reading many small tables with a known hash size. Run
+-- it with the default build and one built with -DLUAI_INLINENODES=0
+-- (no inline room) to compare. Reports the best of 3 runs.
+-- Usage: lua smalltab.lua [tables]
+
+local N = tonumber(arg and arg[1]) or 1000000
+
+local keys = {"a", "b", "c"}
+
+local cases = {
+  {"record {x=,y=}", function (i) return {x = i, y = i} end},
+  {"computed keys", function (i)
+     return {[keys[1]] = i, [keys[2]] = i, [keys[3]] = i} end},
+  {"table.new(0, 4)", function (i)
+     local t = table.new(0, 4)
+     t.a = i; t.b = i; t.c = i; t.d = i
+     return t end},
+}
+
+local function run (make)
+  collectgarbage(); collectgarbage()
+  local t0 = os.clock()
+  local all = {}
+  for i = 1, N do all[i] = make(i) end
+  local s = 0
+  for _ = 1, 5 do
+    for i = 1, N do local t = all[i]; s = s + (t.x or t.a) end
+  end
+  return os.clock() - t0
+end
+
+for _, c in ipairs(cases) do
+  local best = math.huge
+  for _ = 1, 3 do best = math.min(best, run(c[2])) end
+  print(string.format("%-16s %.3fs", c[1], best))
+end
@@ -0,0 +1,54 @@
+-- Value representation: memory of large arrays and hash parts, and
+-- time of value-heavy loops. Run it with the default build and with
+-- one built with -DLUA_NANBOXING to compare.
+-- Usage: lua values.lua [elements]
+
+local N = tonumber(arg and arg[1]) or 1000000
+
+local function mem (f)
+  collectgarbage(); collectgarbage()
+  local m0 = collectgarbage("count")
+  local keep = f()
+  collectgarbage()
+  local m = collectgarbage("count") - m0
+  return keep, m
+end
+
+local function time (f)
+  local t0 = os.clock()
+  local r = f()
+  return r, os.clock() - t0
+end
+
+local _, arr = mem(function ()
+  local t = {}
+  for i = 1, N do t[i] = i * 0.5 end
+  return t
+end)
+local _, hash = mem(function ()
+  local t = {}
+  for i = 1, N do t[-i] = i end
+  return t
+end)
+print(string.format("memory: array %.1f bytes/element, hash %.1f bytes/key",
+                    arr * 1024 / N, hash * 1024 / N))
+
+local _, tnum = time(function ()   -- float and integer arithmetic
+  local s, f = 0, 0.0
+  for i = 1, 20 * N do s = s + i % 7; f = f + i * 0.25 end
+  return s + f
+end)
+local _, tarr = time(function ()   -- array traffic
+  local t = {}
+  for i = 1, N do t[i] = i end
+  local s = 0
+  for _ = 1, 20 do
+    for i = 1, N do s = s + t[i] end
+  end
+  return s
+end)
+local function fib (n) if n < 2 then return n end
+                       return fib(n - 1) + fib(n - 2) end
+local _, tcall = time(function () return fib(30) end)   -- stack traffic
+print(string.format("time: arithmetic %.3fs, arrays %.3fs, calls %.3fs",
+                    tnum, tarr, tcall))
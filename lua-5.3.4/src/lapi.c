@@ -441,6 +441,12 @@ LUA_API size_t lua_rawlen (lua_State *L, int idx) {
 }
 
 
+LUA_API int lua_isfrozen (lua_State *L, int idx) {
+  StkId o = index2addr(L, idx);
+  return (ttistable(o) && isfrozen(hvalue(o)));
+}
+
+
 LUA_API lua_CFunction lua_tocfunction (lua_State *L, int idx) {
   StkId o = index2addr(L, idx);
   if (ttislcf(o)) return fvalue(o);
@@ -776,7 +782,8 @@ LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
   Table *t;
   lua_lock(L);
   /*创建新的Table*/
-  t = luaH_new(L);
+  t = luaH_newsized(L, cast(unsigned int, narray > 0 ? narray : 0),
+                      cast(unsigned int, nrec > 0 ? nrec : 0), 0);
   /*入栈*/
   sethvalue(L, L->top, t);
   /*更新栈顶*/
@@ -789,6 +796,16 @@ LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
 }
 
 
+LUA_API void lua_cleartable (lua_State *L, int idx) {
+  StkId t;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  luaH_clear(L, hvalue(t));
+  lua_unlock(L);
+}
+
+
 LUA_API int lua_getmetatable (lua_State *L, int objindex) {
   const TValue *obj;
   Table *mt;
@@ -924,6 +941,7 @@ LUA_API void lua_rawset (lua_State *L, int idx) {
   api_checknelems(L, 2);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  if (isfrozen(hvalue(o))) luaG_frozenerror(L);
   slot = luaH_set(L, hvalue(o), L->top - 2);
   setobj2t(L, slot, L->top - 1);
   invalidateTMcache(hvalue(o));
@@ -941,6 +959,7 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
   /*获取栈中节点*/
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  if (isfrozen(hvalue(o))) luaG_frozenerror(L);
   /*使用n做为key，L->top-1为value，添加key/value到table o中*/
   luaH_setint(L, hvalue(o), n, L->top - 1);
   luaC_barrierback(L, hvalue(o), L->top-1);
@@ -957,6 +976,7 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   api_checknelems(L, 1);
   o = index2addr(L, idx);
   api_check(L, ttistable(o), "table expected");
+  if (isfrozen(hvalue(o))) luaG_frozenerror(L);
   setpvalue(&k, cast(void *, p));
   slot = luaH_set(L, hvalue(o), &k);
   setobj2t(L, slot, L->top - 1);
@@ -982,6 +1002,7 @@ LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   }
   switch (ttnov(obj)) {
     case LUA_TTABLE: {
+      if (isfrozen(hvalue(obj))) luaG_frozenerror(L);
       hvalue(obj)->metatable = mt;
       if (mt) {
         luaC_objbarrier(L, gcvalue(obj), mt);
@@ -1023,6 +1044,29 @@ LUA_API void lua_setuservalue (lua_State *L, int idx) {
 }
 
 
+/*
+** Freeze table at 'idx'. With 'permanent', also freeze every table
+** reachable from it and move the whole subgraph out of the collector's
+** reach: it is never traversed, swept, or collected again.
+*/
+LUA_API void lua_freeze (lua_State *L, int idx, int permanent) {
+  StkId o;
+  Table *t;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  t = hvalue(o);  /* 'o' may move: 'luaC_fixgraph' may run a collection */
+  if (permanent) {
+    int tt = luaC_fixgraph(L, t);
+    if (tt != LUA_TNONE)
+      luaG_runerror(L, "cannot make table permanent (it refers to a %s)",
+                       ttypename(tt));
+  }
+  t->frozen = 1;
+  lua_unlock(L);
+}
+
+
 /*
 ** 'load' and 'call' functions (run Lua code)
 */
@@ -1219,12 +1263,15 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->gcrunning = 1;  /* allow GC to run */
       if (data == 0) {
         luaE_setdebt(g, -GCSTEPSIZE);  /* to do a "small" step */
-        luaC_step(L);
+        luaC_explicitstep(L);
       }
       else {  /* add 'data' to total debt */
         debt = cast(l_mem, data) * 1024 + g->GCdebt;
         luaE_setdebt(g, debt);
-        luaC_checkGC(L);
+        if (g->gcsteptime > 0)  /* pacing by time? */
+          debt = 1;  /* then each call does a time slice */
+        if (debt > 0)
+          luaC_explicitstep(L);
       }
       g->gcrunning = oldrunning;  /* restore previous state */
       if (debt > 0 && g->gcstate == GCSpause)  /* end of cycle? */
@@ -1246,6 +1293,36 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCSETSTEPTIME: {
+      res = g->gcsteptime;
+      if (data < 0) data = 0;  /* 0 goes back to pacing by work */
+      g->gcsteptime = data;
+      break;
+    }
+    case LUA_GCSETCPUSHARE: {
+      res = g->gccpushare;
+      if (data < 1) data = 1;
+      else if (data > 100) data = 100;
+      g->gccpushare = data;
+      break;
+    }
+    case LUA_GCSETMARKTHREADS: {
+      res = luaC_markthreads(L, data);
+      break;
+    }
+    case LUA_GCSETLIMIT: {  /* budget in Kbytes; 0 removes it */
+      res = cast_int(g->gclimit >> 10);
+      g->gclimit = (data > 0) ? cast(lu_mem, data) << 10 : 0;
+      break;
+    }
+    case LUA_GCPEAK: {
+      res = cast_int(g->gcpeak >> 10);
+      break;
+    }
+    case LUA_GCPEAKB: {
+      res = cast_int(g->gcpeak & 0x3ff);
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1301,6 +1378,30 @@ LUA_API void lua_concat (lua_State *L, int n) {
 }
 
 
+/*
+** Push the concatenation of elements i..j of the table at 'idx',
+** separated by 'sep', if all of them are strings or numbers stored in
+** its array part (see 'luaV_concatarray'). Otherwise push nothing and
+** return 0.
+*/
+LUA_API int lua_concatarray (lua_State *L, int idx, const char *sep,
+                             size_t lsep, lua_Integer i, lua_Integer j) {
+  StkId t;
+  TString *ts = NULL;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  if (ttistable(t))
+    ts = luaV_concatarray(L, hvalue(t), sep, lsep, i, j);
+  if (ts != NULL) {
+    setsvalue2s(L, L->top, ts);
+    api_incr_top(L);
+    luaC_checkGC(L);
+  }
+  lua_unlock(L);
+  return (ts != NULL);
+}
+
+
 LUA_API void lua_len (lua_State *L, int idx) {
   StkId t;
   lua_lock(L);
@@ -1311,6 +1412,22 @@ LUA_API void lua_len (lua_State *L, int idx) {
 }
 
 
+/*
+** Try to sort elements 1..n of the value at 'idx' directly over its
+** array part (see 'luaH_sort'); returns 0 if it could not (including
+** when the value is not a table).
+*/
+LUA_API int lua_sortarray (lua_State *L, int idx, lua_Integer n) {
+  StkId t;
+  int res;
+  lua_lock(L);
+  t = index2addr(L, idx);
+  res = ttistable(t) && luaH_sort(L, hvalue(t), n);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
   lua_Alloc f;
   lua_lock(L);
@@ -0,0 +1,640 @@
+/*
+** $Id: larraylib.c $
+** Typed numeric arrays
+** See Copyright Notice in lua.h
+*/
+
+#define larraylib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** A typed array is a full userdata holding a fixed number of elements
+** of one C numeric type, stored contiguously right after a small header.
+** Elements are indexed from 1; reading outside 1..#a gives nil, writing
+** there is an error. Integer elements are stored as by a C cast from
+** the Lua integer (so they wrap around); float elements hold the
+** nearest representable value.
+**
+** The bulk operations run plain loops over the C data, written so that
+** the compiler can vectorize them; float sums and dot products use
+** several partial sums, so their rounding may differ slightly from a
+** left-to-right sum.
+**
+** 'tobytes' and 'array.frombytes' convert to and from the same layout
+** that 'string.pack' produces with the native-endian formats "=d", "=f",
+** "=i8", "=i4", and "=B" (or "=j" for "int64" with 64-bit integers).
+*/
+
+#define ARRAY_TYPENAME	"array"
+
+#define TA_FLOAT64	0
+#define TA_FLOAT32	1
+#define TA_INT64	2
+#define TA_INT32	3
+#define TA_UINT8	4
+
+#define isfloatkind(k)	((k) <= TA_FLOAT32)
+
+
+static const char *const kindnames[] = {
+  "float64", "float32", "int64", "int32", "uint8", NULL
+};
+
+static const size_t kindsizes[] = {
+  sizeof(double), sizeof(float), sizeof(int64_t), sizeof(int32_t),
+  sizeof(uint8_t)
+};
+
+
+typedef struct TArray {
+  size_t n;  /* number of elements */
+  int kind;
+  union { double d; int64_t i; } data[1];  /* elements start here */
+} TArray;
+
+#define elems(a,T)	((T *)(void *)(a)->data)
+#define sizearray(k,n)	(offsetof(TArray, data) + (n) * kindsizes[k])
+
+
+/*
+** Expands 'M(T)' for the C type of elements of kind 'k'
+*/
+#define dispatch(k,M)  \
+  switch (k) {  \
+    case TA_FLOAT64: M(double); break;  \
+    case TA_FLOAT32: M(float); break;  \
+    case TA_INT64: M(int64_t); break;  \
+    case TA_INT32: M(int32_t); break;  \
+    default: M(uint8_t); break;  \
+  }
+
+
+#define MAXSIZE		(~(size_t)0)
+
+#define checkarray(L,i)	((TArray *)luaL_checkudata(L, i, ARRAY_TYPENAME))
+
+
+static TArray *newarray (lua_State *L, int kind, size_t n) {
+  TArray *a;
+  if (n > (MAXSIZE - offsetof(TArray, data)) / kindsizes[kind])
+    luaL_error(L, "array too large");
+  a = (TArray *)lua_newuserdata(L, sizearray(kind, n));
+  a->n = n;
+  a->kind = kind;
+  luaL_setmetatable(L, ARRAY_TYPENAME);
+  return a;
+}
+
+
+static void checksame (lua_State *L, const TArray *a, const TArray *b,
+                       int arg) {
+  luaL_argcheck(L, a->kind == b->kind && a->n == b->n, arg,
+                "arrays differ in type or length");
+}
+
+
+/* 64-bit integers that do not fit a Lua integer are pushed as floats */
+static void pushint64 (lua_State *L, int64_t v) {
+  if (sizeof(lua_Integer) >= sizeof(int64_t) ||
+      (LUA_MININTEGER <= v && v <= LUA_MAXINTEGER))
+    lua_pushinteger(L, (lua_Integer)v);
+  else
+    lua_pushnumber(L, (lua_Number)v);
+}
+
+
+static void pushelem (lua_State *L, const TArray *a, size_t i) {
+  switch (a->kind) {
+    case TA_FLOAT64: lua_pushnumber(L, (lua_Number)elems(a, double)[i]); break;
+    case TA_FLOAT32: lua_pushnumber(L, (lua_Number)elems(a, float)[i]); break;
+    case TA_INT64: pushint64(L, elems(a, int64_t)[i]); break;
+    case TA_INT32: lua_pushinteger(L, elems(a, int32_t)[i]); break;
+    default: lua_pushinteger(L, elems(a, uint8_t)[i]); break;
+  }
+}
+
+
+/* store value at stack index 'arg' as element 'i' of 'a' */
+static void setelem (lua_State *L, TArray *a, size_t i, int arg) {
+  if (isfloatkind(a->kind)) {
+    lua_Number v = luaL_checknumber(L, arg);
+    if (a->kind == TA_FLOAT64) elems(a, double)[i] = (double)v;
+    else elems(a, float)[i] = (float)v;
+  }
+  else {
+    lua_Integer v = luaL_checkinteger(L, arg);
+    switch (a->kind) {
+      case TA_INT64: elems(a, int64_t)[i] = (int64_t)v; break;
+      case TA_INT32: elems(a, int32_t)[i] = (int32_t)v; break;
+      default: elems(a, uint8_t)[i] = (uint8_t)v; break;
+    }
+  }
+}
+
+
+/*
+** {======================================================
+** Kernels
+** =======================================================
+*/
+
+/* float sums use this many partial sums */
+#define NLANES		4
+
+
+static double fsum (const TArray *a) {
+  double s[NLANES] = {0, 0, 0, 0};
+  size_t n = a->n, i = 0;
+  int l;
+#define FSUM(T)  { const T *p = elems(a, T);  \
+    for (; i + NLANES <= n; i += NLANES)  \
+      for (l = 0; l < NLANES; l++) s[l] += p[i + l];  \
+    for (; i < n; i++) s[0] += p[i]; }
+  if (a->kind == TA_FLOAT64) FSUM(double) else FSUM(float)
+#undef FSUM
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+
+static double fdot (const TArray *a, const TArray *b) {
+  double s[NLANES] = {0, 0, 0, 0};
+  size_t n = a->n, i = 0;
+  int l;
+#define FDOT(T)  { const T *p = elems(a, T); const T *q = elems(b, T);  \
+    for (; i + NLANES <= n; i += NLANES)  \
+      for (l = 0; l < NLANES; l++) s[l] += (double)p[i + l] * q[i + l];  \
+    for (; i < n; i++) s[0] += (double)p[i] * q[i]; }
+  if (a->kind == TA_FLOAT64) FDOT(double) else FDOT(float)
+#undef FDOT
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+
+/* integer sums wrap around, as Lua integer arithmetic does */
+static uint64_t isum (const TArray *a) {
+  uint64_t s = 0;
+  size_t i, n = a->n;
+#define ISUM(T)  { const T *p = elems(a, T);  \
+    for (i = 0; i < n; i++) s += (uint64_t)p[i]; }
+  dispatch(a->kind, ISUM)
+#undef ISUM
+  return s;
+}
+
+
+static uint64_t idot (const TArray *a, const TArray *b) {
+  uint64_t s = 0;
+  size_t i, n = a->n;
+#define IDOT(T)  { const T *p = elems(a, T); const T *q = elems(b, T);  \
+    for (i = 0; i < n; i++) s += (uint64_t)p[i] * (uint64_t)q[i]; }
+  dispatch(a->kind, IDOT)
+#undef IDOT
+  return s;
+}
+
+
+/*
+** Sorting: quicksort with median-of-three pivot, switching to heapsort
+** when recursion gets too deep and to insertion sort for short runs.
+** 'DEFSORT' defines 'sort_<name>' for elements of type 'T'; float
+** arrays have their NaNs moved to the end before sorting.
+*/
+
+#define SORTCUTOFF	16
+
+#define DEFSORT(name,T) \
+static void sift_##name (T *a, size_t i, size_t n) {  \
+  T v = a[i];  \
+  for (;;) {  \
+    size_t c = 2 * i + 1;  \
+    if (c >= n) break;  \
+    if (c + 1 < n && a[c] < a[c + 1]) c++;  \
+    if (!(v < a[c])) break;  \
+    a[i] = a[c]; i = c;  \
+  }  \
+  a[i] = v;  \
+}  \
+static void sort_##name (T *a, size_t n, int depth) {  \
+  size_t i, j;  \
+  while (n > SORTCUTOFF) {  \
+    T p, t;  \
+    size_t mid = (n - 1) / 2;  \
+    if (depth-- == 0) {  /* too deep: heapsort */  \
+      for (i = n / 2; i-- > 0; ) sift_##name(a, i, n);  \
+      for (i = n; i-- > 1; ) {  \
+        t = a[0]; a[0] = a[i]; a[i] = t;  \
+        sift_##name(a, 0, i);  \
+      }  \
+      return;  \
+    }  \
+    if (a[mid] < a[0]) { t = a[mid]; a[mid] = a[0]; a[0] = t; }  \
+    if (a[n - 1] < a[0]) { t = a[n - 1]; a[n - 1] = a[0]; a[0] = t; }  \
+    if (a[n - 1] < a[mid]) { t = a[n - 1]; a[n - 1] = a[mid]; a[mid] = t; }  \
+    p = a[mid];  \
+    i = 0; j = n - 1;  \
+    for (;;) {  /* Hoare partition */  \
+      while (a[i] < p) i++;  \
+      while (p < a[j]) j--;  \
+      if (i >= j) break;  \
+      t = a[i]; a[i] = a[j]; a[j] = t;  \
+      i++; j--;  \
+    }  \
+    j++;  /* a[0..j-1] <= p <= a[j..n-1] */  \
+    if (j < n - j) { sort_##name(a, j, depth); a += j; n -= j; }  \
+    else { sort_##name(a + j, n - j, depth); n = j; }  \
+  }  \
+  for (i = 1; i < n; i++) {  \
+    T v = a[i];  \
+    for (j = i; j > 0 && v < a[j - 1]; j--) a[j] = a[j - 1];  \
+    a[j] = v;  \
+  }  \
+}
+
+DEFSORT(f64, double)
+DEFSORT(f32, float)
+DEFSORT(i64, int64_t)
+DEFSORT(i32, int32_t)
+DEFSORT(u8, uint8_t)
+
+
+/* moves NaNs to the end of 'p[0..n-1]'; returns the number of others */
+#define SKIPNANS(p,n,m)  { size_t i_;  \
+    for (i_ = m = 0; i_ < n; i_++)  \
+      if (p[i_] == p[i_]) { double t_ = p[m]; p[m++] = p[i_]; p[i_] = t_; } }
+
+
+static int sortdepth (size_t n) {
+  int d = 0;
+  while (n >>= 1) d++;
+  return 2 * d;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Methods
+** =======================================================
+*/
+
+static int arr_len (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  lua_pushinteger(L, (lua_Integer)a->n);
+  return 1;
+}
+
+
+static int arr_type (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  lua_pushstring(L, kindnames[a->kind]);
+  return 1;
+}
+
+
+static int arr_sum (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  if (isfloatkind(a->kind))
+    lua_pushnumber(L, (lua_Number)fsum(a));
+  else
+    pushint64(L, (int64_t)isum(a));
+  return 1;
+}
+
+
+static int arr_dot (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  TArray *b = checkarray(L, 2);
+  checksame(L, a, b, 2);
+  if (isfloatkind(a->kind))
+    lua_pushnumber(L, (lua_Number)fdot(a, b));
+  else
+    pushint64(L, (int64_t)idot(a, b));
+  return 1;
+}
+
+
+/*
+** NaNs are ignored by 'min' and 'max' unless the first element is one;
+** both return nil for an empty array.
+*/
+static int minmax (lua_State *L, int ismax) {
+  TArray *a = checkarray(L, 1);
+  size_t i, k = 0, n = a->n;
+  if (n == 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+#define MINMAX(T)  { const T *p = elems(a, T); T m = p[0];  \
+    if (ismax) { for (i = 1; i < n; i++) if (p[i] > m) m = p[i]; }  \
+    else { for (i = 1; i < n; i++) if (p[i] < m) m = p[i]; }  \
+    for (; k < n; k++) if (p[k] == m) break;  \
+    if (k == n) k = 0; }  /* 'm' is a NaN */
+  dispatch(a->kind, MINMAX)
+#undef MINMAX
+  pushelem(L, a, k);
+  return 1;
+}
+
+
+static int arr_min (lua_State *L) {
+  return minmax(L, 0);
+}
+
+
+static int arr_max (lua_State *L) {
+  return minmax(L, 1);
+}
+
+
+/* a[i] = a[i] * k; returns 'a' */
+static int arr_scale (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  size_t i, n = a->n;
+  if (isfloatkind(a->kind)) {
+    lua_Number k = luaL_checknumber(L, 2);
+#define SCALE(T)  { T *p = elems(a, T); T c = (T)k;  \
+      for (i = 0; i < n; i++) p[i] *= c; }
+    if (a->kind == TA_FLOAT64) SCALE(double) else SCALE(float)
+#undef SCALE
+  }
+  else {
+    uint64_t k = (uint64_t)luaL_checkinteger(L, 2);
+#define SCALE(T)  { T *p = elems(a, T);  \
+      for (i = 0; i < n; i++) p[i] = (T)((uint64_t)p[i] * k); }
+    dispatch(a->kind, SCALE)
+#undef SCALE
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* a[i] = a[i] + b[i], with 'b' an array or a number; returns 'a' */
+static int arr_add (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  size_t i, n = a->n;
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    if (isfloatkind(a->kind)) {
+      lua_Number k = lua_tonumber(L, 2);
+#define ADDK(T)  { T *p = elems(a, T); T c = (T)k;  \
+        for (i = 0; i < n; i++) p[i] += c; }
+      if (a->kind == TA_FLOAT64) ADDK(double) else ADDK(float)
+#undef ADDK
+    }
+    else {
+      uint64_t k = (uint64_t)luaL_checkinteger(L, 2);
+#define ADDK(T)  { T *p = elems(a, T);  \
+        for (i = 0; i < n; i++) p[i] = (T)((uint64_t)p[i] + k); }
+      dispatch(a->kind, ADDK)
+#undef ADDK
+    }
+  }
+  else {
+    TArray *b = checkarray(L, 2);
+    checksame(L, a, b, 2);
+    if (isfloatkind(a->kind)) {
+#define ADD(T)  { T *p = elems(a, T); const T *q = elems(b, T);  \
+        for (i = 0; i < n; i++) p[i] += q[i]; }
+      if (a->kind == TA_FLOAT64) ADD(double) else ADD(float)
+#undef ADD
+    }
+    else {
+#define ADD(T)  { T *p = elems(a, T); const T *q = elems(b, T);  \
+        for (i = 0; i < n; i++) p[i] = (T)((uint64_t)p[i] + (uint64_t)q[i]); }
+      dispatch(a->kind, ADD)
+#undef ADD
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* in-place inclusive prefix sum; returns 'a' */
+static int arr_prefixsum (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  size_t i, n = a->n;
+  if (isfloatkind(a->kind)) {
+#define PSUM(T)  { T *p = elems(a, T);  \
+      for (i = 1; i < n; i++) p[i] += p[i - 1]; }
+    if (a->kind == TA_FLOAT64) PSUM(double) else PSUM(float)
+#undef PSUM
+  }
+  else {
+#define PSUM(T)  { T *p = elems(a, T);  \
+      for (i = 1; i < n; i++) p[i] = (T)((uint64_t)p[i] + (uint64_t)p[i - 1]); }
+    dispatch(a->kind, PSUM)
+#undef PSUM
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* sorts in ascending order, NaNs last; returns 'a' */
+static int arr_sort (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  size_t m, n = a->n;
+  switch (a->kind) {
+    case TA_FLOAT64: {
+      double *p = elems(a, double);
+      SKIPNANS(p, n, m);
+      sort_f64(p, m, sortdepth(m));
+      break;
+    }
+    case TA_FLOAT32: {
+      float *p = elems(a, float);
+      SKIPNANS(p, n, m);
+      sort_f32(p, m, sortdepth(m));
+      break;
+    }
+    case TA_INT64: sort_i64(elems(a, int64_t), n, sortdepth(n)); break;
+    case TA_INT32: sort_i32(elems(a, int32_t), n, sortdepth(n)); break;
+    default: sort_u8(elems(a, uint8_t), n, sortdepth(n)); break;
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/* fill(v [, i [, j]]): sets elements i..j to v; returns 'a' */
+static int arr_fill (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  lua_Integer i = luaL_optinteger(L, 3, 1);
+  lua_Integer j = luaL_optinteger(L, 4, (lua_Integer)a->n);
+  if (i < 1) i = 1;
+  if (j > 0 && (lua_Unsigned)j > a->n) j = (lua_Integer)a->n;
+  if (i <= j) {
+    size_t k, e = (size_t)j;
+    setelem(L, a, (size_t)i - 1, 2);  /* also checks the value */
+#define FILL(T)  { T *p = elems(a, T); T v = p[i - 1];  \
+      for (k = (size_t)i; k < e; k++) p[k] = v; }
+    dispatch(a->kind, FILL)
+#undef FILL
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int arr_totable (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  size_t i;
+  luaL_argcheck(L, a->n < (size_t)INT_MAX, 1, "array too large");
+  lua_createtable(L, (int)a->n, 0);
+  for (i = 0; i < a->n; i++) {
+    pushelem(L, a, i);
+    lua_rawseti(L, -2, (lua_Integer)i + 1);
+  }
+  return 1;
+}
+
+
+static int arr_tobytes (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  lua_pushlstring(L, (const char *)a->data, a->n * kindsizes[a->kind]);
+  return 1;
+}
+
+
+static int arr_index (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  int isnum = 0;
+  lua_Integer i = (lua_type(L, 2) == LUA_TNUMBER) ? lua_tointegerx(L, 2, &isnum)
+                                                  : 0;
+  if (isnum) {  /* fast path: element access */
+    if ((lua_Unsigned)i - 1u < a->n)
+      pushelem(L, a, (size_t)i - 1);
+    else
+      lua_pushnil(L);
+  }
+  else  /* method */
+    lua_gettable(L, lua_upvalueindex(1));
+  return 1;
+}
+
+
+static int arr_newindex (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, (lua_Unsigned)i - 1u < a->n, 2, "index out of range");
+  setelem(L, a, (size_t)i - 1, 3);
+  return 0;
+}
+
+
+static int arr_tostring (lua_State *L) {
+  TArray *a = checkarray(L, 1);
+  lua_pushfstring(L, "%s array (%I): %p", kindnames[a->kind],
+                  (lua_Integer)a->n, (void *)a);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** new(type, n [, v]) creates an array of 'n' elements set to 'v'
+** (default 0); new(type, t) copies elements 1..#t from table 't'.
+*/
+static int tarr_new (lua_State *L) {
+  int kind = luaL_checkoption(L, 1, NULL, kindnames);
+  TArray *a;
+  size_t i;
+  lua_settop(L, 3);
+  if (lua_istable(L, 2)) {
+    lua_Integer n = luaL_len(L, 2);
+    a = newarray(L, kind, (size_t)(n > 0 ? n : 0));
+    for (i = 0; i < a->n; i++) {
+      if (lua_geti(L, 2, (lua_Integer)i + 1) != LUA_TNUMBER)
+        luaL_error(L, "element %I of table is not a number", (lua_Integer)i + 1);
+      setelem(L, a, i, 5);
+      lua_pop(L, 1);
+    }
+  }
+  else {
+    lua_Integer n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n >= 0, 2, "invalid size");
+    a = newarray(L, kind, (size_t)n);
+    memset(a->data, 0, (size_t)n * kindsizes[kind]);
+    if (!lua_isnoneornil(L, 3)) {
+      for (i = 0; i < a->n; i++)
+        setelem(L, a, i, 3);
+    }
+  }
+  return 1;
+}
+
+
+/* frombytes(type, s) creates an array from a 'tobytes' layout */
+static int tarr_frombytes (lua_State *L) {
+  int kind = luaL_checkoption(L, 1, NULL, kindnames);
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  TArray *a;
+  luaL_argcheck(L, l % kindsizes[kind] == 0, 2,
+                "length is not a multiple of the element size");
+  a = newarray(L, kind, l / kindsizes[kind]);
+  memcpy(a->data, s, l);
+  return 1;
+}
+
+
+static const luaL_Reg arr_methods[] = {
+  {"dot", arr_dot},
+  {"add", arr_add},
+  {"fill", arr_fill},
+  {"max", arr_max},
+  {"min", arr_min},
+  {"prefixsum", arr_prefixsum},
+  {"scale", arr_scale},
+  {"sort", arr_sort},
+  {"sum", arr_sum},
+  {"tobytes", arr_tobytes},
+  {"totable", arr_totable},
+  {"type", arr_type},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg arr_meta[] = {
+  {"__len", arr_len},
+  {"__newindex", arr_newindex},
+  {"__tostring", arr_tostring},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg tarr_funcs[] = {
+  {"frombytes", tarr_frombytes},
+  {"new", tarr_new},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_array (lua_State *L) {
+  luaL_newmetatable(L, ARRAY_TYPENAME);
+  luaL_setfuncs(L, arr_meta, 0);
+  luaL_newlib(L, arr_methods);
+  lua_pushcclosure(L, arr_index, 1);  /* methods are its upvalue */
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);  /* pop metatable */
+  luaL_newlib(L, tarr_funcs);
+  return 1;
+}
+
@@ -25,6 +25,7 @@
 #include "lua.h"
 
 #include "lauxlib.h"
+#include "lualib.h"
 
 
 /*
@@ -787,6 +788,302 @@ LUALIB_API int luaL_loadstring (lua_State *L, const char *s) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Heap images
+** =======================================================
+*/
+
+#if defined(LUA_USE_POSIX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+/*
+** Name the value below the top of the stack as the (popped) string at
+** the top in table 'perms'. A value reachable by several names gets the
+** shortest one (the first in alphabetical order among those), so that
+** the name does not depend on the order of traversal. If 'known' is not
+** 0, names that are not keys in table 'known' are ignored.
+*/
+static void setperm (lua_State *L, int perms, int known) {
+  size_t l, ol;
+  const char *name = lua_tolstring(L, -1, &l);
+  const char *old = NULL;
+  if (known != 0) {
+    lua_pushvalue(L, -1);
+    if (lua_rawget(L, known) == LUA_TNIL) {  /* unknown name? */
+      lua_pop(L, 2);  /* nil and name */
+      return;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pushvalue(L, -2);
+  if (lua_rawget(L, perms) == LUA_TSTRING)
+    old = lua_tolstring(L, -1, &ol);
+  if (old == NULL || l < ol || (l == ol && strcmp(name, old) < 0)) {
+    lua_pushvalue(L, -3);  /* value */
+    lua_pushvalue(L, -3);  /* its name */
+    lua_rawset(L, perms);
+  }
+  lua_pop(L, 2);  /* name and old name */
+}
+
+
+/*
+** Whether the value at the top of the stack must be a permanent: a
+** light userdata or a userdata with a finalizer (which holds resources
+** outside the Lua heap). Other userdata are saved by value.
+*/
+static int needsname (lua_State *L) {
+  switch (lua_type(L, -1)) {
+    case LUA_TLIGHTUSERDATA: return 1;
+    case LUA_TUSERDATA: {
+      if (luaL_getmetafield(L, -1, "__gc") == LUA_TNIL) return 0;
+      lua_pop(L, 1);  /* remove metafield */
+      return 1;
+    }
+    default: return 0;
+  }
+}
+
+
+/*
+** Add the userdata in the entry at the top of the stack (value at -1,
+** key at -2) that need names to table 'perms': the value itself, named
+** 'prefix.key', or the upvalues of a C function, named 'prefix.key^n'.
+*/
+static void addperms (lua_State *L, int perms, int known,
+                                  const char *prefix) {
+  if (lua_type(L, -2) != LUA_TSTRING)
+    return;
+  if (needsname(L)) {
+    lua_pushfstring(L, "%s.%s", prefix, lua_tostring(L, -2));
+    setperm(L, perms, known);
+  }
+  else if (lua_iscfunction(L, -1)) {
+    int n;
+    for (n = 1; lua_getupvalue(L, -1, n) != NULL; n++) {
+      if (needsname(L)) {
+        lua_pushfstring(L, "%s.%s^%d", prefix, lua_tostring(L, -3), n);
+        setperm(L, perms, known);
+      }
+      lua_pop(L, 1);  /* remove upvalue */
+    }
+  }
+}
+
+
+/*
+** Push the permanents for the heap image of a state with the standard
+** libraries: the userdata that need names (such as 'io.stdout') kept
+** in fields of loaded modules or under string keys in the registry (or
+** as upvalues of C functions kept there), and the light userdata used
+** as keys in the registry. These keys are addresses of static variables
+** (such as 'CLIBS' in loadlib.c), named after their offsets from a
+** function here, which are the same in all processes running the same
+** executable; other addresses get names that another process should
+** not have, so that loading fails instead of using them. The table
+** maps values to names if 'names' is true, otherwise names to values.
+** With 'known' not 0, only names that are keys in that table are used.
+*/
+static void pushpermanents (lua_State *L, int names, int known) {
+  int perms;
+  lua_newtable(L);
+  perms = lua_gettop(L);
+  lua_pushnil(L);
+  while (lua_next(L, LUA_REGISTRYINDEX)) {
+    if (lua_type(L, -2) == LUA_TLIGHTUSERDATA) {
+      size_t p = (size_t)lua_touserdata(L, -2);
+      lua_pushvalue(L, -2);
+      lua_pushfstring(L, "_R.@%I",
+                      (LUAI_UACINT)(p - (size_t)&luaL_newstate));
+      setperm(L, perms, known);
+      lua_pop(L, 1);  /* key copy */
+    }
+    addperms(L, perms, known, "_R");
+    lua_pop(L, 1);
+  }
+  if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE) == LUA_TTABLE) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {  /* for each module */
+      if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TTABLE) {
+        const char *modname = lua_tostring(L, -2);
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+          addperms(L, perms, known, modname);
+          lua_pop(L, 1);
+        }
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);  /* remove LOADED table */
+  if (!names) {
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, perms)) {
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -4);  /* inverse[name] = value */
+    }
+    lua_remove(L, perms);
+  }
+}
+
+
+static int writeF (lua_State *L, const void *b, size_t size, void *ud) {
+  (void)L;  /* not used */
+  return (fwrite(b, size, 1, (FILE *)ud) != 1);
+}
+
+
+static int openref (lua_State *R) {
+  luaL_openlibs(R);
+  pushpermanents(R, 0, 0);
+  return 1;
+}
+
+
+static int copynames (lua_State *L) {
+  lua_State *R = (lua_State *)lua_touserdata(L, 1);
+  lua_newtable(L);
+  lua_pushnil(R);
+  while (lua_next(R, -2)) {  /* for each name in 'R' */
+    lua_pop(R, 1);
+    lua_pushstring(L, lua_tostring(R, -1));
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+  }
+  return 1;
+}
+
+
+/*
+** Push a set with the names of the permanents of a new state with the
+** standard libraries, which is what 'luaL_loadimage' is meant to load
+** into. Values that such a state does not have under the same name
+** (e.g., a file in a global variable) cannot be permanents, so dumping
+** them fails instead of making an image that cannot be loaded.
+*/
+static void pushknownnames (lua_State *L) {
+  lua_State *R = luaL_newstate();
+  int status;
+  if (R == NULL)
+    luaL_error(L, "not enough memory");
+  lua_pushcfunction(R, openref);
+  if (lua_pcall(R, 0, 1, 0) != LUA_OK) {
+    lua_close(R);
+    luaL_error(L, "cannot open the standard libraries in a new state");
+  }
+  lua_pushcfunction(L, copynames);
+  lua_pushlightuserdata(L, R);
+  status = lua_pcall(L, 1, 1, 0);
+  lua_close(R);
+  if (status != LUA_OK)
+    lua_error(L);  /* propagate error */
+}
+
+
+static int dumpaux (lua_State *L) {
+  FILE *f = (FILE *)lua_touserdata(L, 1);
+  pushknownnames(L);
+  pushpermanents(L, 1, lua_gettop(L));
+  lua_pushinteger(L, lua_dumpimage(L, writeF, f));
+  return 1;
+}
+
+
+/*
+** Save the heap of 'L' into file 'filename' (see 'lua_dumpimage'), for
+** 'luaL_loadimage' in a new state with the standard libraries open.
+** Returns LUA_OK or an error code, with a message on the stack.
+*/
+LUALIB_API int luaL_dumpimage (lua_State *L, const char *filename) {
+  int status, writestatus;
+  int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
+  FILE *f;
+  lua_pushfstring(L, "@%s", filename);
+  f = fopen(filename, "wb");
+  if (f == NULL) return errfile(L, "open", fnameindex);
+  lua_pushcfunction(L, dumpaux);
+  lua_pushlightuserdata(L, f);
+  status = lua_pcall(L, 1, 1, 0);
+  writestatus = (status == LUA_OK && lua_tointeger(L, -1) != 0);
+  if (fclose(f) != 0) writestatus = 1;
+  if (status == LUA_OK && writestatus) {
+    lua_settop(L, fnameindex);
+    status = errfile(L, "write", fnameindex);
+  }
+  else if (status != LUA_OK) {
+    lua_replace(L, fnameindex);  /* keep only the error message */
+  }
+  else
+    lua_settop(L, fnameindex - 1);
+  if (status != LUA_OK)
+    remove(filename);  /* do not leave a partial image */
+  return status;
+}
+
+
+/*
+** Load the heap image in file 'filename' into 'L', usually a new state
+** with the standard libraries open (see 'lua_loadimage'). Returns
+** LUA_OK or an error code, with a message on the stack. Where it can,
+** it maps the file into memory instead of reading it.
+*/
+LUALIB_API int luaL_loadimage (lua_State *L, const char *filename) {
+  int status;
+  int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
+  lua_pushfstring(L, "@%s", filename);
+#if defined(LUA_USE_POSIX)
+  {
+    struct stat st;
+    void *m = NULL;
+    LoadS ls;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return errfile(L, "open", fnameindex);
+    if (fstat(fd, &st) != 0 || (st.st_size > 0 &&
+        (m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+          == MAP_FAILED)) {
+      close(fd);
+      return errfile(L, "read", fnameindex);
+    }
+    close(fd);  /* the mapping stays */
+    ls.s = (const char *)m;
+    ls.size = st.st_size;
+    pushpermanents(L, 0, 0);
+    status = lua_loadimage(L, getS, &ls);
+    if (m != NULL) munmap(m, st.st_size);
+  }
+#else
+  {
+    LoadF lf;
+    int readstatus;
+    lf.n = 0;
+    lf.f = fopen(filename, "rb");
+    if (lf.f == NULL) return errfile(L, "open", fnameindex);
+    pushpermanents(L, 0, 0);
+    status = lua_loadimage(L, getF, &lf);
+    readstatus = ferror(lf.f);
+    fclose(lf.f);
+    if (readstatus) {
+      lua_settop(L, fnameindex);
+      return errfile(L, "read", fnameindex);
+    }
+  }
+#endif
+  if (status != LUA_OK)
+    lua_replace(L, fnameindex);  /* keep only the error message */
+  lua_settop(L, fnameindex - (status == LUA_OK));
+  return status;
+}
+
+/* }====================================================== */
+
+
 
 LUALIB_API int luaL_getmetafield (lua_State *L, int obj, const char *event) {
   if (!lua_getmetatable(L, obj))  /* no metatable? */
@@ -173,16 +173,18 @@ static int luaB_rawset (lua_State *L) {
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "setsteptime", "setcpushare", "setmarkthreads",
+    "setlimit", "peak", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCSETSTEPTIME, LUA_GCSETCPUSHARE,
+    LUA_GCSETMARKTHREADS, LUA_GCSETLIMIT, LUA_GCPEAK};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   int ex = (int)luaL_optinteger(L, 2, 0);
   int res = lua_gc(L, o, ex);
   switch (o) {
-    case LUA_GCCOUNT: {
-      int b = lua_gc(L, LUA_GCCOUNTB, 0);
+    case LUA_GCCOUNT: case LUA_GCPEAK: {
+      int b = lua_gc(L, (o == LUA_GCCOUNT) ? LUA_GCCOUNTB : LUA_GCPEAKB, 0);
       lua_pushnumber(L, (lua_Number)res + ((lua_Number)b/1024));
       return 1;
     }
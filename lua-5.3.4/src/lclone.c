@@ -0,0 +1,450 @@
+/*
+** $Id: lclone.c $
+** Deep copy of a Lua state
+** See Copyright Notice in lua.h
+*/
+
+#define lclone_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include <string.h>
+
+#include "lua.h"
+
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "ltm.h"
+
+
+/*
+** 'lua_clonestate' builds a new, independent state with the same heap
+** as 'L': registry (and so globals and loaded modules), metatables for
+** basic types, and every object reachable from them, using the same
+** allocator and collector settings as 'L'. Each object is copied once
+** (short strings are internalized again instead); a table in the new
+** state ('memo') maps each original (as a light userdata) to its copy,
+** which keeps sharing and cycles.
+** Objects are created empty when first reached and filled later from
+** a work list, so deep structures do not use the C stack. The new
+** state does not collect garbage while being built.
+**
+** What cannot be copied is approximated:
+** - coroutines other than the main thread become new, empty threads;
+** - open upvalues (of functions running in 'L') are closed with their
+**   current values;
+** - userdata memory is copied byte by byte, except for userdata with
+**   finalizers: they own resources outside the Lua heap (files,
+**   thread pools, event loops) that the copy must not share, as the
+**   original state may release them at any time. Their copies keep
+**   metatable and user value but get zeroed memory, which libraries
+**   must take as a closed handle (as 'io' does for a zeroed stream).
+**   No object is marked for finalization in the copy.
+*/
+
+
+typedef struct CloneState {
+  lua_State *L;  /* original state */
+  lua_State *D;  /* new state */
+  Table *memo;  /* original object -> copy */
+  GCObject **work;  /* original objects whose contents are pending */
+  int nwork;
+  int sizework;
+} CloneState;
+
+
+static const TValue *getmemo (CloneState *cs, void *p) {
+  TValue k;
+  setpvalue(&k, p);
+  return luaH_get(cs->memo, &k);
+}
+
+
+static void setmemo (CloneState *cs, void *p, const TValue *copy) {
+  TValue k;
+  setpvalue(&k, p);
+  setobj2t(cs->D, luaH_set(cs->D, cs->memo, &k), copy);
+}
+
+
+static void addwork (CloneState *cs, GCObject *o) {
+  luaM_growvector(cs->D, cs->work, cs->nwork, cs->sizework, GCObject *,
+                  MAX_INT, "clone work list");
+  cs->work[cs->nwork++] = o;
+}
+
+
+/*
+** Create (empty) the copy of collectable object 'o', register it in
+** 'memo', and schedule its contents to be copied.
+*/
+static void newcopy (CloneState *cs, GCObject *o, TValue *res) {
+  lua_State *D = cs->D;
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      unsigned int nh = isshaped(h) ? cast(unsigned int, h->shape->nkeys)
+                                    : cast(unsigned int, allocsizenode(h));
+      Table *t = luaH_newsized(D, h->sizearray, nh, isshaped(h));
+      sethvalue(D, res, t);
+      setmemo(cs, o, res);  /* anchor it before sizing it */
+      if (isshaped(h))
+        luaH_presize(D, t, h->sizearray, nh);
+      else
+        luaH_resize(D, t, h->sizearray, nh);
+      break;
+    }
+    case LUA_TLCL: {
+      LClosure *cl = luaF_newLclosure(D, gco2lcl(o)->nupvalues);
+      setclLvalue(D, res, cl);
+      setmemo(cs, o, res);
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *ocl = gco2ccl(o);
+      CClosure *cl = luaF_newCclosure(D, ocl->nupvalues);
+      cl->f = ocl->f;
+      setclCvalue(D, res, cl);
+      setmemo(cs, o, res);
+      break;
+    }
+    case LUA_TPROTO: {
+      Proto *f = luaF_newproto(D);
+      setgcovalue(D, res, obj2gco(f));
+      setmemo(cs, o, res);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *ou = gco2u(o);
+      Udata *u = luaS_newudata(D, ou->len);
+      if (gfasttm(G(cs->L), ou->metatable, TM_GC) != NULL)
+        memset(getudatamem(u), 0, ou->len);  /* a closed handle */
+      else
+        memcpy(getudatamem(u), getudatamem(ou), ou->len);
+      setuvalue(D, res, u);
+      setmemo(cs, o, res);
+      break;
+    }
+    case LUA_TTHREAD: {
+      if (gco2th(o) == G(cs->L)->mainthread) {
+        setthvalue(D, res, G(D)->mainthread);
+      }
+      else {  /* coroutines are not copied */
+        lua_newthread(D);
+        setobj(D, res, D->top - 1);
+        D->top--;
+      }
+      setmemo(cs, o, res);
+      return;  /* nothing to fill */
+    }
+    default: lua_assert(0); return;
+  }
+  addwork(cs, o);
+}
+
+
+/*
+** Short strings are internalized in the new state too, so they are
+** shared anyway; long strings go through 'memo' like other objects.
+*/
+static TString *copystring (CloneState *cs, TString *ts) {
+  lua_State *D = cs->D;
+  const TValue *c;
+  TValue res;
+  if (ts == NULL)
+    return NULL;
+  else if (ts->tt == LUA_TSHRSTR)
+    return luaS_newlstr(D, getstr(ts), ts->shrlen);
+  c = getmemo(cs, obj2gco(ts));
+  if (!ttisnil(c))  /* already copied? */
+    return tsvalue(c);
+  else {
+    TString *nts = luaS_createlngstrobj(D, ts->u.lnglen);
+    memcpy(getstr(nts), getstr(ts), ts->u.lnglen * sizeof(char));
+    setsvalue(D, &res, nts);
+    setmemo(cs, obj2gco(ts), &res);
+    return nts;
+  }
+}
+
+
+/*
+** Set 'res' to the copy of value 'v'
+*/
+static void copyvalue (CloneState *cs, TValue *res, const TValue *v) {
+  lua_State *D = cs->D;
+  if (!iscollectable(v)) {  /* nil, boolean, number, light userdata... */
+    setobj(D, res, v);
+  }
+  else if (ttisstring(v)) {
+    setsvalue(D, res, copystring(cs, tsvalue(v)));
+  }
+  else {
+    const TValue *c = getmemo(cs, gcvalue(v));
+    if (!ttisnil(c)) {  /* already copied? */
+      setobj(D, res, c);
+    }
+    else
+      newcopy(cs, gcvalue(v), res);
+  }
+}
+
+
+/* copy of table, closure, or prototype object 'o' (already created) */
+#define gcopy(cs,o)	gcvalue(getmemo(cs, obj2gco(o)))
+
+
+static void filltable (CloneState *cs, Table *h, Table *t) {
+  lua_State *D = cs->D;
+  TValue kv[2];  /* key-value pair for 'luaH_next' */
+  setnilvalue(&kv[0]);
+  while (luaH_next(cs->L, h, kv)) {
+    TValue k, v;
+    copyvalue(cs, &k, &kv[0]);
+    copyvalue(cs, &v, &kv[1]);
+    setobj2t(D, luaH_set(D, t, &k), &v);
+  }
+  if (h->metatable != NULL) {
+    TValue mt, omt;
+    sethvalue(cs->L, &omt, h->metatable);
+    copyvalue(cs, &mt, &omt);
+    t->metatable = hvalue(&mt);
+  }
+  invalidateTMcache(t);
+  t->frozen = h->frozen;
+}
+
+
+static void fillproto (CloneState *cs, Proto *of, Proto *f) {
+  lua_State *D = cs->D;
+  int i;
+  f->numparams = of->numparams;
+  f->is_vararg = of->is_vararg;
+  f->maxstacksize = of->maxstacksize;
+  f->linedefined = of->linedefined;
+  f->lastlinedefined = of->lastlinedefined;
+  f->source = copystring(cs, of->source);
+  f->code = luaM_newvector(D, of->sizecode, Instruction);
+  f->sizecode = of->sizecode;
+  memcpy(f->code, of->code, of->sizecode * sizeof(Instruction));
+  f->lineinfo = luaM_newvector(D, of->sizelineinfo, int);
+  f->sizelineinfo = of->sizelineinfo;
+  memcpy(f->lineinfo, of->lineinfo, of->sizelineinfo * sizeof(int));
+  f->k = luaM_newvector(D, of->sizek, TValue);
+  f->sizek = of->sizek;
+  for (i = 0; i < of->sizek; i++)
+    setnilvalue(&f->k[i]);
+  for (i = 0; i < of->sizek; i++)
+    copyvalue(cs, &f->k[i], &of->k[i]);
+  f->upvalues = luaM_newvector(D, of->sizeupvalues, Upvaldesc);
+  f->sizeupvalues = of->sizeupvalues;
+  for (i = 0; i < of->sizeupvalues; i++)
+    f->upvalues[i].name = NULL;
+  for (i = 0; i < of->sizeupvalues; i++) {
+    f->upvalues[i].instack = of->upvalues[i].instack;
+    f->upvalues[i].idx = of->upvalues[i].idx;
+    f->upvalues[i].name = copystring(cs, of->upvalues[i].name);
+  }
+  f->locvars = luaM_newvector(D, of->sizelocvars, LocVar);
+  f->sizelocvars = of->sizelocvars;
+  for (i = 0; i < of->sizelocvars; i++)
+    f->locvars[i].varname = NULL;
+  for (i = 0; i < of->sizelocvars; i++) {
+    f->locvars[i].startpc = of->locvars[i].startpc;
+    f->locvars[i].endpc = of->locvars[i].endpc;
+    f->locvars[i].varname = copystring(cs, of->locvars[i].varname);
+  }
+  f->p = luaM_newvector(D, of->sizep, Proto *);
+  f->sizep = of->sizep;
+  for (i = 0; i < of->sizep; i++)
+    f->p[i] = NULL;
+  for (i = 0; i < of->sizep; i++) {
+    TValue p, op;
+    setgcovalue(cs->L, &op, obj2gco(of->p[i]));
+    copyvalue(cs, &p, &op);
+    f->p[i] = gco2p(gcvalue(&p));
+  }
+}
+
+
+/*
+** Upvalues shared by several closures stay shared: the first closure
+** to reach an upvalue creates its copy (always closed). The copy goes
+** into the closure before anything else is allocated, so that it is
+** freed with the closure if the clone fails.
+*/
+static void copyupval (CloneState *cs, UpVal **slot, UpVal *ouv) {
+  const TValue *c = getmemo(cs, ouv);
+  if (!ttisnil(c)) {  /* already copied? */
+    *slot = cast(UpVal *, pvalue(c));
+    (*slot)->refcount++;
+  }
+  else {
+    TValue p;
+    UpVal *uv = luaM_new(cs->D, UpVal);
+    uv->refcount = 1;
+    uv->v = &uv->u.value;
+    setnilvalue(uv->v);
+    *slot = uv;
+    setpvalue(&p, uv);
+    setmemo(cs, ouv, &p);
+    copyvalue(cs, uv->v, ouv->v);
+  }
+}
+
+
+static void fillLclosure (CloneState *cs, LClosure *ocl, LClosure *cl) {
+  TValue p, op;
+  int i;
+  setgcovalue(cs->L, &op, obj2gco(ocl->p));
+  copyvalue(cs, &p, &op);
+  cl->p = gco2p(gcvalue(&p));
+  for (i = 0; i < ocl->nupvalues; i++) {
+    if (ocl->upvals[i] != NULL)
+      copyupval(cs, &cl->upvals[i], ocl->upvals[i]);
+  }
+}
+
+
+static void fillobject (CloneState *cs, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      filltable(cs, gco2t(o), gco2t(gcopy(cs, o)));
+      break;
+    }
+    case LUA_TLCL: {
+      fillLclosure(cs, gco2lcl(o), gco2lcl(gcopy(cs, o)));
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *ocl = gco2ccl(o);
+      CClosure *cl = gco2ccl(gcopy(cs, o));
+      int i;
+      for (i = 0; i < ocl->nupvalues; i++)
+        copyvalue(cs, &cl->upvalue[i], &ocl->upvalue[i]);
+      break;
+    }
+    case LUA_TPROTO: {
+      fillproto(cs, gco2p(o), gco2p(gcopy(cs, o)));
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *ou = gco2u(o);
+      Udata *u = gco2u(gcopy(cs, o));
+      TValue uv, ouv;
+      if (ou->metatable != NULL) {
+        TValue mt, omt;
+        sethvalue(cs->L, &omt, ou->metatable);
+        copyvalue(cs, &mt, &omt);
+        u->metatable = hvalue(&mt);
+      }
+      getuservalue(cs->L, ou, &ouv);
+      copyvalue(cs, &uv, &ouv);
+      setuservalue(cs->D, u, &uv);
+      break;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+/* largest 'memo' built in advance */
+#define MAXMEMO		(1u << 24)
+
+/*
+** Number of objects other than strings in the original heap: an upper
+** bound for the number of entries in 'memo' (not counting upvalues).
+*/
+static unsigned int countobjects (global_State *g) {
+  unsigned int n = 0;
+  GCObject *l[2];
+  int i;
+  l[0] = g->allgc; l[1] = g->finobj;
+  for (i = 0; i < 2; i++) {
+    GCObject *o;
+    for (o = l[i]; o != NULL && n < MAXMEMO; o = o->next) {
+      if (o->tt != LUA_TSHRSTR && o->tt != LUA_TLNGSTR)
+        n++;
+    }
+  }
+  return n;
+}
+
+
+static void clone (lua_State *D, void *ud) {
+  CloneState *cs = cast(CloneState *, ud);
+  global_State *og = G(cs->L);
+  global_State *g = G(D);
+  Table *oreg = hvalue(&og->l_registry);
+  TValue v;
+  int i;
+  if (g->strt.size < og->strt.size)
+    luaS_resize(D, og->strt.size);  /* room for all strings at once */
+  cs->memo = luaH_new(D);
+  sethvalue2s(D, D->top, cs->memo);  /* anchor it */
+  D->top++;
+  luaH_resize(D, cs->memo, 0, countobjects(og));  /* avoid rehashes */
+  /* the registry and the main thread map to their counterparts */
+  setmemo(cs, obj2gco(oreg), &g->l_registry);
+  setthvalue(D, &v, g->mainthread);
+  setmemo(cs, obj2gco(og->mainthread), &v);
+  setmemo(cs, gcvalue(luaH_getint(oreg, LUA_RIDX_GLOBALS)),
+              luaH_getint(hvalue(&g->l_registry), LUA_RIDX_GLOBALS));
+  addwork(cs, obj2gco(oreg));
+  addwork(cs, gcvalue(luaH_getint(oreg, LUA_RIDX_GLOBALS)));
+  for (i = 0; i < LUA_NUMTAGS; i++) {
+    if (og->mt[i] != NULL) {
+      TValue omt;
+      sethvalue(cs->L, &omt, og->mt[i]);
+      copyvalue(cs, &v, &omt);
+      g->mt[i] = hvalue(&v);
+    }
+  }
+  while (cs->nwork > 0)
+    fillobject(cs, cs->work[--cs->nwork]);
+  D->top--;  /* remove 'memo' */
+}
+
+
+LUA_API lua_State *lua_clonestate (lua_State *L) {
+  global_State *og = G(L);
+  CloneState cs;
+  lua_State *D;
+  int status;
+  lua_lock(L);
+  D = lua_newstate(og->frealloc, og->ud);
+  if (D == NULL) {
+    lua_unlock(L);
+    return NULL;
+  }
+  G(D)->gcrunning = 0;  /* no collections while building the copy */
+  G(D)->gcstopem = 1;  /* (not even emergency ones) */
+  cs.L = L; cs.D = D;
+  cs.memo = NULL;
+  cs.work = NULL;
+  cs.nwork = cs.sizework = 0;
+  status = luaD_rawrunprotected(D, clone, &cs);
+  luaM_freearray(D, cs.work, cs.sizework);
+  G(D)->gcrunning = 1;
+  G(D)->gcstopem = 0;
+  G(D)->gcpause = og->gcpause;  /* same collector settings */
+  G(D)->gcstepmul = og->gcstepmul;
+  G(D)->gcsteptime = og->gcsteptime;
+  G(D)->gccpushare = og->gccpushare;
+  G(D)->gclimit = og->gclimit;
+  lua_unlock(L);
+  if (status != LUA_OK) {  /* not enough memory? */
+    lua_close(D);
+    return NULL;
+  }
+  return D;
+}
+
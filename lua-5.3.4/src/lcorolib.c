@@ -113,6 +113,123 @@ static int luaB_coresume (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Coroutine pool: when enabled with 'coroutine.pool(n)', finished
+** coroutines given back by 'coroutine.recycle' are reset and kept in
+** the registry, to be reused by later calls to 'create'/'wrap'. Only
+** the program knows when no other reference to a coroutine is left, so
+** threads are pooled only on request (a 'wrap' function never gives its
+** thread back by itself).
+** =======================================================
+*/
+
+#define COPOOL		"_COPOOL"
+
+
+/* push the pool table; its field 'max' is its capacity */
+static void getpool (lua_State *L) {
+  if (!luaL_getsubtable(L, LUA_REGISTRYINDEX, COPOOL)) {  /* new pool? */
+    lua_pushinteger(L, 0);  /* pooling starts disabled */
+    lua_setfield(L, -2, "max");
+  }
+}
+
+
+static lua_Integer poolmax (lua_State *L) {
+  lua_Integer max;
+  lua_getfield(L, -1, "max");
+  max = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return max;
+}
+
+
+/* is 'co' a coroutine that cannot run anymore? */
+static int isfinished (lua_State *L, lua_State *co) {
+  lua_Debug ar;
+  lua_State *mainth;
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  mainth = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  if (co == L || co == mainth) return 0;
+  switch (lua_status(co)) {
+    case LUA_YIELD: return 0;
+    case LUA_OK: return (lua_getstack(co, 0, &ar) == 0 && lua_gettop(co) == 0);
+    default: return 1;  /* dead by error */
+  }
+}
+
+
+/*
+** Reset 'co' (the value at index 'idx') and put it in the pool, if
+** there is room for it. Returns whether it was pooled.
+*/
+static int recycle (lua_State *L, lua_State *co, int idx) {
+  lua_Integer n;
+  idx = lua_absindex(L, idx);
+  getpool(L);
+  n = (lua_Integer)lua_rawlen(L, -1);
+  if (n >= poolmax(L) || !isfinished(L, co)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  lua_resetthread(co);
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, -2, n + 1);
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/* push a thread for a new coroutine, reusing a pooled one if possible */
+static lua_State *newco (lua_State *L) {
+  lua_State *co;
+  lua_Integer n;
+  getpool(L);
+  n = (lua_Integer)lua_rawlen(L, -1);
+  if (n > 0) {
+    lua_rawgeti(L, -1, n);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, n);  /* remove it from the pool */
+    lua_remove(L, -2);  /* remove pool table */
+    co = lua_tothread(L, -1);
+    lua_sethook(co, lua_gethook(L), lua_gethookmask(L),
+                    lua_gethookcount(L));  /* as 'lua_newthread' does */
+    return co;
+  }
+  lua_pop(L, 1);
+  return lua_newthread(L);
+}
+
+
+static int luaB_copool (lua_State *L) {
+  lua_Integer max = luaL_optinteger(L, 1, -1);
+  getpool(L);
+  lua_pushinteger(L, poolmax(L));  /* previous capacity */
+  if (max >= 0) {
+    lua_Integer n;
+    for (n = (lua_Integer)lua_rawlen(L, -2); n > max; n--) {
+      lua_pushnil(L);  /* drop extra threads */
+      lua_rawseti(L, -3, n);
+    }
+    lua_pushinteger(L, max);
+    lua_setfield(L, -3, "max");
+  }
+  lua_pushinteger(L, (lua_Integer)lua_rawlen(L, -2));  /* pooled threads */
+  return 2;
+}
+
+
+static int luaB_corecycle (lua_State *L) {
+  lua_State *co = getco(L);
+  lua_pushboolean(L, recycle(L, co, 1));
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static int luaB_auxwrap (lua_State *L) {
   lua_State *co = lua_tothread(L, lua_upvalueindex(1));
   int r = auxresume(L, co, lua_gettop(L));
@@ -135,7 +252,7 @@ static int luaB_cocreate (lua_State *L) {
   lua_State *NL;
   luaL_checktype(L, 1, LUA_TFUNCTION);
   /*创建新的虚拟机*/
-  NL = lua_newthread(L);
+  NL = newco(L);
   /*把创建协程时参数中指定的函数入栈*/
   lua_pushvalue(L, 1);  /* move function to top */
   /*把函数从原有的虚拟机移动到协程对应的虚拟机中*/
@@ -204,6 +321,8 @@ static const luaL_Reg co_funcs[] = {
   {"wrap", luaB_cowrap},
   {"yield", luaB_yield},
   {"isyieldable", luaB_yieldable},
+  {"pool", luaB_copool},
+  {"recycle", luaB_corecycle},
   {NULL, NULL}
 };
 
@@ -624,6 +624,11 @@ l_noret luaG_ordererror (lua_State *L, const TValue *p1, const TValue *p2) {
 }
 
 
+l_noret luaG_frozenerror (lua_State *L) {
+  luaG_runerror(L, "attempt to modify a frozen table");
+}
+
+
 /* add src:line information to 'msg' */
 const char *luaG_addinfo (lua_State *L, const char *msg, TString *src,
                                         int line) {
@@ -0,0 +1,759 @@
+/*
+** $Id: levlib.c $
+** Event loop library: coroutine tasks multiplexed over epoll
+** See Copyright Notice in lua.h
+*/
+
+#define levlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+#if defined(LUA_USE_LINUX)		/* { */
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* maximum number of descriptor events collected per 'epoll_wait' */
+#if !defined(LUA_EVMAXEVENTS)
+#define LUA_EVMAXEVENTS		256
+#endif
+
+
+#define EVLOOP		"event.loop"
+
+
+/* what a ready task receives when resumed */
+#define RK_START	0	/* first run: its arguments are already in place */
+#define RK_NONE		1	/* end of 'sleep'/'yield': no values */
+#define RK_READY	2	/* descriptor is ready: 'true' */
+#define RK_TIMEOUT	3	/* wait expired: 'false', "timeout" */
+
+
+/*
+** A task blocked on something. 'seq' identifies one particular wait of
+** task 'ref'; an entry whose 'seq' no longer matches the task's current
+** wait is stale and is ignored (e.g., the timer of a wait that already
+** finished because its descriptor became ready).
+*/
+typedef struct Waiter {
+  int ref;  /* task reference, or LUA_NOREF for none */
+  unsigned int seq;
+} Waiter;
+
+
+typedef struct FdSlot {
+  Waiter rd, wr;  /* tasks waiting to read/write the descriptor */
+  int mask;  /* events currently registered in epoll */
+} FdSlot;
+
+
+typedef struct Timer {
+  double at;  /* expiration time */
+  Waiter w;
+  int fd;  /* descriptor also being waited (-1 for a plain sleep) */
+  int dir;  /* 0 = read, 1 = write */
+} Timer;
+
+
+typedef struct Ready {
+  int ref;
+  int kind;  /* RK_* */
+} Ready;
+
+
+typedef struct Loop {
+  int open;  /* false once closed; all-zero memory is a closed loop */
+  int epfd;
+  int running;  /* true while inside 'event.run' */
+  int parked;  /* set by a task that yields into the loop */
+  int ntasks;  /* number of live tasks */
+  unsigned int seq;  /* last wait identifier */
+  FdSlot *fds;
+  int sizefds;
+  unsigned int *waits;  /* current wait of each task, indexed by 'ref' */
+  int sizewaits;
+  Timer *timers;  /* binary min-heap on 'at' */
+  int ntimers;
+  int sizetimers;
+  Ready *ready;  /* FIFO of tasks ready to run */
+  int readyhead;  /* first entry of 'ready' not yet run */
+  int nready;
+  int sizeready;
+} Loop;
+
+
+static Loop *getloop (lua_State *L) {
+  Loop *lp = (Loop *)lua_touserdata(L, lua_upvalueindex(1));
+  if (!lp->open)  /* e.g., in a state made by 'lua_clonestate' */
+    luaL_error(L, "attempt to use a closed event loop");
+  return lp;
+}
+
+
+static double now (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+
+/*
+** Grow a C vector owned by the loop, using the state's allocator.
+*/
+static void *growvector (lua_State *L, void *v, int *size, int need,
+                         size_t esize) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  int nsize = (*size > 0) ? *size : 16;
+  while (nsize <= need) nsize *= 2;
+  v = allocf(ud, v, (size_t)*size * esize, (size_t)nsize * esize);
+  if (v == NULL)
+    luaL_error(L, "not enough memory");
+  *size = nsize;
+  return v;
+}
+
+
+static void freevector (lua_State *L, void *v, int size, size_t esize) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  if (v != NULL)
+    allocf(ud, v, (size_t)size * esize, 0);
+}
+
+
+/*
+** {======================================================
+** Task bookkeeping. Tasks are kept alive by the uservalue of the
+** loop, a table mapping references to threads and threads back to
+** their references.
+** =======================================================
+*/
+
+static void pushtasks (lua_State *L) {
+  lua_getuservalue(L, lua_upvalueindex(1));
+}
+
+
+/* reference of the running task, or LUA_NOREF if it is not a task */
+static int currenttask (lua_State *L) {
+  int ref;
+  pushtasks(L);
+  lua_pushthread(L);
+  lua_rawget(L, -2);
+  ref = lua_isinteger(L, -1) ? (int)lua_tointeger(L, -1) : LUA_NOREF;
+  lua_pop(L, 2);
+  return ref;
+}
+
+
+static void pushready (lua_State *L, Loop *lp, int ref, int kind) {
+  if (lp->nready >= lp->sizeready)
+    lp->ready = (Ready *)growvector(L, lp->ready, &lp->sizeready,
+                                    lp->nready, sizeof(Ready));
+  lp->ready[lp->nready].ref = ref;
+  lp->ready[lp->nready].kind = kind;
+  lp->nready++;
+}
+
+
+/* start a new wait for task 'ref'; return its identifier */
+static unsigned int newwait (lua_State *L, Loop *lp, int ref) {
+  if (ref >= lp->sizewaits) {
+    int i, osize = lp->sizewaits;
+    lp->waits = (unsigned int *)growvector(L, lp->waits, &lp->sizewaits,
+                                           ref, sizeof(unsigned int));
+    for (i = osize; i < lp->sizewaits; i++) lp->waits[i] = 0;
+  }
+  if (++lp->seq == 0) lp->seq = 1;  /* 0 means "not waiting" */
+  lp->waits[ref] = lp->seq;
+  return lp->seq;
+}
+
+
+/* finish the wait described by 'w', if it is still current */
+static int wakeup (lua_State *L, Loop *lp, Waiter *w, int kind) {
+  int ref = w->ref;
+  w->ref = LUA_NOREF;
+  if (ref == LUA_NOREF || lp->waits[ref] != w->seq)
+    return 0;  /* stale */
+  lp->waits[ref] = 0;
+  pushready(L, lp, ref, kind);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Timers
+** =======================================================
+*/
+
+static void addtimer (lua_State *L, Loop *lp, double at, int ref,
+                      unsigned int seq, int fd, int dir) {
+  int i;
+  if (lp->ntimers >= lp->sizetimers)
+    lp->timers = (Timer *)growvector(L, lp->timers, &lp->sizetimers,
+                                     lp->ntimers, sizeof(Timer));
+  i = lp->ntimers++;
+  while (i > 0 && lp->timers[(i - 1) / 2].at > at) {  /* sift up */
+    lp->timers[i] = lp->timers[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  lp->timers[i].at = at;
+  lp->timers[i].w.ref = ref;
+  lp->timers[i].w.seq = seq;
+  lp->timers[i].fd = fd;
+  lp->timers[i].dir = dir;
+}
+
+
+static void poptimer (Loop *lp) {
+  Timer last = lp->timers[--lp->ntimers];
+  int i = 0;
+  for (;;) {  /* sift down */
+    int c = 2 * i + 1;
+    if (c >= lp->ntimers) break;
+    if (c + 1 < lp->ntimers && lp->timers[c + 1].at < lp->timers[c].at)
+      c++;
+    if (last.at <= lp->timers[c].at) break;
+    lp->timers[i] = lp->timers[c];
+    i = c;
+  }
+  if (lp->ntimers > 0)
+    lp->timers[i] = last;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Descriptors
+** =======================================================
+*/
+
+static int getfd (lua_State *L, int arg) {
+  luaL_Stream *p = (luaL_Stream *)luaL_testudata(L, arg, LUA_FILEHANDLE);
+  if (p != NULL) {
+    if (p->closef == NULL)
+      luaL_error(L, "attempt to use a closed file");
+    return fileno(p->f);
+  }
+  else {
+    lua_Integer fd = luaL_checkinteger(L, arg);
+    luaL_argcheck(L, 0 <= fd && fd <= INT_MAX, arg, "invalid descriptor");
+    return (int)fd;
+  }
+}
+
+
+static FdSlot *getslot (lua_State *L, Loop *lp, int fd) {
+  if (fd >= lp->sizefds) {
+    int i, osize = lp->sizefds;
+    lp->fds = (FdSlot *)growvector(L, lp->fds, &lp->sizefds, fd,
+                                   sizeof(FdSlot));
+    for (i = osize; i < lp->sizefds; i++) {
+      lp->fds[i].rd.ref = lp->fds[i].wr.ref = LUA_NOREF;
+      lp->fds[i].mask = 0;
+    }
+  }
+  return &lp->fds[fd];
+}
+
+
+/*
+** Make the epoll registration of 'fd' match its waiters. Return 0 if
+** the descriptor cannot be polled (e.g., a regular file), in which case
+** it is always ready.
+*/
+static int updatefd (Loop *lp, int fd) {
+  FdSlot *s = &lp->fds[fd];
+  int mask = ((s->rd.ref != LUA_NOREF) ? EPOLLIN : 0) |
+             ((s->wr.ref != LUA_NOREF) ? EPOLLOUT : 0);
+  struct epoll_event ev;
+  int op;
+  if (mask == s->mask) return 1;
+  if (s->mask == 0) op = EPOLL_CTL_ADD;
+  else if (mask == 0) op = EPOLL_CTL_DEL;
+  else op = EPOLL_CTL_MOD;
+  ev.events = (unsigned int)mask;
+  ev.data.fd = fd;
+  if (epoll_ctl(lp->epfd, op, fd, &ev) != 0) {
+    if (op == EPOLL_CTL_DEL) s->mask = 0;  /* descriptor probably closed */
+    return (op == EPOLL_CTL_DEL);
+  }
+  s->mask = mask;
+  return 1;
+}
+
+
+static void wakefd (lua_State *L, Loop *lp, int fd, int dir, int kind) {
+  FdSlot *s = &lp->fds[fd];
+  wakeup(L, lp, (dir == 0) ? &s->rd : &s->wr, kind);
+  updatefd(lp, fd);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Suspending tasks
+** =======================================================
+*/
+
+static int checktask (lua_State *L) {
+  int ref = currenttask(L);
+  if (ref == LUA_NOREF)
+    luaL_error(L, "not inside an event task");
+  return ref;
+}
+
+
+/*
+** Register the running task as waiting for descriptor 'fd' to be
+** ready for reading (dir == 0) or writing (dir == 1), with an optional
+** timeout (negative for none). The caller must yield next.
+*/
+static void waitfd (lua_State *L, int fd, int dir, double timeout) {
+  Loop *lp = getloop(L);
+  int ref = checktask(L);
+  FdSlot *s = getslot(L, lp, fd);
+  Waiter *w = (dir == 0) ? &s->rd : &s->wr;
+  unsigned int seq;
+  if (w->ref != LUA_NOREF && lp->waits[w->ref] == w->seq)
+    luaL_error(L, "descriptor %d already has a task waiting to %s",
+                  fd, (dir == 0) ? "read" : "write");
+  seq = newwait(L, lp, ref);
+  w->ref = ref;
+  w->seq = seq;
+  if (!updatefd(lp, fd)) {  /* cannot poll it? */
+    if (errno != EPERM)
+      luaL_error(L, "cannot wait on descriptor %d (%s)", fd, strerror(errno));
+    wakefd(L, lp, fd, dir, RK_READY);  /* never blocks; run it again */
+  }
+  else if (timeout >= 0)
+    addtimer(L, lp, now() + timeout, ref, seq, fd, dir);
+  lp->parked = 1;
+}
+
+
+static double opttimeout (lua_State *L, int arg) {
+  lua_Number t = luaL_optnumber(L, arg, -1);
+  return (t < 0) ? -1 : (double)t;
+}
+
+
+static int ev_wait (lua_State *L) {
+  static const char *const modes[] = {"r", "w", NULL};
+  int fd = getfd(L, 1);
+  int dir = luaL_checkoption(L, 2, "r", modes);
+  waitfd(L, fd, dir, opttimeout(L, 3));
+  return lua_yield(L, 0);  /* resume values are the results */
+}
+
+
+static int ev_sleep (lua_State *L) {
+  Loop *lp = getloop(L);
+  lua_Number t = luaL_checknumber(L, 1);
+  int ref = checktask(L);
+  unsigned int seq = newwait(L, lp, ref);
+  addtimer(L, lp, now() + ((t > 0) ? (double)t : 0), ref, seq, -1, 0);
+  lp->parked = 1;
+  return lua_yield(L, 0);
+}
+
+
+static int ev_yield (lua_State *L) {
+  Loop *lp = getloop(L);
+  pushready(L, lp, checktask(L), RK_NONE);
+  lp->parked = 1;
+  return lua_yield(L, 0);
+}
+
+
+/*
+** Continuation for 'read' and 'write': if the wait that suspended the
+** task timed out, return failure; otherwise keep only the original
+** arguments so that the operation can be retried.
+*/
+static int resumedtimeout (lua_State *L, int status, int nargs) {
+  if (status == LUA_YIELD && lua_gettop(L) > nargs &&
+      !lua_toboolean(L, nargs + 1)) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "timeout");
+    return 1;
+  }
+  lua_settop(L, nargs);
+  return 0;
+}
+
+
+static int ev_readk (lua_State *L, int status, lua_KContext ctx) {
+  int fd = getfd(L, 1);
+  lua_Integer n = luaL_optinteger(L, 2, LUAL_BUFFERSIZE);
+  luaL_Buffer b;
+  char *p;
+  ssize_t r;
+  (void)ctx;
+  if (resumedtimeout(L, status, 3))
+    return 2;
+  luaL_argcheck(L, n > 0, 2, "size must be positive");
+  p = luaL_buffinitsize(L, &b, (size_t)n);
+  do {
+    r = read(fd, p, (size_t)n);
+  } while (r < 0 && errno == EINTR);
+  if (r > 0) {
+    luaL_pushresultsize(&b, (size_t)r);
+    return 1;
+  }
+  lua_settop(L, 3);  /* remove buffer */
+  if (r == 0) {  /* end of file? */
+    lua_pushnil(L);
+    return 1;
+  }
+  else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    waitfd(L, fd, 0, opttimeout(L, 3));
+    return lua_yieldk(L, 0, 0, ev_readk);
+  }
+  else
+    return luaL_fileresult(L, 0, NULL);
+}
+
+
+/*
+** event.read(file [, n [, timeout]]): read at most 'n' bytes from a
+** non-blocking descriptor, suspending the task until data arrives.
+** Returns nil at end of file. It reads the descriptor directly, so it
+** must not be mixed with buffered 'file:read' on the same file.
+*/
+static int ev_read (lua_State *L) {
+  lua_settop(L, 3);
+  return ev_readk(L, LUA_OK, 0);
+}
+
+
+/* 'ctx' is the number of bytes already written */
+static int ev_writek (lua_State *L, int status, lua_KContext ctx) {
+  int fd = getfd(L, 1);
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  size_t done = (size_t)ctx;
+  if (resumedtimeout(L, status, 3))
+    return 2;
+  while (done < l) {
+    ssize_t r = write(fd, s + done, l - done);
+    if (r >= 0)
+      done += (size_t)r;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      waitfd(L, fd, 1, opttimeout(L, 3));
+      return lua_yieldk(L, 0, (lua_KContext)done, ev_writek);
+    }
+    else if (errno != EINTR)
+      return luaL_fileresult(L, 0, NULL);
+  }
+  lua_settop(L, 1);
+  return 1;  /* return file */
+}
+
+
+/*
+** event.write(file, s [, timeout]): write the whole string to a
+** non-blocking descriptor, suspending the task while it is full.
+*/
+static int ev_write (lua_State *L) {
+  lua_settop(L, 3);
+  return ev_writek(L, LUA_OK, 0);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Running the loop
+** =======================================================
+*/
+
+static int ev_spawn (lua_State *L) {
+  Loop *lp = getloop(L);
+  int n = lua_gettop(L);
+  int ref;
+  lua_State *co;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  co = lua_newthread(L);
+  lua_insert(L, 1);  /* thread below function and arguments */
+  lua_xmove(L, co, n);  /* function and arguments to the new task */
+  pushtasks(L);
+  lua_pushvalue(L, 1);
+  ref = luaL_ref(L, -2);  /* tasks[ref] = thread */
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, ref);
+  lua_rawset(L, -3);  /* tasks[thread] = ref */
+  lua_pop(L, 1);
+  pushready(L, lp, ref, RK_START);
+  lp->ntasks++;
+  return 1;
+}
+
+
+static void droptask (lua_State *L, Loop *lp, int ref) {
+  pushtasks(L);
+  lua_rawgeti(L, -1, ref);
+  lua_pushnil(L);
+  lua_rawset(L, -3);  /* tasks[thread] = nil */
+  luaL_unref(L, -1, ref);
+  lua_pop(L, 1);
+  if (ref < lp->sizewaits) lp->waits[ref] = 0;
+  lp->ntasks--;
+}
+
+
+static void runtask (lua_State *L, Loop *lp, Ready r) {
+  lua_State *co;
+  int status, nargs = 0;
+  pushtasks(L);
+  lua_rawgeti(L, -1, r.ref);
+  co = lua_tothread(L, -1);
+  lua_pop(L, 2);  /* thread is anchored in the task table */
+  switch (r.kind) {
+    case RK_START: nargs = lua_gettop(co) - 1; break;
+    case RK_READY: lua_pushboolean(co, 1); nargs = 1; break;
+    case RK_TIMEOUT: {
+      lua_pushboolean(co, 0);
+      lua_pushliteral(co, "timeout");
+      nargs = 2;
+      break;
+    }
+    default: break;
+  }
+  lp->parked = 0;
+  status = lua_resume(co, L, nargs);
+  if (status == LUA_YIELD) {
+    lua_settop(co, 0);  /* discard yielded values */
+    if (!lp->parked)  /* plain 'coroutine.yield'? */
+      pushready(L, lp, r.ref, RK_NONE);  /* just run it again later */
+  }
+  else if (status == LUA_OK)
+    droptask(L, lp, r.ref);
+  else {  /* error: stop the loop and propagate it with a traceback */
+    const char *msg = lua_tostring(co, -1);
+    if (msg != NULL)
+      luaL_traceback(L, co, msg, 0);
+    else
+      lua_xmove(co, L, 1);
+    droptask(L, lp, r.ref);
+    lua_error(L);
+  }
+}
+
+
+static int hasready (Loop *lp) {
+  return (lp->readyhead < lp->nready);
+}
+
+
+static void runready (lua_State *L, Loop *lp) {
+  int n = lp->nready;  /* tasks readied now run in the next round */
+  while (lp->readyhead < n) {
+    Ready r = lp->ready[lp->readyhead++];  /* dequeue before running it */
+    runtask(L, lp, r);
+  }
+  lp->nready -= lp->readyhead;
+  memmove(lp->ready, lp->ready + lp->readyhead,
+          (size_t)lp->nready * sizeof(Ready));
+  lp->readyhead = 0;
+}
+
+
+static void expiretimers (lua_State *L, Loop *lp) {
+  double t = now();
+  while (lp->ntimers > 0 && lp->timers[0].at <= t) {
+    Timer tm = lp->timers[0];
+    poptimer(lp);
+    if (tm.fd < 0)
+      wakeup(L, lp, &tm.w, RK_NONE);
+    else if (wakeup(L, lp, &tm.w, RK_TIMEOUT)) {
+      FdSlot *s = &lp->fds[tm.fd];  /* cancel the descriptor wait */
+      ((tm.dir == 0) ? &s->rd : &s->wr)->ref = LUA_NOREF;
+      updatefd(lp, tm.fd);
+    }
+  }
+}
+
+
+static void pollevents (lua_State *L, Loop *lp) {
+  struct epoll_event evs[LUA_EVMAXEVENTS];
+  int i, n, timeout = -1;
+  if (hasready(lp))
+    timeout = 0;
+  else if (lp->ntimers > 0) {
+    double d = (lp->timers[0].at - now()) * 1000.0;
+    timeout = (d <= 0) ? 0 : (d >= INT_MAX) ? INT_MAX : (int)d + 1;
+  }
+  n = epoll_wait(lp->epfd, evs, LUA_EVMAXEVENTS, timeout);
+  if (n < 0 && errno != EINTR)
+    luaL_error(L, "epoll_wait failed (%s)", strerror(errno));
+  for (i = 0; i < n; i++) {
+    int fd = evs[i].data.fd;
+    unsigned int e = evs[i].events;
+    if (e & (EPOLLIN | EPOLLHUP | EPOLLERR))
+      wakefd(L, lp, fd, 0, RK_READY);
+    if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      wakefd(L, lp, fd, 1, RK_READY);
+  }
+  expiretimers(L, lp);
+}
+
+
+static int haswaiters (Loop *lp) {
+  int fd;
+  if (lp->ntimers > 0) return 1;
+  for (fd = 0; fd < lp->sizefds; fd++)
+    if (lp->fds[fd].mask != 0) return 1;
+  return 0;
+}
+
+
+/*
+** Body of 'event.run', called in protected mode so that 'running' is
+** reset after any error (including memory errors in the loop itself).
+*/
+static int runloop (lua_State *L) {
+  Loop *lp = getloop(L);
+  while (lp->ntasks > 0) {
+    runready(L, lp);
+    if (lp->ntasks == 0) break;
+    if (!hasready(lp) && !haswaiters(lp))
+      return luaL_error(L, "event loop stalled: all tasks are suspended "
+                           "outside the loop");
+    pollevents(L, lp);
+  }
+  return 0;
+}
+
+
+/*
+** event.run(): run tasks until all of them have finished.
+*/
+static int ev_run (lua_State *L) {
+  Loop *lp = getloop(L);
+  int status;
+  if (lp->running)
+    return luaL_error(L, "event loop is already running");
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushcclosure(L, runloop, 1);
+  lp->running = 1;
+  status = lua_pcall(L, 0, 0, 0);
+  lp->running = 0;
+  if (status != LUA_OK)
+    return lua_error(L);  /* propagate error */
+  return 0;
+}
+
+
+static int ev_setnonblocking (lua_State *L) {
+  int fd = getfd(L, 1);
+  int on = lua_isnoneornil(L, 2) || lua_toboolean(L, 2);
+  int flags = fcntl(fd, F_GETFL);
+  if (flags >= 0)
+    flags = fcntl(fd, F_SETFL, on ? (flags | O_NONBLOCK)
+                                  : (flags & ~O_NONBLOCK));
+  return luaL_fileresult(L, flags >= 0, NULL);
+}
+
+
+static int ev_now (lua_State *L) {
+  lua_pushnumber(L, (lua_Number)now());
+  return 1;
+}
+
+
+static int ev_count (lua_State *L) {
+  lua_pushinteger(L, getloop(L)->ntasks);
+  return 1;
+}
+
+
+static int loop_gc (lua_State *L) {
+  Loop *lp = (Loop *)luaL_checkudata(L, 1, EVLOOP);
+  if (!lp->open) return 0;
+  lp->open = 0;
+  if (lp->epfd >= 0) close(lp->epfd);
+  lp->epfd = -1;
+  freevector(L, lp->fds, lp->sizefds, sizeof(FdSlot));
+  freevector(L, lp->waits, lp->sizewaits, sizeof(unsigned int));
+  freevector(L, lp->timers, lp->sizetimers, sizeof(Timer));
+  freevector(L, lp->ready, lp->sizeready, sizeof(Ready));
+  lp->fds = NULL; lp->waits = NULL; lp->timers = NULL; lp->ready = NULL;
+  lp->sizefds = lp->sizewaits = lp->sizetimers = lp->sizeready = 0;
+  return 0;
+}
+
+/* }====================================================== */
+
+
+static const luaL_Reg ev_funcs[] = {
+  {"count", ev_count},
+  {"now", ev_now},
+  {"read", ev_read},
+  {"run", ev_run},
+  {"setnonblocking", ev_setnonblocking},
+  {"sleep", ev_sleep},
+  {"spawn", ev_spawn},
+  {"wait", ev_wait},
+  {"write", ev_write},
+  {"yield", ev_yield},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_event (lua_State *L) {
+  Loop *lp;
+  luaL_newlibtable(L, ev_funcs);
+  lp = (Loop *)lua_newuserdata(L, sizeof(Loop));
+  memset(lp, 0, sizeof(Loop));
+  lp->epfd = -1;
+  luaL_newmetatable(L, EVLOOP);
+  lua_pushcfunction(L, loop_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_newtable(L);  /* task table */
+  lua_setuservalue(L, -2);
+  lp->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (lp->epfd < 0)
+    return luaL_error(L, "cannot create event loop (%s)", strerror(errno));
+  lp->open = 1;
+  luaL_setfuncs(L, ev_funcs, 1);  /* loop is the upvalue of all functions */
+  return 1;
+}
+
+
+#else					/* }{ */
+
+
+LUAMOD_API int luaopen_event (lua_State *L) {
+  return luaL_error(L, "library 'event' needs epoll (Linux only)");
+}
+
+#endif					/* } */
+
@@ -11,6 +11,7 @@
 
 
 #include <string.h>
+#include <time.h>
 
 #include "lua.h"
 
@@ -107,6 +108,28 @@ static void reallymarkobject (global_State *g, GCObject *o);
 #define gnodelast(h)	gnode(h, cast(size_t, sizenode(h)))
 
 
+/*
+** Set 'n' and 'limit' to the bounds of node vector 'v' of table 'h':
+** 0 is its hash part; 1 is the old hash part of a table whose entries
+** are still being migrated after a resize (see 'luaH_resize'), which
+** must be handled like the other one. Returns 0 if there is no such
+** vector.
+*/
+static int nodevector (Table *h, int v, Node **n, Node **limit) {
+  if (v == 0) {
+    *n = gnode(h, 0);
+    *limit = gnodelast(h);
+    return 1;
+  }
+  else if (v == 1 && h->oldnode != NULL) {
+    *n = h->oldnode;
+    *limit = h->oldnode + sizeoldnode(h);
+    return 1;
+  }
+  else return 0;
+}
+
+
 /*
 ** link collectable object 'o' into list pointed by 'p'
 */
@@ -202,6 +225,136 @@ void luaC_fix (lua_State *L, GCObject *o) {
 }
 
 
+/*
+** Check whether object 'o' can join a permanent subgraph: strings are
+** just marked; tables are marked and linked into list 'todo' to have
+** their contents checked. Objects already not white are permanent (or
+** were already visited). Objects with finalizers, functions, userdata,
+** and threads cannot be made permanent.
+*/
+static int fixvisit (GCObject *o, GCObject **todo) {
+  if (!iswhite(o))
+    return 1;
+  else if (tofinalize(o))
+    return 0;
+  switch (o->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: {
+      white2gray(o);
+      return 1;
+    }
+    case LUA_TTABLE: {
+      white2gray(o);
+      linkgclist(gco2t(o), *todo);
+      return 1;
+    }
+    default: return 0;
+  }
+}
+
+
+/*
+** Visit the metatable and all keys and values of table 'h'. Returns
+** LUA_TNONE if all of them can be made permanent, otherwise the type
+** of the offending value.
+*/
+static int fixtable (Table *h, GCObject **todo) {
+  unsigned int i;
+  Node *n, *limit;
+  int v;
+  if (h->metatable && !fixvisit(obj2gco(h->metatable), todo))
+    return LUA_TTABLE;
+  for (i = 0; i < h->sizearray; i++) {
+    TValue *o = &h->array[i];
+    if (iscollectable(o) && !fixvisit(gcvalue(o), todo))
+      return ttnov(o);
+  }
+  for (i = 0; i < h->sizeslots; i++) {  /* (shape keys are strings) */
+    TValue *o = &h->slots[i];
+    if (iscollectable(o) && !fixvisit(gcvalue(o), todo))
+      return ttnov(o);
+  }
+  for (v = 0; nodevector(h, v, &n, &limit); v++) {
+    for (; n < limit; n++) {
+      if (!ttisnil(gval(n))) {
+        if (iscollectable(gkey(n)) && !fixvisit(gcvalue(gkey(n)), todo))
+          return ttnov(gkey(n));
+        if (iscollectable(gval(n)) && !fixvisit(gcvalue(gval(n)), todo))
+          return ttnov(gval(n));
+      }
+    }
+  }
+  return LUA_TNONE;
+}
+
+
+/*
+** Turn the keys of empty entries of a table being made permanent into
+** dead keys: the table will not be traversed again, so nothing would
+** keep them alive (as 'removeentry' does for other tables).
+*/
+static void clearfixedkeys (Table *h) {
+  Node *n, *limit;
+  int v;
+  for (v = 0; nodevector(h, v, &n, &limit); v++) {
+    for (; n < limit; n++) {
+      if (ttisnil(gval(n)) && iscollectable(gkey(n)))
+        setdeadvalue(wgkey(n));
+    }
+  }
+}
+
+
+/*
+** Make table 't' and everything reachable from it permanent, like
+** 'luaC_fix' does for single objects: all its tables get frozen and
+** the whole subgraph moves to list 'fixedgc', gray forever, so that
+** later cycles neither traverse nor sweep it. The current cycle is
+** finished first, so that every live object in 'allgc' is white and
+** the visited ones are exactly the non-white ones there. (Nothing
+** here allocates memory, so no collection can interfere.) Returns
+** LUA_TNONE on success, otherwise the type of a value that cannot be
+** made permanent; in that case nothing is changed.
+*/
+int luaC_fixgraph (lua_State *L, Table *t) {
+  global_State *g = G(L);
+  GCObject *todo = NULL;
+  GCObject *done = NULL;
+  GCObject **p;
+  int res = LUA_TNONE;
+  luaC_runtilstate(L, bitmask(GCSpause));
+  if (!fixvisit(obj2gco(t), &todo))
+    return LUA_TTABLE;  /* table has a finalizer */
+  while (todo != NULL && res == LUA_TNONE) {
+    Table *h = gco2t(todo);
+    todo = h->gclist;
+    linkgclist(h, done);
+    res = fixtable(h, &todo);
+  }
+  if (res == LUA_TNONE) {
+    for (; done != NULL; done = gco2t(done)->gclist) {
+      gco2t(done)->frozen = 1;
+      clearfixedkeys(gco2t(done));
+    }
+  }
+  p = &g->allgc;
+  while (*p != NULL) {
+    GCObject *curr = *p;
+    if (iswhite(curr))
+      p = &curr->next;
+    else if (res != LUA_TNONE) {  /* failed? */
+      makewhite(g, curr);  /* undo visit */
+      p = &curr->next;
+    }
+    else {  /* move it to 'fixedgc' list */
+      *p = curr->next;
+      curr->next = g->fixedgc;
+      g->fixedgc = curr;
+    }
+  }
+  return res;
+}
+
+
 /*
 ** create a new collectable object (with given type and size) and link
 ** it to 'allgc' list.
@@ -230,6 +383,124 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 */
 
 
+/*
+** Pending ephemeron entries. During 'convergeephemerons', each entry
+** with a white key and a white value is recorded in 'ephmap' (a hash
+** set of pairs, keyed by the key). When a key is marked, its values
+** are pushed onto 'fired', to be marked by the convergence loop, so
+** that each entry is handled once instead of in every pass over all
+** ephemeron tables. The map memory comes straight from the allocator
+** and is not counted as Lua memory, as it lives only inside 'atomic'.
+** If it cannot grow, some entries are not recorded; the final pass in
+** 'convergeephemerons' handles those the classic way.
+*/
+typedef struct EphPair {
+  GCObject *key;
+  GCObject *value;
+} EphPair;
+
+
+typedef struct EphMap {
+  size_t size;  /* number of slots in 'pairs' (a power of 2) */
+  size_t n;  /* number of pairs in use (at most 'size / 2') */
+  EphPair *pairs;
+  GCObject **fired;  /* values to be marked ('size / 2' slots) */
+  size_t nfired;
+} EphMap;
+
+
+/* initial number of slots in an ephemeron map */
+#define MINEPHMAP	64
+
+#define ephhash(m,o)	(cast(size_t, point2uint(o) >> 4) & ((m)->size - 1))
+
+/* parallel marking may fire pending entries from several threads */
+#if defined(LUA_USE_LINUX)
+#define ephpush(m)	__atomic_fetch_add(&(m)->nfired, 1, __ATOMIC_RELAXED)
+#else
+#define ephpush(m)	((m)->nfired++)
+#endif
+
+
+static int allocephmap (global_State *g, EphMap *m, size_t size) {
+  m->pairs = cast(EphPair *, (*g->frealloc)(g->ud, NULL, 0,
+                                            size * sizeof(EphPair)));
+  m->fired = cast(GCObject **, (*g->frealloc)(g->ud, NULL, 0,
+                                              size / 2 * sizeof(GCObject *)));
+  if (m->pairs == NULL || m->fired == NULL) {
+    if (m->pairs != NULL)
+      (*g->frealloc)(g->ud, m->pairs, size * sizeof(EphPair), 0);
+    if (m->fired != NULL)
+      (*g->frealloc)(g->ud, m->fired, size / 2 * sizeof(GCObject *), 0);
+    return 0;
+  }
+  memset(m->pairs, 0, size * sizeof(EphPair));
+  m->size = size;
+  m->n = m->nfired = 0;
+  return 1;
+}
+
+
+static void freeephmap (global_State *g, EphMap *m) {
+  (*g->frealloc)(g->ud, m->pairs, m->size * sizeof(EphPair), 0);
+  (*g->frealloc)(g->ud, m->fired, m->size / 2 * sizeof(GCObject *), 0);
+}
+
+
+static void insertpair (EphMap *m, GCObject *key, GCObject *value) {
+  size_t i = ephhash(m, key);
+  while (m->pairs[i].key != NULL)  /* linear probing */
+    i = (i + 1) & (m->size - 1);
+  m->pairs[i].key = key;
+  m->pairs[i].value = value;
+  m->n++;
+}
+
+
+static int growephmap (global_State *g, EphMap *m) {
+  EphMap nm;
+  size_t i;
+  if (!allocephmap(g, &nm, m->size * 2))
+    return 0;
+  for (i = 0; i < m->size; i++) {
+    if (m->pairs[i].key != NULL)
+      insertpair(&nm, m->pairs[i].key, m->pairs[i].value);
+  }
+  nm.nfired = (m->nfired < m->size / 2) ? m->nfired : m->size / 2;
+  if (nm.nfired > 0)
+    memcpy(nm.fired, m->fired, nm.nfired * sizeof(GCObject *));
+  freeephmap(g, m);
+  *m = nm;
+  return 1;
+}
+
+
+/*
+** record that 'value' must be marked when 'key' is (called only from
+** the main thread, between parallel rounds)
+*/
+static void addpending (global_State *g, GCObject *key, GCObject *value) {
+  EphMap *m = g->ephmap;
+  if (m->n < m->size / 2 || growephmap(g, m))
+    insertpair(m, key, value);
+}
+
+
+/*
+** key 'o' has just been marked: schedule all values waiting for it
+*/
+static void firepending (EphMap *m, GCObject *o) {
+  size_t i = ephhash(m, o);
+  for (; m->pairs[i].key != NULL; i = (i + 1) & (m->size - 1)) {
+    if (m->pairs[i].key == o) {
+      size_t k = ephpush(m);
+      if (k < m->size / 2)  /* else the final pass will handle it */
+        m->fired[k] = m->pairs[i].value;
+    }
+  }
+}
+
+
 /*
 ** mark an object. Userdata, strings, and closed upvalues are visited
 ** and turned black here. Other objects are marked gray and added
@@ -239,6 +510,8 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 static void reallymarkobject (global_State *g, GCObject *o) {
  reentry:
   white2gray(o);
+  if (g->ephmap != NULL)  /* converging ephemerons? */
+    firepending(g->ephmap, o);
   switch (o->tt) {
     case LUA_TSHRSTR: {
       gray2black(o);
@@ -297,6 +570,18 @@ static void markmt (global_State *g) {
 }
 
 
+/*
+** mark the keys of all shapes (each shape adds one key to its parent's)
+*/
+static void markshapes (global_State *g, Shape *s) {
+  for (; s != NULL; s = s->sibling) {
+    if (s->nkeys > 0)
+      markobject(g, s->keys[s->nkeys - 1]);
+    markshapes(g, s->child);
+  }
+}
+
+
 /*
 ** mark all objects in list of being-finalized
 */
@@ -363,19 +648,22 @@ static void restartcollection (global_State *g) {
 ** put it in 'weak' list, to be cleared.
 */
 static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
-  /* if there is array part, assume it may have white values (it is not
-     worth traversing it now just to check) */
-  int hasclears = (h->sizearray > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      if (!hasclears && iscleared(g, gval(n)))  /* is there a white value? */
-        hasclears = 1;  /* table will have to be cleared */
+  Node *n, *limit;
+  int v;
+  /* if there is array part (or slots), assume it may have white values
+     (it is not worth traversing it now just to check) */
+  int hasclears = (h->sizearray > 0 || h->sizeslots > 0);
+  for (v = 0; nodevector(h, v, &n, &limit); v++) {
+    for (; n < limit; n++) {  /* traverse hash part */
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else {
+        lua_assert(!ttisnil(gkey(n)));
+        markvalue(g, gkey(n));  /* mark key */
+        if (!hasclears && iscleared(g, gval(n)))  /* a white value? */
+          hasclears = 1;  /* table will have to be cleared */
+      }
     }
   }
   if (g->gcstate == GCSpropagate)
@@ -399,7 +687,8 @@ static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
   int hasww = 0;  /* true if table has entry "white-key -> white-value" */
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
+  int v;
   unsigned int i;
   /* traverse array part */
   for (i = 0; i < h->sizearray; i++) {
@@ -408,19 +697,31 @@ static int traverseephemeron (global_State *g, Table *h) {
       reallymarkobject(g, gcvalue(&h->array[i]));
     }
   }
-  /* traverse hash part */
-  for (n = gnode(h, 0); n < limit; n++) {
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
-      hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
-        hasww = 1;  /* white-white entry */
-    }
-    else if (valiswhite(gval(n))) {  /* value not marked yet? */
+  /* traverse slots (their keys are strings, which are never cleared) */
+  for (i = 0; i < h->sizeslots; i++) {
+    if (valiswhite(&h->slots[i])) {
       marked = 1;
-      reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+      reallymarkobject(g, gcvalue(&h->slots[i]));
+    }
+  }
+  /* traverse hash part */
+  for (v = 0; nodevector(h, v, &n, &limit); v++) {
+    for (; n < limit; n++) {
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
+        hasclears = 1;  /* table must be cleared */
+        if (valiswhite(gval(n))) {  /* value not marked yet? */
+          hasww = 1;  /* white-white entry */
+          if (g->ephmap != NULL)  /* mark value when key gets marked */
+            addpending(g, gcvalue(gkey(n)), gcvalue(gval(n)));
+        }
+      }
+      else if (valiswhite(gval(n))) {  /* value not marked yet? */
+        marked = 1;
+        reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+      }
     }
   }
   /* link table into proper list */
@@ -435,23 +736,39 @@ static int traverseephemeron (global_State *g, Table *h) {
 
 
 static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Node *n, *limit;
+  int v;
   unsigned int i;
   for (i = 0; i < h->sizearray; i++)  /* traverse array part */
     markvalue(g, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      markvalue(g, gval(n));  /* mark value */
+  for (i = 0; i < h->sizeslots; i++)  /* traverse slots of a shaped table */
+    markvalue(g, &h->slots[i]);
+  for (v = 0; nodevector(h, v, &n, &limit); v++) {
+    for (; n < limit; n++) {  /* traverse hash part */
+      checkdeadkey(n);
+      if (ttisnil(gval(n)))  /* entry is empty? */
+        removeentry(n);  /* remove it */
+      else {
+        lua_assert(!ttisnil(gkey(n)));
+        markvalue(g, gkey(n));  /* mark key */
+        markvalue(g, gval(n));  /* mark value */
+      }
     }
   }
 }
 
 
+/*
+** memory used by table 'h' (header plus all its parts)
+*/
+static lu_mem tablemem (Table *h) {
+  return sizetable(h) + sizeof(TValue) * h->sizearray +
+         (hasinlineslots(h) ? 0 : sizeof(TValue) * h->sizeslots) +
+         (hasinlinenodes(h) ? 0 : sizeof(Node) * allocsizenode(h)) +
+         ((h->oldnode != NULL) ? sizeof(Node) * sizeoldnode(h) : 0);
+}
+
+
 static lu_mem traversetable (global_State *g, Table *h) {
   const char *weakkey, *weakvalue;
   const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
@@ -470,8 +787,17 @@ static lu_mem traversetable (global_State *g, Table *h) {
   }
   else  /* not weak */
     traversestrongtable(g, h);
-  return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                         sizeof(Node) * cast(size_t, allocsizenode(h));
+  return tablemem(h);
+}
+
+
+static int protomem (Proto *f) {
+  return sizeof(Proto) + sizeof(Instruction) * f->sizecode +
+                         sizeof(Proto *) * f->sizep +
+                         sizeof(TValue) * f->sizek +
+                         sizeof(int) * f->sizelineinfo +
+                         sizeof(LocVar) * f->sizelocvars +
+                         sizeof(Upvaldesc) * f->sizeupvalues;
 }
 
 
@@ -493,12 +819,7 @@ static int traverseproto (global_State *g, Proto *f) {
     markobjectN(g, f->p[i]);
   for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
     markobjectN(g, f->locvars[i].varname);
-  return sizeof(Proto) + sizeof(Instruction) * f->sizecode +
-                         sizeof(Proto *) * f->sizep +
-                         sizeof(TValue) * f->sizek +
-                         sizeof(int) * f->sizelineinfo +
-                         sizeof(LocVar) * f->sizelocvars +
-                         sizeof(Upvaldesc) * f->sizeupvalues;
+  return protomem(f);
 }
 
 
@@ -604,13 +925,561 @@ static void propagatemark (global_State *g) {
 }
 
 
+/*
+** {======================================================
+** Parallel marking
+** =======================================================
+*/
+
+#if defined(LUA_USE_LINUX)	/* { */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+/*
+** Helper threads share the traversal of the gray list while the
+** mutator is stopped (in the atomic phase and in full collections).
+** A worker claims a white object with an atomic compare-and-swap on
+** its 'marked' byte, so each object is traversed exactly once; gray
+** objects are linked through their own 'gclist' fields, so marking
+** never allocates. Each worker keeps a private stack and a shared
+** stack that idle workers steal from. Threads and weak tables need
+** the collector lists ('grayagain', 'weak', etc.), so workers leave
+** them to the main thread, which traverses them sequentially after
+** each parallel round.
+*/
+
+
+/* number of sequential steps before starting a parallel round */
+#if !defined(LUAI_PARMARKMIN)
+#define LUAI_PARMARKMIN		1000
+#endif
+
+/* maximum number of helper threads */
+#if !defined(LUAI_MAXMARKTHREADS)
+#define LUAI_MAXMARKTHREADS	64
+#endif
+
+
+typedef struct MarkWorker {
+  struct ParMark *pm;
+  pthread_t thread;
+  pthread_mutex_t lock;  /* protects 'shared' */
+  GCObject *shared;  /* gray objects other workers may steal */
+  GCObject *priv;  /* gray objects only this worker takes */
+  int npriv;  /* number of elements in 'priv' */
+  GCObject *deferred;  /* gray objects left to the main thread */
+  lu_mem memtrav;  /* memory traversed by this worker in this round */
+} MarkWorker;
+
+
+typedef struct ParMark {
+  global_State *g;
+  pthread_mutex_t lock;  /* protects 'round', 'ndone', and 'shutdown' */
+  pthread_cond_t wake;  /* signals a new round (or shutdown) */
+  pthread_cond_t finished;  /* signals all helpers done with a round */
+  unsigned int round;
+  int ndone;  /* helpers that finished current round */
+  int shutdown;
+  int nidle;  /* workers with no work (accessed atomically) */
+  int nworkers;  /* number of workers (main thread is worker 0) */
+  MarkWorker workers[1];  /* variable size */
+} ParMark;
+
+
+#define pwhite(o)	(__atomic_load_n(&(o)->marked, __ATOMIC_RELAXED) \
+                            & WHITEBITS)
+#define pblacken(o)	\
+  __atomic_fetch_or(&(o)->marked, bitmask(BLACKBIT), __ATOMIC_RELAXED)
+
+#define pmarkvalue(w,o) { checkconsistency(o); \
+  if (iscollectable(o)) pmarkobject(w, gcvalue(o)); }
+
+#define pmarkobjectN(w,t)	{ if (t) pmarkobject(w, obj2gco(t)); }
+
+
+/*
+** atomically turn a white object gray; returns true if this call did it
+*/
+static int claim (GCObject *o) {
+  lu_byte m = __atomic_load_n(&o->marked, __ATOMIC_RELAXED);
+  while (m & WHITEBITS) {
+    if (__atomic_compare_exchange_n(&o->marked, &m,
+                                    cast_byte(m & ~WHITEBITS), 1,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return 1;
+  }
+  return 0;
+}
+
+
+static GCObject **getgclist (GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: return &gco2t(o)->gclist;
+    case LUA_TLCL: return &gco2lcl(o)->gclist;
+    case LUA_TCCL: return &gco2ccl(o)->gclist;
+    case LUA_TTHREAD: return &gco2th(o)->gclist;
+    case LUA_TPROTO: return &gco2p(o)->gclist;
+    default: lua_assert(0); return NULL;
+  }
+}
+
+
+/*
+** Parallel version of 'reallymarkobject': strings and userdata are
+** finished here; other objects go to the worker's private stack.
+*/
+static void pmarkobject (MarkWorker *w, GCObject *o) {
+ reentry:
+  if (!pwhite(o) || !claim(o))
+    return;  /* already marked (possibly by another worker) */
+  if (w->pm->g->ephmap != NULL)  /* converging ephemerons? */
+    firepending(w->pm->g->ephmap, o);
+  switch (o->tt) {
+    case LUA_TSHRSTR: {
+      pblacken(o);
+      w->memtrav += sizelstring(gco2ts(o)->shrlen);
+      break;
+    }
+    case LUA_TLNGSTR: {
+      pblacken(o);
+      w->memtrav += sizelstring(gco2ts(o)->u.lnglen);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      TValue uvalue;
+      pmarkobjectN(w, gco2u(o)->metatable);  /* mark its metatable */
+      pblacken(o);
+      w->memtrav += sizeudata(gco2u(o));
+      getuservalue(w->pm->g->mainthread, gco2u(o), &uvalue);
+      if (iscollectable(&uvalue)) {
+        o = gcvalue(&uvalue);
+        goto reentry;
+      }
+      break;
+    }
+    default: {
+      *getgclist(o) = w->priv;
+      w->priv = o;
+      w->npriv++;
+      break;
+    }
+  }
+}
+
+
+/*
+** Weak mode of a table with metatable 'mt', or NULL. Unlike 'gfasttm',
+** it does not update the cache in 'mt->flags', which other workers
+** may be reading.
+*/
+static const TValue *pgetmode (global_State *g, Table *mt) {
+  if (mt == NULL || (mt->flags & (1u << TM_MODE)))
+    return NULL;
+  return luaH_getshortstr(mt, g->tmname[TM_MODE]);
+}
+
+
+static int isweak (global_State *g, Table *h) {
+  const TValue *mode = pgetmode(g, h->metatable);
+  return (mode != NULL && ttisstring(mode) &&
+          (strchr(svalue(mode), 'k') || strchr(svalue(mode), 'v')));
+}
+
+
+static void ptraversestrongtable (MarkWorker *w, Table *h) {
+  Node *n, *limit;
+  int v;
+  unsigned int i;
+  for (i = 0; i < h->sizearray; i++)  /* traverse array part */
+    pmarkvalue(w, &h->array[i]);
+  for (i = 0; i < h->sizeslots; i++)  /* traverse slots of a shaped table */
+    pmarkvalue(w, &h->slots[i]);
+  for (v = 0; nodevector(h, v, &n, &limit); v++) {
+    for (; n < limit; n++) {  /* traverse hash part */
+      checkdeadkey(n);
+      if (ttisnil(gval(n))) {  /* entry is empty? */
+        if (iscollectable(gkey(n)) && pwhite(gcvalue(gkey(n))))
+          setdeadvalue(wgkey(n));  /* as in 'removeentry' */
+      }
+      else {
+        lua_assert(!ttisnil(gkey(n)));
+        pmarkvalue(w, gkey(n));  /* mark key */
+        pmarkvalue(w, gval(n));  /* mark value */
+      }
+    }
+  }
+}
+
+
+static lu_mem ptraverseproto (MarkWorker *w, Proto *f) {
+  int i;
+  if (f->cache && pwhite(f->cache))
+    f->cache = NULL;  /* allow cache to be collected */
+  pmarkobjectN(w, f->source);
+  for (i = 0; i < f->sizek; i++)  /* mark literals */
+    pmarkvalue(w, &f->k[i]);
+  for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
+    pmarkobjectN(w, f->upvalues[i].name);
+  for (i = 0; i < f->sizep; i++)  /* mark nested protos */
+    pmarkobjectN(w, f->p[i]);
+  for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
+    pmarkobjectN(w, f->locvars[i].varname);
+  return protomem(f);
+}
+
+
+static lu_mem ptraverseLclosure (MarkWorker *w, LClosure *cl) {
+  int i;
+  pmarkobjectN(w, cl->p);  /* mark its prototype */
+  for (i = 0; i < cl->nupvalues; i++) {  /* mark its upvalues */
+    UpVal *uv = cl->upvals[i];
+    if (uv != NULL) {
+      if (upisopen(uv) && w->pm->g->gcstate != GCSinsideatomic)
+        __atomic_store_n(&uv->u.open.touched, 1, __ATOMIC_RELAXED);
+      else
+        pmarkvalue(w, uv->v);
+    }
+  }
+  return sizeLclosure(cl->nupvalues);
+}
+
+
+/*
+** Traverse gray object 'o', turning it black; threads and weak tables
+** stay gray and go to the 'deferred' list.
+*/
+static void ptraverse (MarkWorker *w, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      if (isweak(w->pm->g, h))
+        break;  /* defer it */
+      pblacken(o);
+      pmarkobjectN(w, h->metatable);
+      ptraversestrongtable(w, h);
+      w->memtrav += tablemem(h);
+      return;
+    }
+    case LUA_TLCL: {
+      pblacken(o);
+      w->memtrav += ptraverseLclosure(w, gco2lcl(o));
+      return;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      int i;
+      pblacken(o);
+      for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
+        pmarkvalue(w, &cl->upvalue[i]);
+      w->memtrav += sizeCclosure(cl->nupvalues);
+      return;
+    }
+    case LUA_TPROTO: {
+      pblacken(o);
+      w->memtrav += ptraverseproto(w, gco2p(o));
+      return;
+    }
+    default: break;  /* threads are deferred */
+  }
+  *getgclist(o) = w->deferred;
+  w->deferred = o;
+}
+
+
+/*
+** Move half of the private stack of 'w' to its (empty) shared stack.
+*/
+static void share (MarkWorker *w) {
+  int n = w->npriv / 2;
+  GCObject *l;
+  pthread_mutex_lock(&w->lock);
+  l = w->shared;
+  for (; n > 0; n--) {
+    GCObject *o = w->priv;
+    GCObject **next = getgclist(o);
+    w->priv = *next;
+    w->npriv--;
+    *next = l;
+    l = o;
+  }
+  __atomic_store_n(&w->shared, l, __ATOMIC_RELAXED);  /* see 'steal' */
+  pthread_mutex_unlock(&w->lock);
+}
+
+
+/*
+** Take an object from the shared stack of 'v'. A thief ('isthief')
+** leaves the idle count while still holding the victim's lock, so that
+** the victim cannot see all workers idle while this object is pending.
+*/
+static GCObject *take (MarkWorker *v, int isthief) {
+  GCObject *o;
+  pthread_mutex_lock(&v->lock);
+  o = v->shared;
+  if (o != NULL) {
+    __atomic_store_n(&v->shared, *getgclist(o), __ATOMIC_RELAXED);
+    if (isthief)
+      __atomic_sub_fetch(&v->pm->nidle, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&v->lock);
+  return o;
+}
+
+
+static GCObject *steal (MarkWorker *w) {
+  ParMark *pm = w->pm;
+  int self = cast_int(w - pm->workers);
+  int i;
+  for (i = 1; i < pm->nworkers; i++) {
+    MarkWorker *v = &pm->workers[(self + i) % pm->nworkers];
+    /* peek without the lock; 'take' checks again */
+    if (__atomic_load_n(&v->shared, __ATOMIC_RELAXED) != NULL) {
+      GCObject *o = take(v, 1);
+      if (o != NULL) return o;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+** Marking loop of a worker for one round; returns when all workers
+** are idle, that is, when there are no gray objects left in any stack.
+*/
+static void workloop (MarkWorker *w) {
+  ParMark *pm = w->pm;
+  for (;;) {
+    GCObject *o = w->priv;
+    if (o != NULL) {  /* private work? */
+      w->priv = *getgclist(o);
+      w->npriv--;
+    }
+    else if ((o = take(w, 0)) == NULL) {  /* no shared work either? */
+      __atomic_add_fetch(&pm->nidle, 1, __ATOMIC_SEQ_CST);
+      while ((o = steal(w)) == NULL) {
+        if (__atomic_load_n(&pm->nidle, __ATOMIC_SEQ_CST) == pm->nworkers)
+          return;  /* everybody is idle: round is over */
+        sched_yield();
+      }
+    }
+    ptraverse(w, o);
+    if (w->npriv > 1 && __atomic_load_n(&w->shared, __ATOMIC_RELAXED) == NULL)
+      share(w);  /* give idle workers something to steal */
+  }
+}
+
+
+static void *helpermain (void *ud) {
+  MarkWorker *w = cast(MarkWorker *, ud);
+  ParMark *pm = w->pm;
+  unsigned int round = 0;
+  for (;;) {
+    pthread_mutex_lock(&pm->lock);
+    while (pm->round == round && !pm->shutdown)
+      pthread_cond_wait(&pm->wake, &pm->lock);
+    if (pm->shutdown) {
+      pthread_mutex_unlock(&pm->lock);
+      return NULL;
+    }
+    round = pm->round;
+    pthread_mutex_unlock(&pm->lock);
+    workloop(w);
+    pthread_mutex_lock(&pm->lock);
+    if (++pm->ndone == pm->nworkers - 1)
+      pthread_cond_signal(&pm->finished);
+    pthread_mutex_unlock(&pm->lock);
+  }
+}
+
+
+/*
+** Traverse everything reachable from the gray list, in rounds: all
+** workers drain the gray objects they can handle; then the main
+** thread traverses the deferred ones, which may produce new gray
+** objects for another round.
+*/
+static void parallelmark (global_State *g) {
+  ParMark *pm = g->parmark;
+  while (g->gray != NULL) {
+    int i;
+    for (i = 0; i < pm->nworkers; i++) {
+      MarkWorker *w = &pm->workers[i];
+      w->priv = w->shared = w->deferred = NULL;
+      w->npriv = 0;
+      w->memtrav = 0;
+    }
+    pm->workers[0].shared = g->gray;  /* seed round with the gray list */
+    g->gray = NULL;
+    pm->nidle = 0;
+    pthread_mutex_lock(&pm->lock);
+    pm->ndone = 0;
+    pm->round++;
+    pthread_cond_broadcast(&pm->wake);
+    pthread_mutex_unlock(&pm->lock);
+    workloop(&pm->workers[0]);
+    pthread_mutex_lock(&pm->lock);
+    while (pm->ndone < pm->nworkers - 1)
+      pthread_cond_wait(&pm->finished, &pm->lock);
+    pthread_mutex_unlock(&pm->lock);
+    for (i = 0; i < pm->nworkers; i++) {
+      MarkWorker *w = &pm->workers[i];
+      GCObject *o = w->deferred;
+      g->GCmemtrav += w->memtrav;
+      while (o != NULL) {  /* traverse deferred objects */
+        GCObject **next = getgclist(o);
+        GCObject *nexto = *next;
+        *next = g->gray;  /* 'propagatemark' takes it from 'gray' */
+        g->gray = o;
+        propagatemark(g);
+        o = nexto;
+      }
+    }
+  }
+}
+
+
+static void stophelpers (ParMark *pm) {
+  int i;
+  pthread_mutex_lock(&pm->lock);
+  pm->shutdown = 1;
+  pthread_cond_broadcast(&pm->wake);
+  pthread_mutex_unlock(&pm->lock);
+  for (i = 1; i < pm->nworkers; i++)
+    pthread_join(pm->workers[i].thread, NULL);
+  for (i = 0; i < pm->nworkers; i++)
+    pthread_mutex_destroy(&pm->workers[i].lock);
+  pthread_cond_destroy(&pm->finished);
+  pthread_cond_destroy(&pm->wake);
+  pthread_mutex_destroy(&pm->lock);
+  free(pm);
+}
+
+
+/*
+** Start 'n' helper threads. Their state does not come from the Lua
+** allocator, as it is shared with threads that never run Lua code.
+** Returns NULL if it cannot start at least one helper.
+*/
+static ParMark *starthelpers (global_State *g, int n) {
+  ParMark *pm = cast(ParMark *, malloc(sizeof(ParMark) +
+                                       sizeof(MarkWorker) * n));
+  int i;
+  if (pm == NULL) return NULL;
+  memset(pm, 0, sizeof(ParMark) + sizeof(MarkWorker) * n);
+  pm->g = g;
+  pthread_mutex_init(&pm->lock, NULL);
+  pthread_cond_init(&pm->wake, NULL);
+  pthread_cond_init(&pm->finished, NULL);
+  pthread_mutex_init(&pm->workers[0].lock, NULL);
+  pm->workers[0].pm = pm;
+  pm->nworkers = 1;
+  for (i = 1; i <= n; i++) {
+    MarkWorker *w = &pm->workers[i];
+    w->pm = pm;
+    pthread_mutex_init(&w->lock, NULL);
+    if (pthread_create(&w->thread, NULL, helpermain, w) != 0) {
+      pthread_mutex_destroy(&w->lock);
+      break;  /* keep the helpers already running */
+    }
+    pm->nworkers++;
+  }
+  if (pm->nworkers == 1) {  /* no helper? */
+    stophelpers(pm);
+    return NULL;
+  }
+  return pm;
+}
+
+
+/*
+** Set the number of helper threads for parallel marking (0 stops
+** them; a negative 'n' only queries). Returns the previous number.
+*/
+int luaC_markthreads (lua_State *L, int n) {
+  global_State *g = G(L);
+  int old = (g->parmark != NULL) ? g->parmark->nworkers - 1 : 0;
+  if (n >= 0 && n != old) {
+    if (n > LUAI_MAXMARKTHREADS) n = LUAI_MAXMARKTHREADS;
+    if (g->parmark != NULL) {
+      stophelpers(g->parmark);
+      g->parmark = NULL;
+    }
+    if (n > 0)
+      g->parmark = starthelpers(g, n);
+  }
+  return old;
+}
+
+
+/*
+** Traverse all gray objects; after a few sequential steps, hand over
+** to the helpers if there are any (and the mutator is stopped).
+*/
+static void propagateall (global_State *g) {
+  int n = 0;
+  while (g->gray) {
+    if (g->parmark != NULL && ++n > LUAI_PARMARKMIN) {
+      parallelmark(g);
+      return;
+    }
+    propagatemark(g);
+  }
+}
+
+#else				/* }{ */
+
+int luaC_markthreads (lua_State *L, int n) {
+  UNUSED(L); UNUSED(n);
+  return 0;  /* no threads in this platform */
+}
+
+
 static void propagateall (global_State *g) {
   while (g->gray) propagatemark(g);
 }
 
+#endif				/* } */
+
+/* }====================================================== */
+
+
 
+/*
+** Converge ephemerons in two stages. First, traverse every ephemeron
+** table once, recording its white-key/white-value entries in an
+** 'EphMap', and propagate marks until no gray object and no fired
+** entry is left; this is linear in the number of entries. Then run
+** the classic fixed-point loop, which normally finishes in a single
+** pass that marks nothing, but also covers entries the map could not
+** record (for lack of memory).
+*/
 static void convergeephemerons (global_State *g) {
   int changed;
+  EphMap m;
+  if (g->ephemeron != NULL && allocephmap(g, &m, MINEPHMAP)) {
+    GCObject *w;
+    GCObject *next = g->ephemeron;  /* get ephemeron list */
+    g->ephemeron = NULL;  /* tables may return to this list when traversed */
+    g->ephmap = &m;
+    while ((w = next) != NULL) {
+      next = gco2t(w)->gclist;
+      traverseephemeron(g, gco2t(w));
+    }
+    do {
+      propagateall(g);
+      if (m.nfired > m.size / 2)  /* some entries lost? */
+        m.nfired = m.size / 2;  /* (final pass will handle them) */
+      while (m.nfired > 0) {
+        GCObject *o = m.fired[--m.nfired];
+        if (iswhite(o))
+          reallymarkobject(g, o);  /* may fire more entries */
+      }
+    } while (g->gray != NULL);
+    g->ephmap = NULL;
+    freeephmap(g, &m);
+  }
   do {
     GCObject *w;
     GCObject *next = g->ephemeron;  /* get ephemeron list */
@@ -643,11 +1512,14 @@ static void convergeephemerons (global_State *g) {
 static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
-        setnilvalue(gval(n));  /* remove value ... */
-        removeentry(n);  /* and remove entry from table */
+    Node *n, *limit;
+    int v;
+    for (v = 0; nodevector(h, v, &n, &limit); v++) {
+      for (; n < limit; n++) {
+        if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
+          setnilvalue(gval(n));  /* remove value ... */
+          removeentry(n);  /* and remove entry from table */
+        }
       }
     }
   }
@@ -661,17 +1533,25 @@ static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
 static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
+    Node *n, *limit;
+    int v;
     unsigned int i;
     for (i = 0; i < h->sizearray; i++) {
       TValue *o = &h->array[i];
       if (iscleared(g, o))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
-        setnilvalue(gval(n));  /* remove value ... */
-        removeentry(n);  /* and remove entry from table */
+    for (i = 0; i < h->sizeslots; i++) {
+      TValue *o = &h->slots[i];
+      if (iscleared(g, o))  /* value was collected? */
+        setnilvalue(o);  /* remove value */
+    }
+    for (v = 0; nodevector(h, v, &n, &limit); v++) {
+      for (; n < limit; n++) {
+        if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
+          setnilvalue(gval(n));  /* remove value ... */
+          removeentry(n);  /* and remove entry from table */
+        }
       }
     }
   }
@@ -775,14 +1655,26 @@ static GCObject **sweeptolive (lua_State *L, GCObject **p) {
 ** =======================================================
 */
 
+static void shrinkstrt (lua_State *L, void *ud) {
+  UNUSED(ud);
+  luaS_resize(L, G(L)->strt.size / 2);
+}
+
+
 /*
-** If possible, shrink string table
+** If possible, shrink string table. That allocates a new bucket array,
+** so it runs in protected mode: without memory for it, the table just
+** keeps its size (and 'gcstopem' is restored in any case).
 */
 static void checkSizes (lua_State *L, global_State *g) {
   if (g->gckind != KGC_EMERGENCY) {
     l_mem olddebt = g->GCdebt;
-    if (g->strt.nuse < g->strt.size / 4)  /* string table too big? */
-      luaS_resize(L, g->strt.size / 2);  /* shrink it a little */
+    if (g->strt.nuse < g->strt.size / 4 &&  /* string table too big? */
+        g->strt.oldhash == NULL) {  /* and not being resized? */
+      g->gcstopem = 1;  /* the collector cannot run inside itself */
+      luaD_rawrunprotected(L, shrinkstrt, NULL);  /* shrink it a little */
+      g->gcstopem = 0;
+    }
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
   }
 }
@@ -923,6 +1815,33 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
   }
 }
 
+
+/*
+** Do what 'luaC_checkfinalizer' does for each table or userdata in
+** 'allgc' created after 'last' (so, before it in the list), in one
+** pass over them instead of one search per object. Used after
+** building many objects with their metatables (see 'lua_loadimage');
+** it cannot run during a sweep.
+*/
+void luaC_checkfinalizers (lua_State *L, GCObject *last) {
+  global_State *g = G(L);
+  GCObject **p = &g->allgc;
+  lua_assert(!issweepphase(g));
+  while (*p != last) {
+    GCObject *o = *p;
+    Table *mt = (o->tt == LUA_TTABLE) ? gco2t(o)->metatable
+              : (o->tt == LUA_TUSERDATA) ? gco2u(o)->metatable : NULL;
+    if (mt != NULL && gfasttm(g, mt, TM_GC) != NULL) {
+      *p = o->next;  /* remove 'o' from 'allgc' list */
+      o->next = g->finobj;  /* link it in 'finobj' list */
+      g->finobj = o;
+      l_setbit(o->marked, FINALIZEDBIT);
+    }
+    else
+      p = &o->next;
+  }
+}
+
 /* }====================================================== */
 
 
@@ -947,6 +1866,13 @@ static void setpause (global_State *g) {
   threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
             ? estimate * g->gcpause  /* no overflow */
             : MAX_LMEM;  /* overflow; truncate to maximum */
+  if (g->gclimit > 0) {  /* start next cycle halfway to the budget */
+    l_mem live = cast(l_mem, g->GCestimate);
+    l_mem room = (g->gclimit > g->GCestimate)
+               ? cast(l_mem, g->gclimit - g->GCestimate) / 2 : 0;
+    if (threshold > live + room)
+      threshold = live + room;
+  }
   debt = gettotalbytes(g) - threshold;
   luaE_setdebt(g, debt);
 }
@@ -995,6 +1921,7 @@ static l_mem atomic (lua_State *L) {
   /* registry and global metatables may be changed by API */
   markvalue(g, &g->l_registry);
   markmt(g);  /* mark global metatables */
+  markshapes(g, g->rootshape);  /* mark keys of shaped tables */
   /* remark occasional upvalues of (maybe) dead threads */
   remarkupvals(g);
   propagateall(g);  /* propagate changes */
@@ -1031,6 +1958,7 @@ static l_mem atomic (lua_State *L) {
 
 static lu_mem sweepstep (lua_State *L, global_State *g,
                          int nextstate, GCObject **nextlist) {
+  luaS_migrate(L, LUAI_STRMIGRATESTEP);  /* advance string-table resize */
   if (g->sweepgc) {
     l_mem olddebt = g->GCdebt;
     g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
@@ -1049,7 +1977,7 @@ static lu_mem singlestep (lua_State *L) {
   global_State *g = G(L);
   switch (g->gcstate) {
     case GCSpause: {
-      g->GCmemtrav = g->strt.size * sizeof(GCObject*);
+      g->GCmemtrav = (g->strt.size + g->strt.oldsize) * sizeof(GCObject*);
       restartcollection(g);
       g->gcstate = GCSpropagate;
       return g->GCmemtrav;
@@ -1115,9 +2043,29 @@ void luaC_runtilstate (lua_State *L, int statesmask) {
 ** get GC debt and convert it from Kb to 'work units' (avoid zero debt
 ** and overflows)
 */
-static l_mem getdebt (global_State *g) {
-  l_mem debt = g->GCdebt;
+/*
+** Step multiplier, raised as memory use approaches the budget: when
+** the room left is smaller than the live heap, use a multiplier that
+** traverses (twice) the estimated live heap before that room is used
+** up, so that cycles finish without emergency collections.
+*/
+static int getstepmul (global_State *g) {
   int stepmul = g->gcstepmul;
+  if (g->gclimit > 0) {
+    lu_mem total = gettotalbytes(g);
+    lu_mem room = (g->gclimit > total) ? g->gclimit - total : 0;
+    if (room < g->GCestimate) {
+      lu_mem need = g->GCestimate / (room / (2 * STEPMULADJ) + 1);
+      if (need > cast(lu_mem, stepmul))
+        stepmul = (need < MAX_INT) ? cast_int(need) : MAX_INT;
+    }
+  }
+  return stepmul;
+}
+
+
+static l_mem getdebt (global_State *g, int stepmul) {
+  l_mem debt = g->GCdebt;
   if (debt <= 0) return 0;  /* minimal debt */
   else {
     debt = (debt / STEPMULADJ) + 1;
@@ -1127,15 +2075,74 @@ static l_mem getdebt (global_State *g) {
 }
 
 /*
-** performs a basic GC step when collector is running
+** 'l_gcclock' gives a monotonic time in microseconds for time-budgeted
+** steps; without POSIX clocks it falls back to processor time.
 */
-void luaC_step (lua_State *L) {
+#if !defined(l_gcclock)
+
+#if defined(LUA_USE_POSIX) && defined(CLOCK_MONOTONIC)
+static lu_mem l_gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(lu_mem, ts.tv_sec) * 1000000u + cast(lu_mem, ts.tv_nsec / 1000);
+}
+#else
+#define l_gcclock()  cast(lu_mem, cast(double, clock()) * (1e6 / CLOCKS_PER_SEC))
+#endif
+
+#endif
+
+
+/*
+** Time-budgeted step, used when 'gcsteptime' is set: performs single
+** steps until the cycle ends or 'gcsteptime' microseconds have passed
+** (a single step, such as the atomic phase, is never interrupted).
+** Steps triggered by debt ('gated') are also spaced so that they take
+** at most 'gccpushare' percent of the time: one that comes too soon
+** does nothing but ask to be called again after GCSTEPSIZE more bytes
+** are allocated. Between cycles, 'gcpause' works as usual.
+*/
+static void timedstep (lua_State *L, int gated) {
   global_State *g = G(L);
-  l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
+  lu_mem start = l_gcclock();
+  lu_mem now = start;
+  if (gated && cast(l_mem, start - g->gcresume) < 0) {  /* too soon? */
+    luaE_setdebt(g, -GCSTEPSIZE);
+    return;
+  }
+  do {
+    singlestep(L);
+    now = l_gcclock();
+  } while (g->gcstate != GCSpause &&
+           now - start < cast(lu_mem, g->gcsteptime));
+  /* leave the mutator (100 - share)/share times the time just taken */
+  g->gcresume = now + (now - start) * (100 - g->gccpushare) / g->gccpushare;
+  if (g->gcstate == GCSpause)
+    setpause(g);  /* pause until next cycle */
+  else {
+    luaE_setdebt(g, -GCSTEPSIZE);
+    runafewfinalizers(L);
+  }
+}
+
+
+/*
+** performs a basic GC step when collector is running; 'explicit' tells
+** a step asked for by 'lua_gc' (which time pacing never holds back)
+** from one triggered by allocation debt
+*/
+static void step (lua_State *L, int explicit) {
+  global_State *g = G(L);
+  int stepmul = getstepmul(g);
+  l_mem debt = getdebt(g, stepmul);  /* GC deficit (be paid now) */
   if (!g->gcrunning) {  /* not running? */
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  if (g->gcsteptime > 0) {  /* pacing by time? */
+    timedstep(L, !explicit);
+    return;
+  }
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1143,13 +2150,23 @@ void luaC_step (lua_State *L) {
   if (g->gcstate == GCSpause)
     setpause(g);  /* pause until next cycle */
   else {
-    debt = (debt / g->gcstepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
+    debt = (debt / stepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
     luaE_setdebt(g, debt);
     runafewfinalizers(L);
   }
 }
 
 
+void luaC_step (lua_State *L) {
+  step(L, 0);
+}
+
+
+void luaC_explicitstep (lua_State *L) {
+  step(L, 1);
+}
+
+
 /*
 ** Performs a full GC cycle; if 'isemergency', set a flag to avoid
 ** some operations which could change the interpreter state in some
@@ -1169,6 +2186,10 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   /* finish any pending sweep phase to start a new cycle */
   luaC_runtilstate(L, bitmask(GCSpause));
   luaC_runtilstate(L, ~bitmask(GCSpause));  /* start new collection */
+  if (g->parmark != NULL) {  /* helpers available? */
+    propagateall(g);  /* whole propagate phase at once */
+    g->gcstate = GCSatomic;
+  }
   luaC_runtilstate(L, bitmask(GCScallfin));  /* run up to finalizers */
   /* estimate must be correct after a full GC cycle */
   lua_assert(g->GCestimate == gettotalbytes(g));
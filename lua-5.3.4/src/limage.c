@@ -0,0 +1,1197 @@
+/*
+** $Id: limage.c $
+** Heap images: save the heap of a state and rebuild it in another one
+** See Copyright Notice in lua.h
+*/
+
+#define limage_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include <string.h>
+
+#include "lua.h"
+
+#include "lapi.h"
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "lundump.h"
+#include "lzio.h"
+
+
+/*
+** 'lua_dumpimage' writes everything reachable from the registry and
+** from the metatables of basic types (tables, strings, prototypes,
+** closures, plain userdata) as a stream of values. 'lua_loadimage'
+** reads such a stream into another state, usually in a new process,
+** so that the state is ready without running the code that built it.
+** The loading state should have the same C libraries open (and
+** nothing else done): its registry, its globals table, and each table
+** that both registries keep under the same key other than a number
+** (package.loaded, metatables created with 'luaL_newmetatable', ...)
+** stand for their counterparts in the image, whose entries are stored
+** into them.
+**
+** Values that cannot be rebuilt from bytes are handled as follows:
+** - a C function is saved as its offset from 'lua_newstate', which
+**   stays the same for all processes running the same executable (the
+**   image header records other offsets to check that); so, all C
+**   functions must live in the same executable or library as the core;
+** - userdata with a '__gc' metamethod and light userdata must be
+**   permanents: values named in a table given to both functions
+**   (value -> name when dumping, name -> value when loading);
+** - coroutines become new, empty threads; open upvalues are saved with
+**   their current values.
+**
+** Every object gets an id when first written, in order, and later
+** occurrences are written as references to that id. A new object is
+** written as a header with what is needed to create it; its contents
+** follow later, in the order objects were first written, so that the
+** loader creates objects as soon as they are mentioned (which handles
+** cycles) and neither side recurses on nested structures.
+*/
+
+
+#define IMAGE_SIGNATURE	"\x1bLuaH"
+#define IMAGE_FORMAT	1
+
+
+/* tags of values in an image */
+#define I_NIL		0
+#define I_FALSE		1
+#define I_TRUE		2
+#define I_INT		3	/* integer: lua_Integer */
+#define I_FLT		4	/* float: lua_Number */
+#define I_LCF		5	/* light C function: offset */
+#define I_REF		6	/* object written before: id */
+#define I_PERM		7	/* permanent object: name */
+#define I_LPERM		8	/* permanent light value: name */
+#define I_STR		9	/* string: length, bytes */
+#define I_TABLE		10	/* table: array size, hash size, shaped */
+#define I_LCL		11	/* Lua closure: number of upvalues */
+#define I_CCL		12	/* C closure: number of upvalues, offset */
+#define I_PROTO		13	/* prototype */
+#define I_UDATA		14	/* userdata: length, bytes */
+#define I_THREAD	15	/* thread: whether it is the main thread */
+#define I_UPVAL		16	/* upvalue: value */
+#define I_UPREF		17	/* upvalue written before: id */
+#define I_END		18	/* end of image */
+
+/* bits of the flags of a table */
+#define IMG_FROZEN	1
+#define IMG_PERMANENT	2
+
+
+/* size of the output buffer of 'lua_dumpimage' */
+#if !defined(LUAI_IMAGEBUFF)
+#define LUAI_IMAGEBUFF		4096
+#endif
+
+
+/* C functions are saved as offsets from this one */
+#define funcoffset(f)	(cast(size_t, (f)) - cast(size_t, &lua_newstate))
+#define offsetfunc(o)	cast(lua_CFunction, cast(size_t, &lua_newstate) + (o))
+
+
+/*
+** {======================================================
+** Dump
+** =======================================================
+*/
+
+typedef struct DumpState {
+  lua_State *L;
+  lua_Writer writer;
+  void *data;
+  int status;
+  Table *perms;  /* value -> name (or NULL) */
+  Table *memo;  /* object or upvalue (as a light userdata) -> id */
+  int nobjs;  /* number of ids given to objects */
+  int nupvals;  /* number of ids given to upvalues */
+  GCObject **queue;  /* objects whose contents were not written yet */
+  int nqueue;
+  int sizequeue;
+  size_t n;  /* bytes in 'buff' */
+  char buff[LUAI_IMAGEBUFF];
+} DumpState;
+
+
+static void flushbuff (DumpState *D, const void *b, size_t size) {
+  if (D->status == 0 && size > 0) {
+    lua_unlock(D->L);
+    D->status = (*D->writer)(D->L, b, size, D->data);
+    lua_lock(D->L);
+  }
+}
+
+
+static void dumpblock (DumpState *D, const void *b, size_t size) {
+  if (D->n + size > sizeof(D->buff)) {  /* no room in the buffer? */
+    flushbuff(D, D->buff, D->n);
+    D->n = 0;
+    if (size > sizeof(D->buff)) {  /* block larger than the buffer? */
+      flushbuff(D, b, size);  /* write it directly */
+      return;
+    }
+  }
+  memcpy(D->buff + D->n, b, size);
+  D->n += size;
+}
+
+
+#define dumpvector(D,v,n)	dumpblock(D,v,(n)*sizeof((v)[0]))
+
+#define dumpvar(D,x)		dumpvector(D,&x,1)
+
+
+static void dumpbyte (DumpState *D, int y) {
+  lu_byte x = cast_byte(y);
+  dumpvar(D, x);
+}
+
+
+static void dumpint (DumpState *D, int x) {
+  dumpvar(D, x);
+}
+
+
+static void dumpsize (DumpState *D, size_t x) {
+  dumpvar(D, x);
+}
+
+
+/*
+** Returns the entry of 'p' in 'memo' (nil if 'p' has no id yet). The
+** entry must be set before anything else is added to 'memo'.
+*/
+static TValue *memoslot (DumpState *D, void *p) {
+  TValue k;
+  setpvalue(&k, p);
+  return luaH_set(D->L, D->memo, &k);
+}
+
+
+static void enqueue (DumpState *D, GCObject *o) {
+  luaM_growvector(D->L, D->queue, D->nqueue, D->sizequeue, GCObject *,
+                  MAX_INT, "image objects");
+  D->queue[D->nqueue++] = o;
+}
+
+
+static void dumpvalue (DumpState *D, const TValue *o);
+
+
+/*
+** If value 'o' is a permanent, write its name (with tag 'tag') and
+** return true.
+*/
+static int dumpperm (DumpState *D, const TValue *o, int tag) {
+  const TValue *name;
+  if (D->perms == NULL || ttisnil(name = luaH_get(D->perms, o)))
+    return 0;
+  else if (!ttisstring(name))
+    luaG_runerror(D->L, "name of permanent %s is not a string",
+                        ttypename(ttnov(o)));
+  dumpbyte(D, tag);
+  dumpvalue(D, name);
+  return 1;
+}
+
+
+static void dumptableheader (DumpState *D, Table *h) {
+  unsigned int nh = 0;
+  if (isshaped(h))
+    nh = cast(unsigned int, h->shape->nkeys);
+  else if (!isdummy(h)) {  /* count entries in the hash part */
+    Node *n;
+    for (n = gnode(h, 0); n < gnode(h, sizenode(h)); n++)
+      if (!ttisnil(gval(n))) nh++;
+    if (h->oldnode != NULL) {
+      for (n = h->oldnode; n < h->oldnode + sizeoldnode(h); n++)
+        if (!ttisnil(gval(n))) nh++;
+    }
+  }
+  dumpbyte(D, I_TABLE);
+  dumpvar(D, h->sizearray);
+  dumpvar(D, nh);
+  dumpbyte(D, isshaped(h));
+}
+
+
+/*
+** Write collectable object 'o': a reference if it already has an id;
+** otherwise its header (and, for a permanent, its name).
+*/
+static void dumpobject (DumpState *D, GCObject *o) {
+  lua_State *L = D->L;
+  TValue *slot = memoslot(D, o);
+  if (!ttisnil(slot)) {  /* written before? */
+    dumpbyte(D, I_REF);
+    dumpint(D, cast_int(ivalue(slot)));
+    return;
+  }
+  setivalue(slot, D->nobjs++);
+  if (o->tt != LUA_TSHRSTR && o->tt != LUA_TLNGSTR && o->tt != LUA_TPROTO) {
+    TValue v;
+    setgcovalue(L, &v, o);
+    if (dumpperm(D, &v, I_PERM))
+      return;
+  }
+  switch (o->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR: {
+      TString *ts = gco2ts(o);
+      size_t len = tsslen(ts);
+      dumpbyte(D, I_STR);
+      dumpsize(D, len);
+      dumpblock(D, getstr(ts), len);
+      return;  /* no contents */
+    }
+    case LUA_TTABLE: {
+      dumptableheader(D, gco2t(o));
+      break;
+    }
+    case LUA_TLCL: {
+      dumpbyte(D, I_LCL);
+      dumpbyte(D, gco2lcl(o)->nupvalues);
+      break;
+    }
+    case LUA_TCCL: {
+      size_t off = funcoffset(gco2ccl(o)->f);
+      dumpbyte(D, I_CCL);
+      dumpbyte(D, gco2ccl(o)->nupvalues);
+      dumpsize(D, off);
+      break;
+    }
+    case LUA_TPROTO: {
+      dumpbyte(D, I_PROTO);
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      if (gfasttm(G(L), u->metatable, TM_GC) != NULL)
+        luaG_runerror(L, "cannot dump userdata with a finalizer "
+                         "(not a permanent)");
+      dumpbyte(D, I_UDATA);
+      dumpsize(D, u->len);
+      dumpblock(D, getudatamem(u), u->len);
+      break;
+    }
+    case LUA_TTHREAD: {
+      dumpbyte(D, I_THREAD);
+      dumpbyte(D, gco2th(o) == G(L)->mainthread);
+      return;  /* no contents */
+    }
+    default: lua_assert(0); return;
+  }
+  enqueue(D, o);
+}
+
+
+static void dumpvalue (DumpState *D, const TValue *o) {
+  switch (ttype(o)) {
+    case LUA_TNIL:
+      dumpbyte(D, I_NIL);
+      break;
+    case LUA_TBOOLEAN:
+      dumpbyte(D, bvalue(o) ? I_TRUE : I_FALSE);
+      break;
+    case LUA_TNUMINT: {
+      lua_Integer i = ivalue(o);
+      dumpbyte(D, I_INT);
+      dumpvar(D, i);
+      break;
+    }
+    case LUA_TNUMFLT: {
+      lua_Number n = fltvalue(o);
+      dumpbyte(D, I_FLT);
+      dumpvar(D, n);
+      break;
+    }
+    case LUA_TLCF: {
+      if (!dumpperm(D, o, I_LPERM)) {
+        size_t off = funcoffset(fvalue(o));
+        dumpbyte(D, I_LCF);
+        dumpsize(D, off);
+      }
+      break;
+    }
+    case LUA_TLIGHTUSERDATA: {
+      if (!dumpperm(D, o, I_LPERM))
+        luaG_runerror(D->L, "cannot dump light userdata (not a permanent)");
+      break;
+    }
+    default:
+      dumpobject(D, gcvalue(o));
+      break;
+  }
+}
+
+
+static void dumpstring (DumpState *D, TString *ts) {
+  if (ts == NULL)
+    dumpbyte(D, I_NIL);
+  else
+    dumpobject(D, obj2gco(ts));
+}
+
+
+static void dumpmetatable (DumpState *D, Table *mt) {
+  if (mt == NULL)
+    dumpbyte(D, I_NIL);
+  else
+    dumpobject(D, obj2gco(mt));
+}
+
+
+/*
+** Contents of a table: flags, metatable, array part, slots of a
+** shaped table (keys in slot order, with nil values), and the pairs of
+** its hash part, ended by a nil key.
+*/
+static void dumptable (DumpState *D, Table *h) {
+  unsigned int i;
+  int v;
+  /* after 'luaC_runtilstate', only objects in 'fixedgc' are not white */
+  dumpbyte(D, (isfrozen(h) ? IMG_FROZEN : 0) |
+              (iswhite(h) ? 0 : IMG_PERMANENT));
+  dumpmetatable(D, h->metatable);
+  dumpvar(D, h->sizearray);
+  for (i = 0; i < h->sizearray; i++)
+    dumpvalue(D, &h->array[i]);
+  dumpint(D, isshaped(h) ? h->shape->nkeys : 0);
+  if (isshaped(h)) {
+    for (i = 0; cast_int(i) < h->shape->nkeys; i++) {
+      dumpobject(D, obj2gco(h->shape->keys[i]));
+      dumpvalue(D, &h->slots[i]);
+    }
+  }
+  for (v = 0; v < 2; v++) {  /* hash part and old hash part */
+    Node *n, *limit;
+    if (v == 0) {
+      n = gnode(h, 0); limit = gnode(h, sizenode(h));
+    }
+    else if (h->oldnode != NULL) {
+      n = h->oldnode; limit = h->oldnode + sizeoldnode(h);
+    }
+    else break;
+    for (; n < limit; n++) {
+      if (!ttisnil(gval(n))) {
+        TValue k;
+        setobj(D->L, &k, gkey(n));
+        dumpvalue(D, &k);
+        dumpvalue(D, gval(n));
+      }
+    }
+  }
+  dumpbyte(D, I_NIL);
+}
+
+
+static void dumpproto (DumpState *D, Proto *f) {
+  int i;
+  dumpbyte(D, f->numparams);
+  dumpbyte(D, f->is_vararg);
+  dumpbyte(D, f->maxstacksize);
+  dumpint(D, f->linedefined);
+  dumpint(D, f->lastlinedefined);
+  dumpstring(D, f->source);
+  dumpint(D, f->sizecode);
+  dumpvector(D, f->code, f->sizecode);
+  dumpint(D, f->sizek);
+  for (i = 0; i < f->sizek; i++)
+    dumpvalue(D, &f->k[i]);
+  dumpint(D, f->sizeupvalues);
+  for (i = 0; i < f->sizeupvalues; i++) {
+    dumpbyte(D, f->upvalues[i].instack);
+    dumpbyte(D, f->upvalues[i].idx);
+    dumpstring(D, f->upvalues[i].name);
+  }
+  dumpint(D, f->sizep);
+  for (i = 0; i < f->sizep; i++)
+    dumpobject(D, obj2gco(f->p[i]));
+  dumpint(D, f->sizelineinfo);
+  dumpvector(D, f->lineinfo, f->sizelineinfo);
+  dumpint(D, f->sizelocvars);
+  for (i = 0; i < f->sizelocvars; i++) {
+    dumpstring(D, f->locvars[i].varname);
+    dumpint(D, f->locvars[i].startpc);
+    dumpint(D, f->locvars[i].endpc);
+  }
+}
+
+
+/*
+** Contents of a Lua closure: its prototype and its upvalues. Each
+** upvalue gets an id, so that upvalues shared by closures stay shared.
+*/
+static void dumpLclosure (DumpState *D, LClosure *cl) {
+  int i;
+  dumpobject(D, obj2gco(cl->p));
+  for (i = 0; i < cl->nupvalues; i++) {
+    UpVal *uv = cl->upvals[i];
+    TValue *slot;
+    if (uv == NULL) {
+      dumpbyte(D, I_NIL);
+      continue;
+    }
+    slot = memoslot(D, uv);
+    if (!ttisnil(slot)) {  /* written before? */
+      dumpbyte(D, I_UPREF);
+      dumpint(D, cast_int(ivalue(slot)));
+    }
+    else {
+      setivalue(slot, D->nupvals++);
+      dumpbyte(D, I_UPVAL);
+      dumpvalue(D, uv->v);
+    }
+  }
+}
+
+
+static void dumpcontents (DumpState *D, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      dumptable(D, gco2t(o));
+      break;
+    }
+    case LUA_TLCL: {
+      dumpLclosure(D, gco2lcl(o));
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      int i;
+      for (i = 0; i < cl->nupvalues; i++)
+        dumpvalue(D, &cl->upvalue[i]);
+      break;
+    }
+    case LUA_TPROTO: {
+      dumpproto(D, gco2p(o));
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      TValue uv;
+      dumpmetatable(D, u->metatable);
+      getuservalue(D->L, u, &uv);
+      dumpvalue(D, &uv);
+      break;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+static void dumpheader (DumpState *D) {
+  lua_Integer i = LUAC_INT;
+  lua_Number n = LUAC_NUM;
+  dumpblock(D, IMAGE_SIGNATURE, sizeof(IMAGE_SIGNATURE) - sizeof(char));
+  dumpbyte(D, LUAC_VERSION);
+  dumpbyte(D, IMAGE_FORMAT);
+  dumpbyte(D, sizeof(int));
+  dumpbyte(D, sizeof(size_t));
+  dumpbyte(D, sizeof(Instruction));
+  dumpbyte(D, sizeof(TValue));
+  dumpvar(D, i);
+  dumpvar(D, n);
+  dumpsize(D, funcoffset(&lua_close));
+  dumpsize(D, funcoffset(&luaH_new));
+}
+
+
+/*
+** Number of objects in the heap (strings included): an estimate of
+** the number of entries in 'memo'.
+*/
+static int countobjects (global_State *g) {
+  int n = g->strt.nuse;
+  GCObject *o;
+  for (o = g->allgc; o != NULL && n < MAX_INT / 2; o = o->next) n++;
+  for (o = g->finobj; o != NULL && n < MAX_INT / 2; o = o->next) n++;
+  return n;
+}
+
+
+static void dumpimage (lua_State *L, void *ud) {
+  DumpState *D = cast(DumpState *, ud);
+  global_State *g = G(L);
+  int i, next;
+  luaD_checkstack(L, 1);
+  D->memo = luaH_new(L);
+  sethvalue2s(L, L->top, D->memo);  /* anchor it */
+  L->top++;
+  luaH_resize(L, D->memo, 0, countobjects(g));
+  dumpheader(D);
+  dumpobject(D, gcvalue(&g->l_registry));  /* object 0 */
+  for (i = 0; i < LUA_NUMTAGS; i++)
+    dumpmetatable(D, g->mt[i]);
+  for (next = 0; next < D->nqueue; next++)
+    dumpcontents(D, D->queue[next]);
+  dumpbyte(D, I_END);
+  flushbuff(D, D->buff, D->n);
+  D->n = 0;
+  L->top--;  /* remove 'memo' */
+}
+
+
+/*
+** Dump the heap of 'L' with the permanents (a table or nil) at the top
+** of the stack; the table stays there. Raises an error for values that
+** cannot be dumped; otherwise, returns the status of the writer.
+*/
+LUA_API int lua_dumpimage (lua_State *L, lua_Writer writer, void *data) {
+  global_State *g = G(L);
+  DumpState D;
+  StkId o;
+  lu_byte running, stopem;
+  int status;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  o = L->top - 1;
+  api_check(L, ttistable(o) || ttisnil(o), "table expected");
+  D.L = L;
+  D.writer = writer;
+  D.data = data;
+  D.status = 0;
+  D.perms = ttistable(o) ? hvalue(o) : NULL;
+  D.memo = NULL;
+  D.nobjs = D.nupvals = 0;
+  D.queue = NULL;
+  D.nqueue = D.sizequeue = 0;
+  D.n = 0;
+  luaC_runtilstate(L, bitmask(GCSpause));  /* finish current cycle */
+  running = g->gcrunning;
+  stopem = g->gcstopem;
+  g->gcrunning = 0;  /* objects in 'queue' are not anchored */
+  g->gcstopem = 1;
+  status = luaD_rawrunprotected(L, dumpimage, &D);
+  g->gcrunning = running;
+  g->gcstopem = stopem;
+  luaM_freearray(L, D.queue, D.sizequeue);
+  if (status != LUA_OK)
+    luaD_throw(L, status);  /* error object is on the top */
+  lua_unlock(L);
+  return D.status;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Load
+** =======================================================
+*/
+
+typedef struct LoadState {
+  lua_State *L;
+  ZIO *Z;
+  Table *perms;  /* name -> value (or NULL) */
+  Table *premap;  /* existing table standing for the next new table */
+  GCObject **objs;  /* objects by id */
+  int nobjs;
+  int sizeobjs;
+  UpVal **upvals;  /* upvalues by id */
+  int nupvals;
+  int sizeupvals;
+  GCObject **queue;  /* objects whose contents were not read yet */
+  int nqueue;
+  int sizequeue;
+  Table **fixed;  /* permanent tables (see 'lua_freeze') */
+  int nfixed;
+  int sizefixed;
+  GCObject *last;  /* newest object in 'allgc' before loading */
+  int hasgc;  /* may some new object need a finalizer? */
+} LoadState;
+
+
+static l_noret error (LoadState *S, const char *why) {
+  luaO_pushfstring(S->L, "bad heap image (%s)", why);
+  luaD_throw(S->L, LUA_ERRSYNTAX);
+}
+
+
+#define loadvector(S,b,n)	loadblock(S,b,(n)*sizeof((b)[0]))
+
+static void loadblock (LoadState *S, void *b, size_t size) {
+  ZIO *z = S->Z;
+  if (z->n >= size) {  /* common case: all bytes in the buffer */
+    memcpy(b, z->p, size);
+    z->p += size;
+    z->n -= size;
+  }
+  else if (luaZ_read(z, b, size) != 0)
+    error(S, "truncated");
+}
+
+
+#define loadvar(S,x)		loadvector(S,&x,1)
+
+
+static lu_byte loadbyte (LoadState *S) {
+  int b = zgetc(S->Z);
+  if (b == EOZ)
+    error(S, "truncated");
+  return cast_byte(b);
+}
+
+
+static int loadint (LoadState *S) {
+  int x;
+  loadvar(S, x);
+  return x;
+}
+
+
+/* a non-negative count */
+static int loadsize (LoadState *S) {
+  int x = loadint(S);
+  if (x < 0)
+    error(S, "bad size");
+  return x;
+}
+
+
+static size_t loadsizet (LoadState *S) {
+  size_t x;
+  loadvar(S, x);
+  return x;
+}
+
+
+/*
+** Give the next id to 'o' (NULL while it is not created yet; it must
+** be set before anything else gets an id).
+*/
+static int newid (LoadState *S, GCObject *o) {
+  luaM_growvector(S->L, S->objs, S->nobjs, S->sizeobjs, GCObject *,
+                  MAX_INT, "image objects");
+  S->objs[S->nobjs] = o;
+  return S->nobjs++;
+}
+
+
+static void addqueue (LoadState *S, GCObject *o) {
+  luaM_growvector(S->L, S->queue, S->nqueue, S->sizequeue, GCObject *,
+                  MAX_INT, "image objects");
+  S->queue[S->nqueue++] = o;
+}
+
+
+static TString *loadstr (LoadState *S) {
+  lua_State *L = S->L;
+  ZIO *z = S->Z;
+  size_t len = loadsizet(S);
+  TString *ts;
+  if (len > 0 && z->n >= len) {  /* whole string in the buffer? */
+    ts = luaS_newlstr(L, z->p, len);  /* create it from there */
+    z->p += len;
+    z->n -= len;
+  }
+  else if (len <= LUAI_MAXSHORTLEN) {
+    char buff[LUAI_MAXSHORTLEN];
+    loadvector(S, buff, len);
+    ts = luaS_newlstr(L, buff, len);
+  }
+  else {  /* long string */
+    ts = luaS_createlngstrobj(L, len);
+    loadvector(S, getstr(ts), len);  /* load directly in final place */
+  }
+  return ts;
+}
+
+
+static void loadvalue (LoadState *S, TValue *o);
+
+
+/*
+** Resolve the name that follows into the value of a permanent
+*/
+static void loadperm (LoadState *S, TValue *o) {
+  TValue name;
+  const TValue *v = luaO_nilobject;
+  loadvalue(S, &name);
+  if (!ttisstring(&name))
+    error(S, "bad permanent name");
+  if (S->perms != NULL)
+    v = luaH_get(S->perms, &name);
+  if (ttisnil(v)) {
+    luaO_pushfstring(S->L, "heap image refers to unknown permanent '%s'",
+                           svalue(&name));
+    luaD_throw(S->L, LUA_ERRSYNTAX);
+  }
+  if (ttistable(v))  /* may be a metatable with a '__gc' field */
+    S->hasgc = 1;
+  setobj(S->L, o, v);
+}
+
+
+static void loadtableheader (LoadState *S, TValue *o, int id) {
+  lua_State *L = S->L;
+  unsigned int na, nh;
+  int shaped;
+  Table *t;
+  loadvar(S, na);
+  loadvar(S, nh);
+  shaped = loadbyte(S);
+  if (S->premap != NULL) {  /* stands for an existing table? */
+    t = S->premap;
+    S->premap = NULL;
+    S->objs[id] = obj2gco(t);
+  }
+  else {
+    t = luaH_newsized(L, na, nh, shaped);
+    S->objs[id] = obj2gco(t);
+    if (shaped)
+      luaH_presize(L, t, na, nh);
+    else
+      luaH_resize(L, t, na, nh);
+  }
+  sethvalue(L, o, t);
+}
+
+
+/*
+** Read the header of a new object (with tag 'tag') and create it
+*/
+static void loadobject (LoadState *S, int tag, TValue *o) {
+  lua_State *L = S->L;
+  int id = newid(S, NULL);
+  switch (tag) {
+    case I_PERM: {
+      loadperm(S, o);
+      if (!iscollectable(o))
+        error(S, "bad permanent");
+      S->objs[id] = gcvalue(o);
+      return;  /* no contents */
+    }
+    case I_STR: {
+      TString *ts = loadstr(S);
+      S->objs[id] = obj2gco(ts);
+      setsvalue(L, o, ts);
+      return;  /* no contents */
+    }
+    case I_TABLE: {
+      loadtableheader(S, o, id);
+      break;
+    }
+    case I_LCL: {
+      LClosure *cl = luaF_newLclosure(L, loadbyte(S));
+      S->objs[id] = obj2gco(cl);
+      setclLvalue(L, o, cl);
+      break;
+    }
+    case I_CCL: {
+      int n = loadbyte(S);
+      size_t off = loadsizet(S);
+      CClosure *cl = luaF_newCclosure(L, n);
+      cl->f = offsetfunc(off);
+      S->objs[id] = obj2gco(cl);
+      setclCvalue(L, o, cl);
+      break;
+    }
+    case I_PROTO: {
+      Proto *f = luaF_newproto(L);
+      S->objs[id] = obj2gco(f);
+      setgcovalue(L, o, obj2gco(f));
+      break;
+    }
+    case I_UDATA: {
+      size_t len = loadsizet(S);
+      Udata *u = luaS_newudata(L, len);
+      S->objs[id] = obj2gco(u);
+      loadblock(S, getudatamem(u), len);
+      setuvalue(L, o, u);
+      break;
+    }
+    case I_THREAD: {
+      if (loadbyte(S)) {  /* main thread? */
+        setthvalue(L, o, G(L)->mainthread);
+      }
+      else {  /* coroutines are not saved */
+        lua_newthread(L);
+        setobj(L, o, L->top - 1);
+        L->top--;
+      }
+      S->objs[id] = gcvalue(o);
+      return;  /* no contents */
+    }
+    default: error(S, "bad tag");
+  }
+  addqueue(S, gcvalue(o));
+}
+
+
+static void loadvalue (LoadState *S, TValue *o) {
+  int tag = loadbyte(S);
+  switch (tag) {
+    case I_NIL:
+      setnilvalue(o);
+      break;
+    case I_FALSE: case I_TRUE:
+      setbvalue(o, tag == I_TRUE);
+      break;
+    case I_INT: {
+      lua_Integer i;
+      loadvar(S, i);
+      setivalue(o, i);
+      break;
+    }
+    case I_FLT: {
+      lua_Number n;
+      loadvar(S, n);
+      setfltvalue(o, n);
+      break;
+    }
+    case I_LCF: {
+      size_t off = loadsizet(S);
+      setfvalue(o, offsetfunc(off));
+      break;
+    }
+    case I_REF: {
+      int id = loadint(S);
+      if (id < 0 || id >= S->nobjs || S->objs[id] == NULL)
+        error(S, "bad reference");
+      setgcovalue(S->L, o, S->objs[id]);
+      break;
+    }
+    case I_LPERM: {
+      loadperm(S, o);
+      if (iscollectable(o))
+        error(S, "bad permanent");
+      break;
+    }
+    default:
+      loadobject(S, tag, o);
+      break;
+  }
+}
+
+
+static TString *loadstring (LoadState *S) {
+  TValue v;
+  loadvalue(S, &v);
+  if (ttisnil(&v))
+    return NULL;
+  else if (!ttisstring(&v))
+    error(S, "string expected");
+  return tsvalue(&v);
+}
+
+
+static Table *loadmetatable (LoadState *S) {
+  TValue v;
+  loadvalue(S, &v);
+  if (ttisnil(&v))
+    return NULL;
+  else if (!ttistable(&v))
+    error(S, "table expected");
+  return hvalue(&v);
+}
+
+
+/*
+** Set the entry for the key that the registry 'reg' of the loading
+** state has in 'k' as the table the next new table stands for.
+*/
+static void premap (LoadState *S, Table *reg, const TValue *k) {
+  const TValue *old = luaH_get(reg, k);
+  S->premap = ttistable(old) ? hvalue(old) : NULL;
+}
+
+
+/* strings are internalized, so '__gc' keys are found by address */
+#define isgckey(L,k)  \
+	(ttisshrstring(k) && tsvalue(k) == G(L)->tmname[TM_GC])
+
+
+static void loadtable (LoadState *S, Table *t) {
+  lua_State *L = S->L;
+  Table *reg = (t == hvalue(&G(L)->l_registry)) ? t : NULL;
+  int flags = loadbyte(S);
+  unsigned int na, i;
+  int ns, j;
+  TValue k, v;
+  t->metatable = loadmetatable(S);
+  loadvar(S, na);
+  for (i = 1; i <= na; i++) {
+    if (reg && i == LUA_RIDX_GLOBALS) {
+      setivalue(&k, i);
+      premap(S, reg, &k);
+    }
+    loadvalue(S, &v);
+    S->premap = NULL;
+    if (!ttisnil(&v))
+      luaH_setint(L, t, i, &v);
+  }
+  ns = loadsize(S);
+  for (j = 0; j < ns; j++) {  /* slots of a shaped table */
+    TValue *slot;
+    loadvalue(S, &k);
+    loadvalue(S, &v);
+    if (isgckey(L, &k)) S->hasgc = 1;
+    slot = luaH_set(L, t, &k);
+    setobj2t(L, slot, &v);
+  }
+  for (;;) {
+    loadvalue(S, &k);
+    if (ttisnil(&k)) break;
+    if (reg && !ttisnumber(&k))
+      premap(S, reg, &k);
+    else if (isgckey(L, &k))
+      S->hasgc = 1;
+    loadvalue(S, &v);
+    S->premap = NULL;
+    setobj2t(L, luaH_set(L, t, &k), &v);
+  }
+  invalidateTMcache(t);
+  if (flags & IMG_PERMANENT) {
+    luaM_growvector(L, S->fixed, S->nfixed, S->sizefixed, Table *,
+                    MAX_INT, "image objects");
+    S->fixed[S->nfixed++] = t;
+  }
+  if (flags & IMG_FROZEN)
+    t->frozen = 1;
+}
+
+
+static Proto *checkproto (LoadState *S, const TValue *v) {
+  if (!iscollectable(v) || gcvalue(v)->tt != LUA_TPROTO)
+    error(S, "prototype expected");
+  return gco2p(gcvalue(v));
+}
+
+
+static void loadproto (LoadState *S, Proto *f) {
+  lua_State *L = S->L;
+  int i, n;
+  f->numparams = loadbyte(S);
+  f->is_vararg = loadbyte(S);
+  f->maxstacksize = loadbyte(S);
+  f->linedefined = loadint(S);
+  f->lastlinedefined = loadint(S);
+  f->source = loadstring(S);
+  n = loadsize(S);
+  f->code = luaM_newvector(L, n, Instruction);
+  f->sizecode = n;
+  loadvector(S, f->code, n);
+  n = loadsize(S);
+  f->k = luaM_newvector(L, n, TValue);
+  f->sizek = n;
+  for (i = 0; i < n; i++)
+    setnilvalue(&f->k[i]);
+  for (i = 0; i < n; i++)
+    loadvalue(S, &f->k[i]);
+  n = loadsize(S);
+  f->upvalues = luaM_newvector(L, n, Upvaldesc);
+  f->sizeupvalues = n;
+  for (i = 0; i < n; i++)
+    f->upvalues[i].name = NULL;
+  for (i = 0; i < n; i++) {
+    f->upvalues[i].instack = loadbyte(S);
+    f->upvalues[i].idx = loadbyte(S);
+    f->upvalues[i].name = loadstring(S);
+  }
+  n = loadsize(S);
+  f->p = luaM_newvector(L, n, Proto *);
+  f->sizep = n;
+  for (i = 0; i < n; i++)
+    f->p[i] = NULL;
+  for (i = 0; i < n; i++) {
+    TValue v;
+    loadvalue(S, &v);
+    f->p[i] = checkproto(S, &v);
+  }
+  n = loadsize(S);
+  f->lineinfo = luaM_newvector(L, n, int);
+  f->sizelineinfo = n;
+  loadvector(S, f->lineinfo, n);
+  n = loadsize(S);
+  f->locvars = luaM_newvector(L, n, LocVar);
+  f->sizelocvars = n;
+  for (i = 0; i < n; i++)
+    f->locvars[i].varname = NULL;
+  for (i = 0; i < n; i++) {
+    f->locvars[i].varname = loadstring(S);
+    f->locvars[i].startpc = loadint(S);
+    f->locvars[i].endpc = loadint(S);
+  }
+}
+
+
+static void loadLclosure (LoadState *S, LClosure *cl) {
+  lua_State *L = S->L;
+  TValue v;
+  int i;
+  loadvalue(S, &v);
+  cl->p = checkproto(S, &v);
+  for (i = 0; i < cl->nupvalues; i++) {
+    int tag = loadbyte(S);
+    if (tag == I_UPVAL) {
+      UpVal *uv;
+      luaM_growvector(L, S->upvals, S->nupvals, S->sizeupvals, UpVal *,
+                      MAX_INT, "image upvalues");
+      uv = luaM_new(L, UpVal);
+      uv->refcount = 1;
+      uv->v = &uv->u.value;  /* always closed */
+      setnilvalue(uv->v);
+      cl->upvals[i] = uv;  /* (freed with 'cl' if load fails) */
+      S->upvals[S->nupvals++] = uv;
+      loadvalue(S, uv->v);
+    }
+    else if (tag == I_UPREF) {
+      int id = loadint(S);
+      if (id < 0 || id >= S->nupvals)
+        error(S, "bad reference");
+      cl->upvals[i] = S->upvals[id];
+      cl->upvals[i]->refcount++;
+    }
+    else if (tag != I_NIL)
+      error(S, "bad upvalue");
+  }
+}
+
+
+static void loadcontents (LoadState *S, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      loadtable(S, gco2t(o));
+      break;
+    }
+    case LUA_TLCL: {
+      loadLclosure(S, gco2lcl(o));
+      break;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      int i;
+      for (i = 0; i < cl->nupvalues; i++)
+        loadvalue(S, &cl->upvalue[i]);
+      break;
+    }
+    case LUA_TPROTO: {
+      loadproto(S, gco2p(o));
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      TValue uv;
+      u->metatable = loadmetatable(S);
+      loadvalue(S, &uv);
+      setuservalue(S->L, u, &uv);
+      break;
+    }
+    default: lua_assert(0);
+  }
+}
+
+
+static void checkheader (LoadState *S) {
+  char sig[sizeof(IMAGE_SIGNATURE) - sizeof(char)];
+  lua_Integer i;
+  lua_Number n;
+  loadblock(S, sig, sizeof(sig));
+  if (memcmp(sig, IMAGE_SIGNATURE, sizeof(sig)) != 0)
+    error(S, "not a heap image");
+  if (loadbyte(S) != LUAC_VERSION || loadbyte(S) != IMAGE_FORMAT)
+    error(S, "version mismatch");
+  if (loadbyte(S) != sizeof(int) || loadbyte(S) != sizeof(size_t) ||
+      loadbyte(S) != sizeof(Instruction) || loadbyte(S) != sizeof(TValue))
+    error(S, "format mismatch");
+  loadvar(S, i);
+  loadvar(S, n);
+  if (i != LUAC_INT || n != LUAC_NUM)
+    error(S, "format mismatch");
+  if (loadsizet(S) != funcoffset(&lua_close) ||
+      loadsizet(S) != funcoffset(&luaH_new))
+    error(S, "made by another executable");
+}
+
+
+static void loadimage (lua_State *L, void *ud) {
+  LoadState *S = cast(LoadState *, ud);
+  global_State *g = G(L);
+  TValue v;
+  int i, next;
+  checkheader(S);
+  if (loadbyte(S) != I_TABLE)
+    error(S, "bad registry");
+  S->premap = hvalue(&g->l_registry);
+  loadtableheader(S, &v, newid(S, NULL));
+  addqueue(S, gcvalue(&v));
+  for (i = 0; i < LUA_NUMTAGS; i++)
+    g->mt[i] = loadmetatable(S);
+  for (next = 0; next < S->nqueue; next++)
+    loadcontents(S, S->queue[next]);
+  if (loadbyte(S) != I_END)
+    error(S, "bad end");
+  if (S->hasgc)  /* some new object may need a finalizer? */
+    luaC_checkfinalizers(L, S->last);
+  for (i = 0; i < S->nfixed; i++) {
+    if (iswhite(S->fixed[i]))  /* not fixed with another one yet? */
+      luaC_fixgraph(L, S->fixed[i]);
+  }
+}
+
+
+/*
+** Load a heap image into 'L', with the permanents (a table or nil) at
+** the top of the stack; the table stays there. Returns a status code
+** and, on errors, pushes a message (and the state may hold part of
+** the image; it should be closed).
+*/
+LUA_API int lua_loadimage (lua_State *L, lua_Reader reader, void *data) {
+  global_State *g = G(L);
+  LoadState S;
+  ZIO z;
+  StkId o;
+  lu_byte running, stopem;
+  int status;
+  lua_lock(L);
+  api_checknelems(L, 1);
+  o = L->top - 1;
+  api_check(L, ttistable(o) || ttisnil(o), "table expected");
+  luaZ_init(L, &z, reader, data);
+  S.L = L;
+  S.Z = &z;
+  S.perms = ttistable(o) ? hvalue(o) : NULL;
+  S.premap = NULL;
+  S.objs = NULL;
+  S.nobjs = S.sizeobjs = 0;
+  S.upvals = NULL;
+  S.nupvals = S.sizeupvals = 0;
+  S.queue = NULL;
+  S.nqueue = S.sizequeue = 0;
+  S.fixed = NULL;
+  S.nfixed = S.sizefixed = 0;
+  /* with no cycle under way, no barriers are needed for old objects */
+  luaC_runtilstate(L, bitmask(GCSpause));
+  S.last = g->allgc;
+  S.hasgc = 0;
+  running = g->gcrunning;
+  stopem = g->gcstopem;
+  g->gcrunning = 0;  /* new objects are not anchored until the end */
+  g->gcstopem = 1;
+  status = luaD_pcall(L, loadimage, &S, savestack(L, L->top), L->errfunc);
+  g->gcrunning = running;
+  g->gcstopem = stopem;
+  luaM_freearray(L, S.objs, S.sizeobjs);
+  luaM_freearray(L, S.upvals, S.sizeupvals);
+  luaM_freearray(L, S.queue, S.sizequeue);
+  luaM_freearray(L, S.fixed, S.sizefixed);
+  lua_unlock(L);
+  return status;
+}
+
+/* }====================================================== */
+
@@ -52,8 +52,14 @@ static const luaL_Reg loadedlibs[] = {
   {LUA_MATHLIBNAME, luaopen_math},
   {LUA_UTF8LIBNAME, luaopen_utf8},
   {LUA_DBLIBNAME, luaopen_debug},
+  {LUA_SERLIBNAME, luaopen_serialize},
+  {LUA_ARRAYLIBNAME, luaopen_array},
 #if defined(LUA_COMPAT_BITLIB)
   {LUA_BITLIBNAME, luaopen_bit32},
+#endif
+#if defined(LUA_USE_LINUX)
+  {LUA_EVLIBNAME, luaopen_event},
+  {LUA_THREADLIBNAME, luaopen_threadpool},
 #endif
   {NULL, NULL}
 };
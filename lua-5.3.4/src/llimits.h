@@ -191,6 +191,16 @@ typedef unsigned long Instruction;
 #endif
 
 
+/*
+** Number of buckets of the old string table moved to the new one at
+** each string creation (and at each sweep step of the collector)
+** while the table is being resized
+*/
+#if !defined(LUAI_STRMIGRATESTEP)
+#define LUAI_STRMIGRATESTEP	4
+#endif
+
+
 /*
 ** Size of cache for strings in the API. 'N' is the number of
 ** sets (better be a prime) and "M" is the size of each set (M == 1
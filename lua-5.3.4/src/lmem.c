@@ -77,6 +77,22 @@ l_noret luaM_toobig (lua_State *L) {
 
 
 
+/*
+** Memory budget: an allocation that would take the state over
+** 'gclimit' first runs an emergency collection; if that does not free
+** enough, it fails as if the allocator had refused it. Allocations
+** made by the collector itself ('gcstopem') are not checked.
+*/
+static int withinlimit (lua_State *L, size_t delta) {
+  global_State *g = G(L);
+  if (gettotalbytes(g) + delta <= g->gclimit || g->gcstopem)
+    return 1;
+  if (g->version)  /* is state fully built? */
+    luaC_fullgc(L, 1);  /* try to free some memory... */
+  return (gettotalbytes(g) + delta <= g->gclimit);
+}
+
+
 /*
 ** generic allocation routine.
 */
@@ -90,12 +106,15 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   if (nsize > realosize && g->gcrunning)
     luaC_fullgc(L, 1);  /* force a GC whenever possible */
 #endif
+  if (nsize > realosize && g->gclimit > 0 &&
+      !withinlimit(L, nsize - realosize))
+    luaD_throw(L, LUA_ERRMEM);  /* over the memory budget */
   /*实际调用l_alloc，分配nsize大小的内存块，释放老的内存块*/
   newblock = (*g->frealloc)(g->ud, block, osize, nsize);
   /*分配失败*/
   if (newblock == NULL && nsize > 0) {
     lua_assert(nsize > realosize);  /* cannot fail when shrinking a block */
-    if (g->version) {  /* is state fully built? */
+    if (g->version && !g->gcstopem) {  /* can collect? */
 	  /*垃圾回收*/
       luaC_fullgc(L, 1);  /* try to free some memory... */
 	  /*尝试重新分配内存*/
@@ -108,6 +127,8 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   lua_assert((nsize == 0) == (newblock == NULL));
   /*更新内存统计*/
   g->GCdebt = (g->GCdebt + nsize) - realosize;
+  if (gettotalbytes(g) > g->gcpeak)
+    g->gcpeak = gettotalbytes(g);
   return newblock;
 }
 
@@ -98,6 +98,8 @@ struct GCObject {
 ** an actual value plus a tag with its type.
 */
 
+#if !defined(LUA_NANBOXING)	/* { */
+
 /*
 ** Union of all Lua values
 */
@@ -115,13 +117,6 @@ typedef union Value {
 #define TValuefields	Value value_; int tt_
 
 
-/*lua支持的数据类型的抽象*/
-typedef struct lua_TValue {
-  TValuefields;
-} TValue;
-
-
-
 /* macro defining a nil value */
 #define NILCONSTANT	{NULL}, LUA_TNIL
 
@@ -132,6 +127,73 @@ typedef struct lua_TValue {
 /* raw type tag of a TValue */
 #define rttype(o)	((o)->tt_)
 
+#else				/* }{ */
+
+/*
+** NaN boxing: a value is a single 64-bit word. Floats are kept as
+** they are, except that every NaN is stored as 'NBNAN'. Any other value
+** is a negative quiet NaN (which no float is): its 13 highest bits are
+** set, the next 4 bits hold a code for its tag (see 'nbcode'), and the
+** lowest 47 bits hold its payload (a pointer, a boolean, or a 32-bit
+** integer).
+*/
+
+#if defined(LUA_USE_C89) || LUA_FLOAT_TYPE != LUA_FLOAT_DOUBLE || \
+    LUA_MAXINTEGER > 2147483647
+#error "NaN boxing needs C99, 'double' floats and 32-bit integers"
+#endif
+
+typedef unsigned long long l_nbword;
+
+#define TValuefields	union { l_nbword u_; lua_Number n_; } nb_
+
+#define NBBOX		0xFFF8000000000000ULL  /* all boxed values are above */
+#define NBPAYLOAD	0x00007FFFFFFFFFFFULL  /* mask for payloads */
+#define NBNAN		0x7FF8000000000000ULL  /* the canonical float NaN */
+
+/* macro defining a nil value */
+#define NILCONSTANT	{NBBOX}
+
+
+/*
+** Codes for boxed tags: the tag without variants, or a free code for
+** the variants that need one (float numbers are not boxed)
+*/
+#define nbcode(t) \
+	((t) == LUA_TNUMINT ? 11 : (t) == ctb(LUA_TLNGSTR) ? 12 : \
+	 (t) == LUA_TLCF ? 13 : (t) == ctb(LUA_TCCL) ? 14 : novariant(t))
+
+/* codes of collectable tags (as bits) */
+#define NBCOLLECTABLE	((0x3F << LUA_TSTRING) | (1 << 12) | (1 << 14))
+
+#define nbword(o)	((o)->nb_.u_)
+#define isboxed(o)	(nbword(o) >= NBBOX)
+#define nbcodeof(o)	cast_int((nbword(o) >> 47) & 0xF)
+#define nbpayload(o)	(nbword(o) & NBPAYLOAD)
+#define nbgc(o)		cast(GCObject *, cast(size_t, nbpayload(o)))
+
+#define nbtag(c)	(NBBOX | (cast(l_nbword, c) << 47))
+#define nbptr(p)	check_exp((cast(l_nbword, cast(size_t, p)) & \
+                                  ~NBPAYLOAD) == 0, \
+                                  cast(l_nbword, cast(size_t, p)))
+#define nbset(o,c,p)	(nbword(o) = nbtag(c) | (p))
+
+
+/* full tag for each code */
+LUAI_DDEC const lu_byte luaO_nbtags[16];
+
+/* raw type tag of a TValue */
+#define rttype(o)	(isboxed(o) ? luaO_nbtags[nbcodeof(o)] : LUA_TNUMFLT)
+
+#endif				/* } */
+
+
+/*lua支持的数据类型的抽象*/
+typedef struct lua_TValue {
+  TValuefields;
+} TValue;
+
+
 /* tag with no variants (bits 0-3) */
 #define novariant(x)	((x) & 0x0F)
 
@@ -143,20 +205,31 @@ typedef struct lua_TValue {
 
 
 /* Macros to test type */
+#if !defined(LUA_NANBOXING)
 #define checktag(o,t)		(rttype(o) == (t))
 #define checktype(o,t)		(ttnov(o) == (t))
 #define ttisnumber(o)		checktype((o), LUA_TNUMBER)
+#define ttisstring(o)		checktype((o), LUA_TSTRING)
+#define ttisfunction(o)		checktype(o, LUA_TFUNCTION)
+#define ttisclosure(o)		((rttype(o) & 0x1F) == LUA_TFUNCTION)
+#else
+#define checktag(o,t)		((t) == LUA_TNUMFLT ? !isboxed(o) : \
+                                 (nbword(o) >> 47) == (nbtag(nbcode(t)) >> 47))
+#define checkcode(o,c)		(isboxed(o) && nbcodeof(o) == (c))
+#define checktype(o,t)		(ttnov(o) == (t))
+#define ttisnumber(o)		(!isboxed(o) || nbcodeof(o) == 11)
+#define ttisstring(o)		(checkcode(o, 4) || checkcode(o, 12))
+#define ttisfunction(o)		(ttisclosure(o) || checkcode(o, 13))
+#define ttisclosure(o)		(checkcode(o, 6) || checkcode(o, 14))
+#endif
 #define ttisfloat(o)		checktag((o), LUA_TNUMFLT)
 #define ttisinteger(o)		checktag((o), LUA_TNUMINT)
 #define ttisnil(o)		checktag((o), LUA_TNIL)
 #define ttisboolean(o)		checktag((o), LUA_TBOOLEAN)
 #define ttislightuserdata(o)	checktag((o), LUA_TLIGHTUSERDATA)
-#define ttisstring(o)		checktype((o), LUA_TSTRING)
 #define ttisshrstring(o)	checktag((o), ctb(LUA_TSHRSTR))
 #define ttislngstring(o)	checktag((o), ctb(LUA_TLNGSTR))
 #define ttistable(o)		checktag((o), ctb(LUA_TTABLE))
-#define ttisfunction(o)		checktype(o, LUA_TFUNCTION)
-#define ttisclosure(o)		((rttype(o) & 0x1F) == LUA_TFUNCTION)
 #define ttisCclosure(o)		checktag((o), ctb(LUA_TCCL))
 #define ttisLclosure(o)		checktag((o), ctb(LUA_TLCL))
 #define ttislcf(o)		checktag((o), LUA_TLCF)
@@ -166,6 +239,7 @@ typedef struct lua_TValue {
 
 
 /* Macros to access values */
+#if !defined(LUA_NANBOXING)
 /*获取TValue的整数值i*/
 #define ivalue(o)	check_exp(ttisinteger(o), val_(o).i)
 #define fltvalue(o)	check_exp(ttisfloat(o), val_(o).n)
@@ -186,10 +260,36 @@ typedef struct lua_TValue {
 /* a dead value may get the 'gc' field, but cannot access its contents */
 #define deadvalue(o)	check_exp(ttisdeadkey(o), cast(void *, val_(o).gc))
 
-#define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
+#define iscollectable(o)	(rttype(o) & BIT_ISCOLLECTABLE)
 
+#else
 
-#define iscollectable(o)	(rttype(o) & BIT_ISCOLLECTABLE)
+#define ivalue(o)	check_exp(ttisinteger(o), \
+                          l_castU2S(cast(lua_Unsigned, nbword(o))))
+#define fltvalue(o)	check_exp(ttisfloat(o), (o)->nb_.n_)
+#define nvalue(o)	check_exp(ttisnumber(o), \
+	(ttisinteger(o) ? cast_num(ivalue(o)) : fltvalue(o)))
+#define gcvalue(o)	check_exp(iscollectable(o), nbgc(o))
+#define pvalue(o)	check_exp(ttislightuserdata(o), \
+                          cast(void *, cast(size_t, nbpayload(o))))
+#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(nbgc(o)))
+#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(nbgc(o)))
+#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(nbgc(o)))
+#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(nbgc(o)))
+#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(nbgc(o)))
+#define fvalue(o)	check_exp(ttislcf(o), \
+                          cast(lua_CFunction, cast(size_t, nbpayload(o))))
+#define hvalue(o)	check_exp(ttistable(o), gco2t(nbgc(o)))
+#define bvalue(o)	check_exp(ttisboolean(o), cast_int(nbpayload(o)))
+#define thvalue(o)	check_exp(ttisthread(o), gco2th(nbgc(o)))
+#define deadvalue(o)	check_exp(ttisdeadkey(o), cast(void *, nbgc(o)))
+
+#define iscollectable(o) \
+	(isboxed(o) && ((NBCOLLECTABLE >> nbcodeof(o)) & 1))
+
+#endif
+
+#define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
 
 
 /* Macros for internal tests */
@@ -200,6 +300,8 @@ typedef struct lua_TValue {
 		(righttt(obj) && (L == NULL || !isdead(G(L),gcvalue(obj)))))
 
 
+#if !defined(LUA_NANBOXING)
+
 /* Macros to set values */
 /*设置TValue o类型为t*/
 #define settt_(o,t)	((o)->tt_=(t))
@@ -269,6 +371,74 @@ typedef struct lua_TValue {
 
 #define setdeadvalue(obj)	settt_(obj, LUA_TDEADKEY)
 
+#else
+
+#define setfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); \
+    if (luai_numisnan(n_)) nbword(io) = NBNAN; else io->nb_.n_ = n_; }
+
+#define chgfltvalue(obj,x) \
+  { TValue *i_o=(obj); lua_assert(ttisfloat(i_o)); setfltvalue(i_o, x); }
+
+#define setivalue(obj,x) \
+  { TValue *io=(obj); \
+    nbset(io, nbcode(LUA_TNUMINT), cast(l_nbword, l_castS2U(x))); }
+
+#define chgivalue(obj,x) \
+  { TValue *i_o=(obj); lua_assert(ttisinteger(i_o)); setivalue(i_o, x); }
+
+#define setnilvalue(obj) (nbword(obj) = NBBOX)
+
+#define setfvalue(obj,x) \
+  { TValue *io=(obj); nbset(io, nbcode(LUA_TLCF), nbptr(x)); }
+
+#define setpvalue(obj,x) \
+  { TValue *io=(obj); nbset(io, nbcode(LUA_TLIGHTUSERDATA), nbptr(x)); }
+
+#define setbvalue(obj,x) \
+  { TValue *io=(obj); \
+    nbset(io, nbcode(LUA_TBOOLEAN), cast(l_nbword, (x) != 0)); }
+
+#define setgcovalue(L,obj,x) \
+  { TValue *io = (obj); GCObject *i_g=(x); \
+    nbset(io, nbcode(ctb(i_g->tt)), nbptr(i_g)); }
+
+#define setsvalue(L,obj,x) \
+  { TValue *io = (obj); TString *x_ = (x); \
+    nbset(io, nbcode(ctb(x_->tt)), nbptr(x_)); \
+    checkliveness(L,io); }
+
+#define setuvalue(L,obj,x) \
+  { TValue *io = (obj); Udata *x_ = (x); \
+    nbset(io, nbcode(ctb(LUA_TUSERDATA)), nbptr(x_)); \
+    checkliveness(L,io); }
+
+#define setthvalue(L,obj,x) \
+  { TValue *io = (obj); lua_State *x_ = (x); \
+    nbset(io, nbcode(ctb(LUA_TTHREAD)), nbptr(x_)); \
+    checkliveness(L,io); }
+
+#define setclLvalue(L,obj,x) \
+  { TValue *io = (obj); LClosure *x_ = (x); \
+    nbset(io, nbcode(ctb(LUA_TLCL)), nbptr(x_)); \
+    checkliveness(L,io); }
+
+#define setclCvalue(L,obj,x) \
+  { TValue *io = (obj); CClosure *x_ = (x); \
+    nbset(io, nbcode(ctb(LUA_TCCL)), nbptr(x_)); \
+    checkliveness(L,io); }
+
+#define sethvalue(L,obj,x) \
+  { TValue *io = (obj); Table *x_ = (x); \
+    nbset(io, nbcode(ctb(LUA_TTABLE)), nbptr(x_)); \
+    checkliveness(L,io); }
+
+/* a dead key keeps its payload, so that 'deadvalue' still works */
+#define setdeadvalue(obj) \
+	nbset(obj, nbcode(LUA_TDEADKEY), nbpayload(obj))
+
+#endif
+
 
 
 #define setobj(L,obj1,obj2) \
@@ -375,7 +545,11 @@ typedef struct Udata {
   lu_byte ttuv_;  /* user value's tag */
   struct Table *metatable;
   size_t len;  /* number of bytes */
+#if !defined(LUA_NANBOXING)
   union Value user_;  /* user value */
+#else
+  TValue user_;  /* user value */
+#endif
 } Udata;
 
 
@@ -395,6 +569,8 @@ typedef union UUdata {
 #define getudatamem(u)  \
   check_exp(sizeof((u)->ttuv_), (cast(char*, (u)) + sizeof(UUdata)))
 
+#if !defined(LUA_NANBOXING)
+
 #define setuservalue(L,u,o) \
 	{ const TValue *io=(o); Udata *iu = (u); \
 	  iu->user_ = io->value_; iu->ttuv_ = rttype(io); \
@@ -406,6 +582,21 @@ typedef union UUdata {
 	  io->value_ = iu->user_; settt_(io, iu->ttuv_); \
 	  checkliveness(L,io); }
 
+#else
+
+#define setuservalue(L,u,o) \
+	{ const TValue *io=(o); Udata *iu = (u); \
+	  iu->user_ = *io; iu->ttuv_ = rttype(io); \
+	  checkliveness(L,io); }
+
+
+#define getuservalue(L,u,o) \
+	{ TValue *io=(o); const Udata *iu = (u); \
+	  *io = iu->user_; \
+	  checkliveness(L,io); }
+
+#endif
+
 
 /*
 ** Description of an upvalue for function prototypes
@@ -534,10 +725,17 @@ typedef union TKey {
 
 /* copy a value into a key without messing up field 'next' */
 /*拷贝obj中value到key，没有数据拷贝，只是指针和类型赋值*/
+#if !defined(LUA_NANBOXING)
 #define setnodekey(L,key,obj) \
 	{ TKey *k_=(key); const TValue *io_=(obj); \
 	  k_->nk.value_ = io_->value_; k_->nk.tt_ = io_->tt_; \
 	  (void)L; checkliveness(L,io_); }
+#else
+#define setnodekey(L,key,obj) \
+	{ TKey *k_=(key); const TValue *io_=(obj); \
+	  nbword(&k_->nk) = nbword(io_); \
+	  (void)L; checkliveness(L,io_); }
+#endif
 
 
 typedef struct Node {
@@ -546,19 +744,40 @@ typedef struct Node {
 } Node;
 
 
+/*
+** Shapes (key sets shared by record-like tables; see ltable.c)
+*/
+typedef struct Shape {
+  struct Shape *child;  /* first shape extending this one with a key */
+  struct Shape *sibling;  /* next shape extending the same parent */
+  int nkeys;  /* number of keys */
+  TString *keys[1];  /* keys, in slot order (short strings) */
+} Shape;
+
+
 typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
   /*node数组容量2^lsizenode*/
   lu_byte lsizenode;  /* log2 of size of 'node' array */
+  lu_byte frozen;  /* true if table cannot be modified */
+  lu_byte oldlsizenode;  /* log2 of size of 'oldnode' array */
+  lu_byte sizeslots;  /* size of 'slots' array */
+  lu_byte sizeinline;  /* room allocated after the header, in TValues */
   /*array容量*/
   unsigned int sizearray;  /* size of 'array' array */
+  unsigned int border;  /* hint for 'luaH_getn' (last border found) */
+  unsigned int cursor;  /* hint for 'luaH_next' (last node traversed) */
+  unsigned int oldpos;  /* nodes in 'oldnode' not yet migrated */
   /*array数组，数组部分*/
   TValue *array;  /* array part */
   /*node数组，hash表部分，容量为2^lsizenode*/
   Node *node;
   /*最后一个空闲位置的下一个位置，该指针用于向前查找最后一个空闲位置*/
   Node *lastfree;  /* any free position is before this position */
+  Node *oldnode;  /* previous hash part, while being migrated (or NULL) */
+  Shape *shape;  /* key set of a shaped table (or NULL) */
+  TValue *slots;  /* values of a shaped table, in the order of its keys */
   struct Table *metatable;
   GCObject *gclist;
 } Table;
@@ -574,6 +793,7 @@ typedef struct Table {
 
 #define twoto(x)	(1<<(x))
 #define sizenode(t)	(twoto((t)->lsizenode))
+#define sizeoldnode(t)	(twoto((t)->oldlsizenode))
 
 
 /*
@@ -587,6 +807,9 @@ LUAI_DDEC const TValue luaO_nilobject_;
 /* size of buffer for 'luaO_utf8esc' function */
 #define UTF8BUFFSZ	8
 
+/* maximum length of the conversion of a number to a string */
+#define MAXNUMBER2STR	50
+
 LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_utf8esc (char *buff, unsigned long x);
@@ -595,6 +818,7 @@ LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
 LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC size_t luaO_tostringbuff (const TValue *obj, char *buff);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
@@ -0,0 +1,458 @@
+/*
+** $Id: lserlib.c $
+** Binary serialization of Lua values
+** See Copyright Notice in lua.h
+*/
+
+#define lserlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <limits.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** Format: a header (SER_MAGIC, SER_VERSION, sizeof(lua_Number)), the
+** number of values as a varint, and the encoded values. Each value is a
+** tag byte plus its payload:
+**
+** S_NIL, S_FALSE, S_TRUE:  nothing
+** S_INT:  integer as a zigzag varint
+** S_FLT:  lua_Number, in native byte order
+** S_STR:  length as a varint, then the bytes
+** S_TABLE:  array count and hash count as 4-byte little-endian
+**   integers, then the values of keys 1..array count, then key-value
+**   pairs for all other entries
+** S_REF:  varint index of a table or string seen before (in order of
+**   first appearance, from 1)
+**
+** Tables and strings are numbered as they are first seen, so that shared
+** tables (including cycles) and repeated strings are written only once.
+** Metatables are not serialized; functions, userdata, and threads cannot
+** be serialized.
+*/
+
+#define SER_MAGIC	"\x1bS"
+#define SER_VERSION	1
+
+#define S_NIL		0
+#define S_FALSE		1
+#define S_TRUE		2
+#define S_INT		3
+#define S_FLT		4
+#define S_STR		5
+#define S_TABLE		6
+#define S_REF		7
+
+
+/* maximum nesting of tables */
+#if !defined(LUA_SERMAXDEPTH)
+#define LUA_SERMAXDEPTH		200
+#endif
+
+
+/*
+** {======================================================
+** Encoding
+** =======================================================
+*/
+
+typedef struct Box {
+  char *b;
+  size_t size;
+} Box;
+
+
+static void resizebox (lua_State *L, Box *box, size_t newsize) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  char *temp = (char *)allocf(ud, box->b, box->size, newsize);
+  if (temp == NULL && newsize > 0) {  /* allocation error? */
+    resizebox(L, box, 0);  /* free buffer */
+    luaL_error(L, "not enough memory for serialization buffer");
+  }
+  box->b = temp;
+  box->size = newsize;
+}
+
+
+static int boxgc (lua_State *L) {
+  resizebox(L, (Box *)lua_touserdata(L, 1), 0);
+  return 0;
+}
+
+
+typedef struct Encoder {
+  lua_State *L;
+  Box *box;  /* output buffer */
+  size_t n;  /* bytes used in the buffer */
+  int refs;  /* stack index of table mapping values to their indices */
+  lua_Integer nrefs;  /* number of values in 'refs' */
+} Encoder;
+
+
+static char *reserve (Encoder *E, size_t l) {
+  if (E->box->size - E->n < l) {
+    size_t newsize = E->box->size * 2;
+    if (newsize - E->n < l)
+      newsize = E->n + l;
+    if (newsize < E->n)  /* overflow? */
+      luaL_error(E->L, "serialized data too large");
+    resizebox(E->L, E->box, newsize);
+  }
+  E->n += l;
+  return E->box->b + E->n - l;
+}
+
+
+static void addbyte (Encoder *E, int c) {
+  *reserve(E, 1) = (char)c;
+}
+
+
+static void addvarint (Encoder *E, lua_Unsigned u) {
+  char buff[(sizeof(lua_Unsigned) * 8 + 6) / 7];
+  int n = 0;
+  do {
+    buff[n++] = (char)((u & 0x7f) | ((u >= 0x80) ? 0x80 : 0));
+    u >>= 7;
+  } while (u != 0);
+  memcpy(reserve(E, n), buff, n);
+}
+
+
+static void setuint32 (char *p, size_t u) {
+  int i;
+  for (i = 0; i < 4; i++, u >>= 8)
+    p[i] = (char)(u & 0xff);
+}
+
+
+/*
+** If value at 'idx' was already seen, write a reference to it and return
+** true. Otherwise give it the next index and return false.
+*/
+static int checkref (Encoder *E, int idx) {
+  lua_State *L = E->L;
+  lua_pushvalue(L, idx);
+  if (lua_rawget(L, E->refs) == LUA_TNUMBER) {
+    addbyte(E, S_REF);
+    addvarint(E, (lua_Unsigned)lua_tointeger(L, -1));
+    lua_pop(L, 1);
+    return 1;
+  }
+  lua_pop(L, 1);
+  lua_pushvalue(L, idx);
+  lua_pushinteger(L, ++E->nrefs);
+  lua_rawset(L, E->refs);
+  return 0;
+}
+
+
+static void encode (Encoder *E, int idx, int depth);
+
+
+/*
+** Tables are traversed once: keys 1, 2, ... coming first from 'lua_next'
+** (the array part) go to the array section without their keys; all the
+** others are written as pairs. The counts are patched in at the end.
+*/
+static void encodetable (Encoder *E, int idx, int depth) {
+  lua_State *L = E->L;
+  size_t counts, narr = 0, nhash = 0;
+  int inarray = 1;
+  if (depth >= LUA_SERMAXDEPTH)
+    luaL_error(L, "table nesting too deep to serialize");
+  luaL_checkstack(L, 4, "table nesting too deep to serialize");
+  addbyte(E, S_TABLE);
+  reserve(E, 8);
+  counts = E->n - 8;  /* buffer may move; keep an offset */
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    if (inarray && lua_isinteger(L, -2) &&
+        lua_tointeger(L, -2) == (lua_Integer)narr + 1)
+      narr++;
+    else {
+      inarray = 0;
+      encode(E, lua_gettop(L) - 1, depth + 1);  /* key */
+      nhash++;
+    }
+    encode(E, lua_gettop(L), depth + 1);  /* value */
+    lua_pop(L, 1);
+  }
+  if (narr > 0xffffffffu || nhash > 0xffffffffu)
+    luaL_error(L, "table too large to serialize");
+  setuint32(E->box->b + counts, narr);
+  setuint32(E->box->b + counts + 4, nhash);
+}
+
+
+static void encode (Encoder *E, int idx, int depth) {
+  lua_State *L = E->L;
+  switch (lua_type(L, idx)) {
+    case LUA_TNIL: addbyte(E, S_NIL); break;
+    case LUA_TBOOLEAN:
+      addbyte(E, lua_toboolean(L, idx) ? S_TRUE : S_FALSE);
+      break;
+    case LUA_TNUMBER: {
+      if (lua_isinteger(L, idx)) {
+        lua_Unsigned u = (lua_Unsigned)lua_tointeger(L, idx);
+        addbyte(E, S_INT);
+        addvarint(E, (u << 1) ^ (0u - (u >> (sizeof(u) * 8 - 1))));
+      }
+      else {
+        lua_Number n = lua_tonumber(L, idx);
+        addbyte(E, S_FLT);
+        memcpy(reserve(E, sizeof(n)), &n, sizeof(n));
+      }
+      break;
+    }
+    case LUA_TSTRING: {
+      if (!checkref(E, idx)) {
+        size_t l;
+        const char *s = lua_tolstring(L, idx, &l);
+        addbyte(E, S_STR);
+        addvarint(E, (lua_Unsigned)l);
+        memcpy(reserve(E, l), s, l);
+      }
+      break;
+    }
+    case LUA_TTABLE: {
+      if (!checkref(E, idx))
+        encodetable(E, idx, depth);
+      break;
+    }
+    default:
+      luaL_error(L, "cannot serialize a %s value", luaL_typename(L, idx));
+  }
+}
+
+
+/*
+** Push a string with the serialization of the 'n' values starting at
+** index 'idx'.
+*/
+LUALIB_API void luaL_serialize (lua_State *L, int idx, int n) {
+  Encoder E;
+  int i;
+  idx = lua_absindex(L, idx);
+  E.L = L;
+  E.box = (Box *)lua_newuserdata(L, sizeof(Box));
+  E.box->b = NULL;
+  E.box->size = 0;
+  if (luaL_newmetatable(L, "serialize.box")) {
+    lua_pushcfunction(L, boxgc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  resizebox(L, E.box, LUAL_BUFFERSIZE);
+  lua_newtable(L);
+  E.refs = lua_gettop(L);
+  E.nrefs = 0;
+  E.n = 0;
+  memcpy(reserve(&E, sizeof(SER_MAGIC) - 1), SER_MAGIC, sizeof(SER_MAGIC) - 1);
+  addbyte(&E, SER_VERSION);
+  addbyte(&E, (int)sizeof(lua_Number));
+  addvarint(&E, (lua_Unsigned)n);
+  for (i = 0; i < n; i++)
+    encode(&E, idx + i, 0);
+  lua_pushlstring(L, E.box->b, E.n);
+  resizebox(L, E.box, 0);
+  lua_replace(L, -3);  /* result in place of the box */
+  lua_pop(L, 1);  /* remove 'refs' */
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Decoding
+** =======================================================
+*/
+
+typedef struct Decoder {
+  lua_State *L;
+  const char *p;
+  const char *end;
+  int refs;  /* stack index of array of values by index */
+  lua_Integer nrefs;
+} Decoder;
+
+
+static void invalid (Decoder *D) {
+  luaL_error(D->L, "invalid serialized data");
+}
+
+
+static const char *getbytes (Decoder *D, size_t l) {
+  const char *p = D->p;
+  if ((size_t)(D->end - p) < l)
+    invalid(D);
+  D->p += l;
+  return p;
+}
+
+
+static lua_Unsigned getvarint (Decoder *D) {
+  lua_Unsigned u = 0;
+  int shift = 0;
+  for (;;) {
+    int c = (unsigned char)*getbytes(D, 1);
+    if (shift >= (int)sizeof(u) * 8)
+      invalid(D);
+    u |= (lua_Unsigned)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return u;
+    shift += 7;
+  }
+}
+
+
+static size_t getuint32 (Decoder *D) {
+  const unsigned char *p = (const unsigned char *)getbytes(D, 4);
+  return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) |
+         ((size_t)p[3] << 24);
+}
+
+
+static void addref (Decoder *D) {
+  lua_pushvalue(D->L, -1);
+  lua_rawseti(D->L, D->refs, ++D->nrefs);
+}
+
+
+static void decode (Decoder *D, int depth);
+
+
+static void decodetable (Decoder *D, int depth) {
+  lua_State *L = D->L;
+  size_t i, narr = getuint32(D);
+  size_t nhash = getuint32(D);
+  if (depth >= LUA_SERMAXDEPTH)
+    luaL_error(L, "table nesting too deep to deserialize");
+  luaL_checkstack(L, 3, "table nesting too deep to deserialize");
+  /* each entry takes at least one byte: do not trust larger counts */
+  if (narr > (size_t)(D->end - D->p) || nhash > (size_t)(D->end - D->p))
+    invalid(D);
+  lua_createtable(L, (int)narr, (int)nhash);
+  addref(D);  /* registered before its contents, for cycles */
+  for (i = 1; i <= narr; i++) {
+    decode(D, depth + 1);
+    lua_rawseti(L, -2, (lua_Integer)i);
+  }
+  for (i = 0; i < nhash; i++) {
+    decode(D, depth + 1);  /* key */
+    if (lua_isnil(L, -1))
+      invalid(D);
+    decode(D, depth + 1);  /* value */
+    lua_rawset(L, -3);
+  }
+}
+
+
+static void decode (Decoder *D, int depth) {
+  lua_State *L = D->L;
+  switch (*getbytes(D, 1)) {
+    case S_NIL: lua_pushnil(L); break;
+    case S_FALSE: lua_pushboolean(L, 0); break;
+    case S_TRUE: lua_pushboolean(L, 1); break;
+    case S_INT: {
+      lua_Unsigned u = getvarint(D);
+      lua_pushinteger(L, (lua_Integer)((u >> 1) ^ (0u - (u & 1))));
+      break;
+    }
+    case S_FLT: {
+      lua_Number n;
+      memcpy(&n, getbytes(D, sizeof(n)), sizeof(n));
+      lua_pushnumber(L, n);
+      break;
+    }
+    case S_STR: {
+      size_t l = (size_t)getvarint(D);
+      const char *s = getbytes(D, l);
+      lua_pushlstring(L, s, l);
+      addref(D);
+      break;
+    }
+    case S_TABLE: decodetable(D, depth); break;
+    case S_REF: {
+      lua_Unsigned r = getvarint(D);
+      if (r == 0 || r > (lua_Unsigned)D->nrefs)
+        invalid(D);
+      lua_rawgeti(L, D->refs, (lua_Integer)r);
+      break;
+    }
+    default: invalid(D);
+  }
+}
+
+
+/*
+** Push the values serialized in 's' by 'luaL_serialize'; return how many
+** they are.
+*/
+LUALIB_API int luaL_deserialize (lua_State *L, const char *s, size_t l) {
+  Decoder D;
+  lua_Unsigned i, n;
+  D.L = L;
+  D.p = s;
+  D.end = s + l;
+  if (l < sizeof(SER_MAGIC) + 1 ||
+      memcmp(s, SER_MAGIC, sizeof(SER_MAGIC) - 1) != 0)
+    luaL_error(L, "not serialized data");
+  D.p += sizeof(SER_MAGIC) - 1;
+  if (*getbytes(&D, 1) != SER_VERSION ||
+      *getbytes(&D, 1) != (char)sizeof(lua_Number))
+    luaL_error(L, "serialized data has an incompatible format");
+  n = getvarint(&D);
+  if (n > INT_MAX - 2)
+    luaL_error(L, "too many values to deserialize");
+  /* values, the 'refs' table, and the copy pushed by 'addref' */
+  luaL_checkstack(L, (int)n + 2, "too many values to deserialize");
+  lua_newtable(L);
+  D.refs = lua_gettop(L);
+  D.nrefs = 0;
+  for (i = 0; i < n; i++)
+    decode(&D, 0);
+  if (D.p != D.end)
+    invalid(&D);
+  lua_remove(L, D.refs);
+  return (int)n;
+}
+
+/* }====================================================== */
+
+
+static int ser_encode (lua_State *L) {
+  luaL_serialize(L, 1, lua_gettop(L));
+  return 1;
+}
+
+
+static int ser_decode (lua_State *L) {
+  size_t l;
+  const char *s = luaL_checklstring(L, 1, &l);
+  return luaL_deserialize(L, s, l);
+}
+
+
+static const luaL_Reg ser_funcs[] = {
+  {"decode", ser_decode},
+  {"encode", ser_encode},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_serialize (lua_State *L) {
+  luaL_newlib(L, ser_funcs);
+  return 1;
+}
+
@@ -36,6 +36,14 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 #endif
 
+#if !defined(LUAI_GCSTEPTIME)
+#define LUAI_GCSTEPTIME	0  /* steps are paced by work, not by time */
+#endif
+
+#if !defined(LUAI_GCCPUSHARE)
+#define LUAI_GCCPUSHARE	50  /* time-budgeted steps take up to 50% */
+#endif
+
 
 /*
 ** a macro to help the creation of a unique random seed when a state is
@@ -267,11 +275,14 @@ static void preinit_thread (lua_State *L, global_State *g) {
 
 static void close_state (lua_State *L) {
   global_State *g = G(L);
+  luaC_markthreads(L, 0);  /* stop marking helpers */
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeallobjects(L);  /* collect all objects */
   if (g->version)  /* closing a fully built state? */
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+  luaM_freearray(L, G(L)->strt.oldhash, G(L)->strt.oldsize);
+  luaH_freeshapes(L, g->rootshape);
   freestack(L);
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
@@ -317,6 +328,45 @@ void luaE_freethread (lua_State *L, lua_State *L1) {
   luaM_free(L, l);
 }
 
+
+/*
+** Bring a finished (or dead by error) coroutine back to the state of a
+** newly created thread, so that it can run a new function: close its
+** upvalues, unwind its CallInfo list, empty its stack and remove its
+** hook. Returns the status the thread had.
+*/
+LUA_API int lua_resetthread (lua_State *L) {
+  CallInfo *ci = &L->base_ci;
+  int status;
+  StkId o;
+  lua_lock(L);
+  status = L->status;
+  api_check(L, L != G(L)->mainthread, "cannot reset the main thread");
+  api_check(L, status != LUA_YIELD, "cannot reset a suspended coroutine");
+  luaF_close(L, L->stack);  /* close all upvalues for this thread */
+  lua_assert(L->openupval == NULL);
+  L->ci = ci;
+  ci->func = L->stack;
+  ci->callstatus = 0;
+  setnilvalue(L->stack);  /* 'function' entry for this 'ci' */
+  L->top = L->stack + 1;
+  ci->top = L->top + LUA_MINSTACK;
+  L->status = LUA_OK;
+  L->errfunc = 0;
+  L->nny = 1;
+  L->nCcalls = 0;
+  L->errorJmp = NULL;
+  L->hook = NULL;  /* no hook from its previous use */
+  L->hookmask = 0;
+  L->basehookcount = 0;
+  L->hookcount = 0;
+  luaD_shrinkstack(L);  /* also trims the CallInfo list */
+  for (o = L->top; o < L->stack + L->stacksize; o++)
+    setnilvalue(o);  /* erase old contents */
+  lua_unlock(L);
+  return status;
+}
+
 /*
 f：l_alloc
 */
@@ -344,9 +394,14 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   /*计算随机数*/
   g->seed = makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
+  g->gcstopem = 0;
   g->GCestimate = 0;
   g->strt.size = g->strt.nuse = 0;
   g->strt.hash = NULL;
+  g->strt.oldhash = NULL;
+  g->strt.oldsize = g->strt.oldpos = 0;
+  g->rootshape = NULL;
+  g->nshapes = 0;
   setnilvalue(&g->l_registry);
   g->panic = NULL;
   g->version = NULL;
@@ -362,6 +417,13 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->gcsteptime = LUAI_GCSTEPTIME;
+  g->gccpushare = LUAI_GCCPUSHARE;
+  g->gcresume = 0;
+  g->gclimit = 0;
+  g->gcpeak = sizeof(LG);
+  g->parmark = NULL;
+  g->ephmap = NULL;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   /*调用setjmp后执行f_luaopen函数，f_luaopen中会执行一些初始化工作*/
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
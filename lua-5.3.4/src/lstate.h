@@ -31,6 +31,8 @@
 
 
 struct lua_longjmp;  /* defined in ldo.c */
+struct ParMark;  /* defined in lgc.c */
+struct EphMap;  /* defined in lgc.c */
 
 
 /*
@@ -62,6 +64,9 @@ typedef struct stringtable {
   int nuse;  /* number of elements */
   /*hash桶的大小*/
   int size;
+  TString **oldhash;  /* buckets still to be moved during a resize */
+  int oldsize;  /* size of 'oldhash' */
+  int oldpos;  /* next bucket of 'oldhash' to be moved */
 } stringtable;
 
 
@@ -142,6 +147,7 @@ typedef struct global_State {
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcrunning;  /* true if GC is running */
+  lu_byte gcstopem;  /* stops emergency collections (and budget checks) */
   /*可回收对象添加到该链表中*/
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
@@ -158,6 +164,13 @@ typedef struct global_State {
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int gcsteptime;  /* max. duration of a GC step, in us (0: pace by work) */
+  int gccpushare;  /* max. % of time taken by time-budgeted GC steps */
+  lu_mem gcresume;  /* clock time (us) when the next timed step may run */
+  lu_mem gclimit;  /* memory budget, in bytes (0: no budget) */
+  lu_mem gcpeak;  /* largest value of 'gettotalbytes' so far */
+  struct ParMark *parmark;  /* helper threads for parallel marking (or NULL) */
+  struct EphMap *ephmap;  /* pending ephemeron entries (only in 'atomic') */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
@@ -178,6 +191,8 @@ typedef struct global_State {
   /*基本类型的metatable，string类型的metatable中包含了string库的函数名称和handler的映射关系*/
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+  Shape *rootshape;  /* empty shape, root of the tree of all shapes */
+  int nshapes;  /* number of shapes in that tree */
 } global_State;
 
 
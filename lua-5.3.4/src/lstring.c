@@ -25,15 +25,6 @@
 #define MEMERRMSG       "not enough memory"
 
 
-/*
-** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
-*/
-#if !defined(LUAI_HASHLIMIT)
-#define LUAI_HASHLIMIT		5
-#endif
-
-
 /*
 ** equality for long strings
 */
@@ -46,6 +37,23 @@ int luaS_eqlngstr (TString *a, TString *b) {
 }
 
 
+/*
+** {======================================================
+** String hash
+** =======================================================
+*/
+
+#if defined(LUAI_SAMPLEDHASH)	/* { */
+
+/*
+** Original hash: looks at each byte of the string, but uses at most
+** ~(2^LUAI_HASHLIMIT) bytes from it.
+*/
+#if !defined(LUAI_HASHLIMIT)
+#define LUAI_HASHLIMIT		5
+#endif
+
+
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   unsigned int h = seed ^ cast(unsigned int, l);
   size_t step = (l >> LUAI_HASHLIMIT) + 1;
@@ -54,6 +62,56 @@ unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   return h;
 }
 
+#else				/* }{ */
+
+/*
+** Default hash: consumes the whole string a 'lua_Unsigned' word at a
+** time, mixing each word with a multiply-xorshift step (in the style
+** of MurmurHash64A). Every byte affects the result, so strings that
+** differ only in bytes the sampling hash skips no longer collide, and
+** the seed enters the state before any input.
+*/
+#if LUA_MAXINTEGER > 2147483647
+#define HASHMUL		((lua_Unsigned)0xc6a4a7935bd1e995)
+#define HASHSHIFT	47
+#else
+#define HASHMUL		((lua_Unsigned)0x5bd1e995)
+#define HASHSHIFT	24
+#endif
+
+#define WORDSIZE	sizeof(lua_Unsigned)
+
+
+/* load 'n' (at most WORDSIZE) bytes from 'p' (possibly unaligned) */
+static lua_Unsigned loadword (const char *p, size_t n) {
+  lua_Unsigned w = 0;
+  memcpy(&w, p, n);
+  return w;
+}
+
+
+unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
+  lua_Unsigned h = seed ^ (cast(lua_Unsigned, l) * HASHMUL);
+  for (; l >= WORDSIZE; l -= WORDSIZE, str += WORDSIZE) {
+    lua_Unsigned k = loadword(str, WORDSIZE) * HASHMUL;
+    k ^= k >> HASHSHIFT;
+    h ^= k * HASHMUL;
+    h *= HASHMUL;
+  }
+  if (l > 0) {  /* remaining bytes */
+    h ^= loadword(str, l);
+    h *= HASHMUL;
+  }
+  h ^= h >> HASHSHIFT;
+  h *= HASHMUL;
+  h ^= h >> HASHSHIFT;
+  return cast(unsigned int, h ^ (h >> (WORDSIZE * 4)));
+}
+
+#endif				/* } */
+
+/* }====================================================== */
+
 
 unsigned int luaS_hashlongstr (TString *ts) {
   lua_assert(ts->tt == LUA_TLNGSTR);
@@ -66,44 +124,58 @@ unsigned int luaS_hashlongstr (TString *ts) {
 
 
 /*
-** resizes the string table
+** moves up to 'n' buckets of the old bucket array (left by a previous
+** resize) to the current one; frees the old array when it is empty
 */
-/*字符串hash表扩缩容*/
-void luaS_resize (lua_State *L, int newsize) {
-  int i;
+void luaS_migrate (lua_State *L, int n) {
   stringtable *tb = &G(L)->strt;
-  /*hash表需要扩容*/
-  if (newsize > tb->size) {  /* grow table if needed */
-  	/*分配数组，节点类型为TStirng *，首地址保存在tb->hash中*/
-    luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
-    for (i = tb->size; i < newsize; i++)
-      tb->hash[i] = NULL;
-  }
-  /*遍历每个hash桶*/
-  for (i = 0; i < tb->size; i++) {  /* rehash */
-  	/*保存链表头*/
-    TString *p = tb->hash[i];
-    tb->hash[i] = NULL;
-  	/*遍历链表中每个节点*/
+  if (tb->oldhash == NULL)  /* no resize in progress? */
+    return;
+  for (; n > 0 && tb->oldpos < tb->oldsize; n--) {
+    TString *p = tb->oldhash[tb->oldpos];
+    tb->oldhash[tb->oldpos++] = NULL;
     while (p) {  /* for each node in the list */
       TString *hnext = p->u.hnext;  /* save next */
-	  /*hash表扩容后，重新计算节点位置*/
-      unsigned int h = lmod(p->hash, newsize);  /* new position */
-	  /*插入到新位置的链表头部*/
+      unsigned int h = lmod(p->hash, tb->size);  /* new position */
       p->u.hnext = tb->hash[h];  /* chain it */
-	  /*更新链表头*/
       tb->hash[h] = p;
-	  /*继续下一个节点*/
       p = hnext;
     }
   }
-  /*hash表需要缩容*/
-  if (newsize < tb->size) {  /* shrink table if needed */
-    /* vanishing slice should be empty */
-    lua_assert(tb->hash[newsize] == NULL && tb->hash[tb->size - 1] == NULL);
-    luaM_reallocvector(L, tb->hash, tb->size, newsize, TString *);
+  if (tb->oldpos == tb->oldsize) {  /* all buckets moved? */
+    luaM_freearray(L, tb->oldhash, tb->oldsize);
+    tb->oldhash = NULL;
+    tb->oldsize = tb->oldpos = 0;
+  }
+}
+
+
+/*
+** resizes the string table. Strings are not rehashed at once: the
+** current buckets are kept as the old array and moved to the new one
+** a few at a time by 'luaS_migrate', so that no single string creation
+** pays for rehashing the whole table. A resize still in progress is
+** finished before starting another one.
+*/
+/*字符串hash表扩缩容*/
+void luaS_resize (lua_State *L, int newsize) {
+  int i;
+  stringtable *tb = &G(L)->strt;
+  TString **newhash;
+  luaS_migrate(L, MAX_INT);  /* finish previous resize */
+  /* allocation may run an emergency collection, which removes strings
+     from the (still consistent) current table */
+  newhash = luaM_newvector(L, newsize, TString *);
+  for (i = 0; i < newsize; i++)
+    newhash[i] = NULL;
+  lua_assert(tb->oldhash == NULL);
+  if (tb->size > 0) {  /* keep current buckets to be moved later */
+    tb->oldhash = tb->hash;
+    tb->oldsize = tb->size;
+    tb->oldpos = 0;
   }
   /*更新hash桶的大小*/
+  tb->hash = newhash;
   tb->size = newsize;
 }
 
@@ -168,11 +240,22 @@ TString *luaS_createlngstrobj (lua_State *L, size_t l) {
 }
 
 
+/*
+** find the link pointing to 'ts' in list 'p' (or the final NULL link)
+*/
+static TString **findlink (TString **p, TString *ts) {
+  while (*p != ts && *p != NULL)  /* find previous element */
+    p = &(*p)->u.hnext;
+  return p;
+}
+
+
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
-  TString **p = &tb->hash[lmod(ts->hash, tb->size)];
-  while (*p != ts)  /* find previous element */
-    p = &(*p)->u.hnext;
+  TString **p = findlink(&tb->hash[lmod(ts->hash, tb->size)], ts);
+  if (*p == NULL)  /* not moved from the old buckets yet? */
+    p = findlink(&tb->oldhash[lmod(ts->hash, tb->oldsize)], ts);
+  lua_assert(*p == ts);
   *p = (*p)->u.hnext;  /* remove element from its list */
   tb->nuse--;
 }
@@ -181,6 +264,21 @@ void luaS_remove (lua_State *L, TString *ts) {
 /*
 ** checks whether short string exists and reuses it or creates a new one
 */
+/*
+** look for a short string in list 'ts'
+*/
+static TString *findshrstr (TString *ts, const char *str, size_t l) {
+  /*遍历每个节点*/
+  for (; ts != NULL; ts = ts->u.hnext) {
+  	/*找到节点*/
+    if (l == ts->shrlen &&
+        (memcmp(str, getstr(ts), l * sizeof(char)) == 0))
+      return ts;  /* found! */
+  }
+  return NULL;
+}
+
+
 static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   TString *ts;
   global_State *g = G(L);
@@ -189,16 +287,13 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
   /*获取hash桶*/
   TString **list = &g->strt.hash[lmod(h, g->strt.size)];
   lua_assert(str != NULL);  /* otherwise 'memcmp'/'memcpy' are undefined */
-  /*遍历每个节点*/
-  for (ts = *list; ts != NULL; ts = ts->u.hnext) {
-  	/*找到节点*/
-    if (l == ts->shrlen &&
-        (memcmp(str, getstr(ts), l * sizeof(char)) == 0)) {
-      /* found! */
-      if (isdead(g, ts))  /* dead (but not collected yet)? */
-        changewhite(ts);  /* resurrect it */
-      return ts;
-    }
+  ts = findshrstr(*list, str, l);
+  if (ts == NULL && g->strt.oldhash != NULL)  /* resize in progress? */
+    ts = findshrstr(g->strt.oldhash[lmod(h, g->strt.oldsize)], str, l);
+  if (ts != NULL) {
+    if (isdead(g, ts))  /* dead (but not collected yet)? */
+      changewhite(ts);  /* resurrect it */
+    return ts;
   }
   /*节点数超过hash桶大小，扩容hash表*/
   if (g->strt.nuse >= g->strt.size && g->strt.size <= MAX_INT/2) {
@@ -206,6 +301,8 @@ static TString *internshrstr (lua_State *L, const char *str, size_t l) {
 	/*获取新位置*/
     list = &g->strt.hash[lmod(h, g->strt.size)];  /* recompute with new size */
   }
+  else
+    luaS_migrate(L, LUAI_STRMIGRATESTEP);  /* advance pending resize */
   /*没有找到节点，创建一个新的字符串对象*/
   ts = createstrobj(L, l, LUA_TSHRSTR, h);
   /*拷贝数据到对象中*/
@@ -25,6 +25,7 @@
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -55,21 +56,87 @@
 #define MAXHBITS	(MAXABITS - 1)
 
 
+/*
+** Hash parts growing to at least LUAI_HASHMIGRATEMIN nodes are resized
+** incrementally: the old node vector is kept, and its entries migrate
+** to the new one LUAI_HASHMIGRATESTEP nodes at a time, each time a new
+** key is inserted (see 'luaH_resize').
+*/
+#if !defined(LUAI_HASHMIGRATEMIN)
+#define LUAI_HASHMIGRATEMIN	(1 << 16)
+#endif
+
+#if !defined(LUAI_HASHMIGRATESTEP)
+#define LUAI_HASHMIGRATESTEP	16
+#endif
+
+
+/*
+** Record constructors with at most LUAI_MAXSHAPEKEYS fields build
+** shaped tables (0 disables shapes), and a state keeps at most
+** LUAI_MAXSHAPES shapes (see 'luaH_presize').
+*/
+#if !defined(LUAI_MAXSHAPEKEYS)
+#define LUAI_MAXSHAPEKEYS	16
+#endif
+
+#if !defined(LUAI_MAXSHAPES)
+#define LUAI_MAXSHAPES		1024
+#endif
+
+
+/*
+** A table created with a known small hash part (by a constructor or
+** 'lua_createtable') gets room for up to LUAI_INLINENODES nodes in the
+** same allocation as its header, where its node vector (or the slots
+** of a shaped table) can live without a separate allocation (see
+** 'luaH_newsized'); 0 disables it.
+*/
+#if !defined(LUAI_INLINENODES)
+#define LUAI_INLINENODES	4
+#endif
+
+/* TValues of room needed for 'n' nodes, and the most a table gets */
+#define roomfornodes(n)	(((n) * sizeof(Node) + sizeof(TValue) - 1) / \
+                         sizeof(TValue))
+#define MAXINLINEROOM	roomfornodes(LUAI_INLINENODES)
+
+
+/* whether 'luaH_presize' gives a constructor a shaped table */
+#define shapable(g,na,nh)  \
+	((na) == 0 && (nh) <= LUAI_MAXSHAPEKEYS && (g)->nshapes < LUAI_MAXSHAPES)
+
+
 #define hashpow2(t,n)		(gnode(t, lmod((n), sizenode(t))))
 
 #define hashstr(t,str)		hashpow2(t, (str)->hash)
 #define hashboolean(t,p)	hashpow2(t, p)
-#define hashint(t,i)		hashpow2(t, i)
+#define hashint(t,i)		hashpow2(t, mixbits(l_castS2U(i)))
+#define hashpointer(t,p)	hashpow2(t, mixbits(cast(lua_Unsigned, \
+                                                 cast(size_t, p))))
 
 
-/*
-** for some types, it is better to avoid modulus by power of 2, as
-** they tend to have many 2 factors.
-*/
-#define hashmod(t,n)	(gnode(t, ((n) % ((sizenode(t)-1)|1))))
+/* half the number of bits in a lua_Unsigned */
+#define HALFBITS	(cast_int(sizeof(lua_Unsigned) * CHAR_BIT) / 2)
 
+/* 2^64 / golden ratio (truncated to the size of a lua_Unsigned) */
+#define MIXCONST	((cast(lua_Unsigned, 0x9E3779B9u) << 16 << 16) | \
+                         cast(lua_Unsigned, 0x7F4A7C15u))
 
-#define hashpointer(t,p)	hashmod(t, point2uint(p))
+
+/*
+** Integers and pointers used as keys often differ only in their high
+** bits (strided ids, timestamps, aligned addresses), while only the low
+** bits select a node. So, fold the high half into the low one, multiply
+** by a large odd constant, and fold again, so that every bit of the key
+** affects the bits that 'lmod' keeps.
+*/
+static unsigned int mixbits (lua_Unsigned u) {
+  u ^= u >> HALFBITS;
+  u *= MIXCONST;
+  u ^= u >> HALFBITS;
+  return cast(unsigned int, u);
+}
 
 
 #define dummynode		(&dummynode_)
@@ -81,8 +148,12 @@ static const Node dummynode_ = {
 
 
 /*
-** Hash for floating-point numbers.
-** The main computation should be just
+** Hash for floating-point numbers. Keys with an integral value are
+** stored as integers and NaN is not a valid key, so equal float keys
+** always have the same representation: when 'lua_Number' has the size
+** of a 'lua_Unsigned', its bits are just mixed like an integer.
+** Otherwise (e.g. long double, whose padding bytes are undefined), the
+** main computation should be just
 **     n = frexp(n, &i); return (n * INT_MAX) + i
 ** but there are some numerical subtleties.
 ** In a two-complement representation, INT_MAX does not has an exact
@@ -94,9 +165,14 @@ static const Node dummynode_ = {
 ** INT_MIN.
 */
 #if !defined(l_hashfloat)
-static int l_hashfloat (lua_Number n) {
+static unsigned int l_hashfloat (lua_Number n) {
   int i;
   lua_Integer ni;
+  if (sizeof(lua_Number) == sizeof(lua_Unsigned)) {
+    lua_Unsigned u;
+    memcpy(&u, &n, sizeof(u));
+    return mixbits(u);
+  }
   n = l_mathop(frexp)(n, &i) * -cast_num(INT_MIN);
   if (!lua_numbertointeger(n, &ni)) {  /* is 'n' inf/-inf/NaN? */
     lua_assert(luai_numisnan(n) || l_mathop(fabs)(n) == cast_num(HUGE_VAL));
@@ -104,7 +180,7 @@ static int l_hashfloat (lua_Number n) {
   }
   else {  /* normal case */
     unsigned int u = cast(unsigned int, i) + cast(unsigned int, ni);
-    return cast_int(u <= cast(unsigned int, INT_MAX) ? u : ~u);
+    return mixbits(u <= cast(unsigned int, INT_MAX) ? u : ~u);
   }
 }
 #endif
@@ -120,7 +196,7 @@ static Node *mainposition (const Table *t, const TValue *key) {
     case LUA_TNUMINT:
       return hashint(t, ivalue(key));
     case LUA_TNUMFLT:
-      return hashmod(t, l_hashfloat(fltvalue(key)));
+      return hashpow2(t, l_hashfloat(fltvalue(key)));
     case LUA_TSHRSTR:
       return hashstr(t, tsvalue(key));
     case LUA_TLNGSTR:
@@ -138,6 +214,55 @@ static Node *mainposition (const Table *t, const TValue *key) {
 }
 
 
+/*
+** Find 'key' in the old node vector of table 't', which is being
+** migrated (see 'luaH_resize'); with 'dead', also match a dead key for
+** the same object, as 'next' needs. Migrated nodes have nil keys, so
+** they are never found. Returns NULL if 'key' is not there.
+*/
+static Node *findold (const Table *t, const TValue *key, int dead) {
+  Table old;  /* 't' seen with its old node vector as hash part */
+  Node *n;
+  old.node = t->oldnode;
+  old.lsizenode = t->oldlsizenode;
+  n = mainposition(&old, key);
+  for (;;) {  /* check whether 'key' is somewhere in the chain */
+    if (luaV_rawequalobj(gkey(n), key) ||
+          (dead && ttisdeadkey(gkey(n)) && iscollectable(key) &&
+           deadvalue(gkey(n)) == gcvalue(key)))
+      return n;
+    else {
+      int nx = gnext(n);
+      if (nx == 0)
+        return NULL;  /* not found */
+      n += nx;
+    }
+  }
+}
+
+
+static const TValue *getold (const Table *t, const TValue *key) {
+  Node *n = findold(t, key, 0);
+  return (n == NULL) ? luaO_nilobject : gval(n);
+}
+
+
+/*
+** Returns node 'i' in a traversal of the hash part of 't': first come
+** the nodes of its node vector, then those of its old node vector, if
+** it is being migrated. Returns NULL after the last one.
+*/
+static Node *travnode (const Table *t, unsigned int i) {
+  unsigned int size = cast(unsigned int, sizenode(t));
+  if (i < size)
+    return gnode(t, i);
+  else if (t->oldnode != NULL && i - size < cast(unsigned int, sizeoldnode(t)))
+    return t->oldnode + (i - size);
+  else
+    return NULL;
+}
+
+
 /*
 ** returns the index for 'key' if 'key' is an appropriate key to live in
 ** the array part of the table, 0 otherwise.
@@ -157,7 +282,10 @@ static unsigned int arrayindex (const TValue *key) {
 /*
 ** returns the index of a 'key' for table traversals. First goes all
 ** elements in the array part, then elements in the hash part. The
-** beginning of a traversal is signaled by 0.
+** beginning of a traversal is signaled by 0. In a traversal, 'key' is
+** usually the key in the node returned by the previous call, which is
+** kept in 't->cursor'; checking it first avoids hashing the key and
+** walking its chain, so that a full traversal is a linear scan.
 */
 static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   unsigned int i;
@@ -165,9 +293,22 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   i = arrayindex(key);
   if (i != 0 && i <= t->sizearray)  /* is 'key' inside array part? */
     return i;  /* yes; that's the index */
+  else if (isshaped(t)) {  /* slots are numbered after array elements */
+    if (ttisshrstring(key)) {
+      for (i = 0; cast_int(i) < t->shape->nkeys; i++) {
+        if (eqshrstr(t->shape->keys[i], tsvalue(key)))
+          return (i + 1) + t->sizearray;
+      }
+    }
+    luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+    return 0;  /* to avoid warnings */
+  }
   else {
     int nx;
-    Node *n = mainposition(t, key);
+    Node *n = travnode(t, t->cursor);
+    if (n != NULL && luaV_rawequalobj(gkey(n), key))
+      return (t->cursor + 1) + t->sizearray;  /* where last step left it */
+    n = mainposition(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
       /* key may be dead already, but it is ok to use it in 'next' */
       if (luaV_rawequalobj(gkey(n), key) ||
@@ -178,8 +319,13 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
         return (i + 1) + t->sizearray;
       }
       nx = gnext(n);
-      if (nx == 0)
+      if (nx == 0) {
+        if (t->oldnode != NULL && (n = findold(t, key, 1)) != NULL) {
+          i = cast_int(n - t->oldnode) + sizenode(t);
+          return (i + 1) + t->sizearray;
+        }
         luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+      }
       else n += nx;
     }
   }
@@ -188,6 +334,7 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
 
 int luaH_next (lua_State *L, Table *t, StkId key) {
   unsigned int i = findindex(L, t, key);  /* find original element */
+  Node *n;
   for (; i < t->sizearray; i++) {  /* try first array part */
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
       setivalue(key, i + 1);
@@ -195,10 +342,21 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       return 1;
     }
   }
-  for (i -= t->sizearray; cast_int(i) < sizenode(t); i++) {  /* hash part */
-    if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
-      setobj2s(L, key, gkey(gnode(t, i)));
-      setobj2s(L, key+1, gval(gnode(t, i)));
+  if (isshaped(t)) {
+    for (i -= t->sizearray; cast_int(i) < t->shape->nkeys; i++) {
+      if (!ttisnil(&t->slots[i])) {  /* a non-nil value? */
+        setsvalue2s(L, key, t->shape->keys[i]);
+        setobj2s(L, key+1, &t->slots[i]);
+        return 1;
+      }
+    }
+    return 0;
+  }
+  for (i -= t->sizearray; (n = travnode(t, i)) != NULL; i++) {  /* hash */
+    if (!ttisnil(gval(n))) {  /* a non-nil value? */
+      setobj2s(L, key, gkey(n));
+      setobj2s(L, key+1, gval(n));
+      t->cursor = i;
       return 1;
     }
   }
@@ -296,9 +454,9 @@ static unsigned int numusearray (const Table *t, unsigned int *nums) {
 static int numusehash (const Table *t, unsigned int *nums, unsigned int *pna) {
   int totaluse = 0;  /* total number of elements */
   int ause = 0;  /* elements added to 'nums' (can go to array part) */
-  int i = sizenode(t);
-  while (i--) {
-    Node *n = &t->node[i];
+  unsigned int i;
+  Node *n;
+  for (i = 0; (n = travnode(t, i)) != NULL; i++) {  /* with old nodes */
     if (!ttisnil(gval(n))) {
 	  /*统计hash节点到对应的区间[2^(lg-1),2^lg]*/
       ause += countint(gkey(n), nums);
@@ -339,7 +497,11 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
 	/*获取hash表容量大小，该值大于等于传递进来的size*/
     size = twoto(lsize);
 	/*分配size*sizeof(Node)大小的内存*/
-    t->node = luaM_newvector(L, size, Node);
+    /* use room in the header, unless slots being moved out still use it */
+    if (size <= sizeinlinenodes(t) && t->slots == NULL)
+      t->node = inlinenodes(t);
+    else
+      t->node = luaM_newvector(L, size, Node);
 	/*初始化每个hash节点*/
     for (i = 0; i < (int)size; i++) {
       Node *n = gnode(t, i);
@@ -352,22 +514,82 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   }
 }
 
+static unsigned int unshape (lua_State *L, Table *t);  /* see below */
+
+
+static void freeoldnode (lua_State *L, Table *t) {
+  luaM_freearray(L, t->oldnode, cast(size_t, sizeoldnode(t)));
+  t->oldnode = NULL;
+  t->oldpos = 0;
+}
+
+
+/*
+** Re-insert the entries from node vector 'nold' (with 'size' nodes)
+** into table 't'.
+*/
+static void reinsert (lua_State *L, Table *t, Node *nold, int size) {
+  int j;
+  for (j = size - 1; j >= 0; j--) {
+    Node *old = nold + j;
+    if (!ttisnil(gval(old))) {
+      /* doesn't need barrier/invalidate cache, as entry was
+         already present in the table */
+      setobjt2t(L, luaH_set(L, t, gkey(old)), gval(old));
+    }
+  }
+}
+
+
+/*
+** Resize table 't'. When only a large hash part grows, its entries are
+** not re-inserted now: the old node vector is kept in 't->oldnode' and
+** entries migrate from it as new keys are inserted (see 'migrate'),
+** spreading the cost of the resize. Meanwhile, lookups that miss in
+** the new vector also search the old one. If the table is resized
+** again before the migration ends, the remaining old entries are
+** re-inserted with the others.
+*/
 /*重新调整Table大小，nasize为指定的数组部分大小，nhsize为指定的hash部分大小*/
 void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                           unsigned int nhsize) {
   unsigned int i;
-  int j;
   /*获取数组大小*/
-  unsigned int oldasize = t->sizearray;
+  unsigned int oldasize;
   /*获取hash部分大小*/
-  int oldhsize = allocsizenode(t);
-  Node *nold = t->node;  /* save old hash ... */
+  int oldhsize;
+  lu_byte oldlsize;
+  Node *nold;
+  Node *pending;
+  int pendingsize;
+  Node saved[LUAI_INLINENODES + 1];  /* (+1 avoids an empty array) */
+  if (isshaped(t))  /* must leave the shaped representation? */
+    nhsize += unshape(L, t);  /* its entries go to the hash part */
+  oldasize = t->sizearray;
+  oldhsize = allocsizenode(t);
+  oldlsize = t->lsizenode;
+  nold = t->node;  /* save old hash ... */
+  pending = t->oldnode;  /* ... and entries not migrated yet */
+  pendingsize = (pending != NULL) ? sizeoldnode(t) : 0;
+  if (hasinlinenodes(t)) {  /* new hash part may reuse the same room? */
+    memcpy(saved, nold, sizeof(Node) * cast(size_t, oldhsize));
+    nold = saved;
+  }
   /*数组部分需要扩大，重新分配内存*/
   if (nasize > oldasize)  /* array part must grow? */
     setarrayvector(L, t, nasize);
   /* create new hash part with appropriate size */
   /*分配hash部分内存并初始化*/
   setnodevector(L, t, nhsize);
+  if (pending == NULL && nasize == oldasize && nold != saved &&
+      oldhsize > 0 && sizenode(t) >= LUAI_HASHMIGRATEMIN &&
+      sizenode(t) >= 2 * oldhsize) {  /* large hash part growing? */
+    t->oldnode = nold;  /* migrate its entries incrementally */
+    t->oldlsizenode = oldlsize;
+    t->oldpos = cast(unsigned int, oldhsize);
+    return;
+  }
+  t->oldnode = NULL;  /* pending entries will be re-inserted */
   /*需要缩减数组部分*/
   if (nasize < oldasize) {  /* array part must shrink? */
     t->sizearray = nasize;
@@ -380,16 +602,13 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
     luaM_reallocvector(L, t->array, oldasize, nasize, TValue);
   }
   /* re-insert elements from hash part */
-  for (j = oldhsize - 1; j >= 0; j--) {
-    Node *old = nold + j;
-    if (!ttisnil(gval(old))) {
-      /* doesn't need barrier/invalidate cache, as entry was
-         already present in the table */
-      setobjt2t(L, luaH_set(L, t, gkey(old)), gval(old));
-    }
-  }
-  if (oldhsize > 0)  /* not the dummy node? */
+  reinsert(L, t, nold, oldhsize);
+  if (oldhsize > 0 && nold != saved)  /* not the dummy node? */
     luaM_freearray(L, nold, cast(size_t, oldhsize)); /* free old hash */
+  if (pending != NULL) {
+    reinsert(L, t, pending, pendingsize);
+    luaM_freearray(L, pending, cast(size_t, pendingsize));
+  }
 }
 
 
@@ -398,6 +617,7 @@ void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
   luaH_resize(L, t, nasize, nsize);
 }
 
+
 /*
 ** nums[i] = number of keys 'k' where 2^(i - 1) < k <= 2^i
 */
@@ -432,26 +652,94 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
 */
 
 
-Table *luaH_new (lua_State *L) {
+static Table *newtable (lua_State *L, size_t room) {
   /*分配一个Table对象，转换为GCObject对象添加到链表global_State->allgc链表*/
-  GCObject *o = luaC_newobj(L, LUA_TTABLE, sizeof(Table));
+  GCObject *o = luaC_newobj(L, LUA_TTABLE,
+                            sizeof(Table) + sizeof(TValue) * room);
   /*转换为Table类型对象*/
   Table *t = gco2t(o);
   t->metatable = NULL;
   t->flags = cast_byte(~0);
+  t->frozen = 0;
   t->array = NULL;
   t->sizearray = 0;
+  t->border = 0;
+  t->cursor = 0;
+  t->oldnode = NULL;
+  t->oldlsizenode = 0;
+  t->oldpos = 0;
+  t->shape = NULL;
+  t->slots = NULL;
+  t->sizeslots = 0;
+  t->sizeinline = cast_byte(room);
   /*初始化Table*/
   setnodevector(L, t, 0);
   return t;
 }
 
 
+Table *luaH_new (lua_State *L) {
+  return newtable(L, 0);
+}
+
+
+/*
+** Create an empty table that is about to be sized to 'nasize' and
+** 'nhsize', by 'luaH_presize' if 'record' is true or else by
+** 'luaH_resize'. When its node vector (or its slots, if it will be
+** shaped) fits in LUAI_INLINENODES nodes, that room is allocated
+** together with the header. (The caller must anchor the table before
+** sizing it.)
+*/
+Table *luaH_newsized (lua_State *L, unsigned int nasize,
+                      unsigned int nhsize, int record) {
+  size_t room;
+  if (record && shapable(G(L), nasize, nhsize))  /* will be shaped? */
+    room = nhsize;  /* room for its slots */
+  else if (nhsize > 0 && nhsize <= LUAI_INLINENODES)  /* room for nodes */
+    room = roomfornodes(cast(size_t, twoto(luaO_ceillog2(nhsize))));
+  else
+    room = 0;
+  return newtable(L, (room <= MAXINLINEROOM) ? room : 0);
+}
+
+
 void luaH_free (lua_State *L, Table *t) {
-  if (!isdummy(t))
+  if (!isdummy(t) && !hasinlinenodes(t))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
+  if (t->oldnode != NULL)
+    freeoldnode(L, t);
+  if (!hasinlineslots(t))
+    luaM_freearray(L, t->slots, t->sizeslots);
   luaM_freearray(L, t->array, t->sizearray);
-  luaM_free(L, t);
+  luaM_freemem(L, t, sizetable(t));
+}
+
+
+/*
+** Remove all entries from table 't', keeping its array and hash parts
+** allocated (and its metatable), so that it can be refilled without
+** any allocation. No barrier is needed, as no value is stored.
+*/
+void luaH_clear (lua_State *L, Table *t) {
+  unsigned int i;
+  if (isfrozen(t)) luaG_frozenerror(L);
+  for (i = 0; i < t->sizearray; i++)
+    setnilvalue(&t->array[i]);
+  for (i = 0; i < t->sizeslots; i++)  /* a shaped table keeps its shape */
+    setnilvalue(&t->slots[i]);
+  if (t->oldnode != NULL)
+    freeoldnode(L, t);
+  if (!isdummy(t)) {
+    int size = sizenode(t);
+    for (i = 0; i < cast(unsigned int, size); i++) {
+      Node *n = gnode(t, i);
+      gnext(n) = 0;
+      setnilvalue(wgkey(n));
+      setnilvalue(gval(n));
+    }
+    t->lastfree = gnode(t, size);  /* all positions are free */
+  }
 }
 
 
@@ -475,37 +763,20 @@ static Node *getfreepos (Table *t) {
 ** position is free. If not, check whether colliding node is in its main
 ** position or not: if it is not, move colliding node to an empty place and
 ** put new key in its main position; otherwise (colliding node is in its main
-** position), new key goes to an empty position.
+** position), new key goes to an empty position. Returns NULL if there is
+** no free place for the key.
 */
-/*添加新的节点到hash表中*/
-TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
-  Node *mp;
-  TValue aux;
-  if (ttisnil(key)) luaG_runerror(L, "table index is nil");
-  /*float类型*/
-  else if (ttisfloat(key)) {
-    lua_Integer k;
-    if (luaV_tointeger(key, &k, 0)) {  /* does index fit in an integer? */
-      setivalue(&aux, k);
-      key = &aux;  /* insert it as an integer */
-    }
-    else if (luai_numisnan(fltvalue(key)))
-      luaG_runerror(L, "table index is NaN");
-  }
+static TValue *insertkey (lua_State *L, Table *t, const TValue *key) {
   /*根据不同类型计算出hash值并返回对应的hash节点*/
-  mp = mainposition(t, key);
+  Node *mp = mainposition(t, key);
   /*主位置被占用*/
   if (!ttisnil(gval(mp)) || isdummy(t)) {  /* main position is taken? */
     Node *othern;
 	/*从后向前查找最后一个空闲位置*/
     Node *f = getfreepos(t);  /* get a free place */
-  	/*找不到空闲位置，扩大hash表然后再次插入*/
-    if (f == NULL) {  /* cannot find a free place? */
-      rehash(L, t, key);  /* grow table */
-      /* whatever called 'newkey' takes care of TM cache */
-	  /*插入后直接返回*/
-      return luaH_set(L, t, key);  /* insert key into grown table */
-    }
+  	/*找不到空闲位置，返回NULL由调用者扩大hash表然后再次插入*/
+    if (f == NULL)  /* cannot find a free place? */
+      return NULL;
     lua_assert(!isdummy(t));
 	/*找到空闲位置，然后根据目前主位置中存储的节点mp的key查找对应的主位置othern*/
     othern = mainposition(t, gkey(mp));
@@ -550,13 +821,245 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
   /*拷贝key中value到mp->i_key中，此时的mp可能是在冲突节点存在于主位置的情况下找到的空闲节点，也可能是
   该key对应的主位置节点*/
   setnodekey(L, &mp->i_key, key);
-  luaC_barrierback(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   /*返回该节点中保存的TValue类型的值*/
   return gval(mp);
 }
 
 
+/*
+** Move the entries of at most 'n' nodes from the old node vector of
+** 't' to its current one, going down from 't->oldpos'. Migrated nodes
+** get a nil key (keeping their 'next' field), so that searches along
+** chains in the old vector skip them. Frees the old vector when done.
+** Returns 0 if the current vector became full; the whole table must be
+** rehashed then.
+*/
+static int migrate (lua_State *L, Table *t, unsigned int n) {
+  for (; n > 0 && t->oldpos > 0; n--) {
+    Node *old = t->oldnode + (t->oldpos - 1);
+    if (!ttisnil(gval(old))) {
+      /* no barrier needed, as entry was already present in the table */
+      TValue *slot = insertkey(L, t, gkey(old));
+      if (slot == NULL)
+        return 0;
+      setobjt2t(L, slot, gval(old));
+    }
+    setnilvalue(wgkey(old));
+    setnilvalue(gval(old));
+    t->oldpos--;
+  }
+  if (t->oldpos == 0)
+    freeoldnode(L, t);
+  return 1;
+}
+
+
+/*
+** {=============================================================
+** Shapes
+** ==============================================================
+*/
+
+/*
+** A table built by a small record constructor starts "shaped" (see
+** 'luaH_presize'): its hash part is the dummy node, and its string
+** keys are kept in a shape, shared by all tables that got the same
+** keys in the same order, while the table itself keeps only their
+** values, in 'slots'. Shapes form a tree rooted at 'g->rootshape',
+** each one extending its parent with one key. They live until the
+** state is closed, and the collector marks their keys in the atomic
+** phase. A write that no shape can describe (a key that is not a
+** short string, too many keys, a resize) moves the entries to an
+** ordinary hash part, and the table stays that way.
+*/
+
+
+#define sizeshape(n)	(cast(int, sizeof(Shape)) + \
+                         cast(int, sizeof(TString *) * ((n) - 1)))
+
+/* a shape with this many children gets no new ones */
+#define MAXSHAPECHILDREN	8
+
+
+static Shape *newshape (lua_State *L, Shape *parent, TString *key) {
+  int n = (parent == NULL) ? 0 : parent->nkeys + 1;
+  Shape *s = cast(Shape *, luaM_malloc(L, sizeshape(n)));
+  s->child = s->sibling = NULL;
+  s->nkeys = n;
+  if (parent != NULL) {
+    int i;
+    for (i = 0; i < parent->nkeys; i++)
+      s->keys[i] = parent->keys[i];
+    s->keys[n - 1] = key;
+    s->sibling = parent->child;  /* link it as a child of 'parent' */
+    parent->child = s;
+  }
+  G(L)->nshapes++;
+  return s;
+}
+
+
+void luaH_freeshapes (lua_State *L, Shape *s) {
+  while (s != NULL) {
+    Shape *next = s->sibling;
+    luaH_freeshapes(L, s->child);
+    luaM_freemem(L, s, sizeshape(s->nkeys));
+    s = next;
+  }
+}
+
+
+/*
+** Set the initial sizes of a table built by a constructor. A record
+** constructor ('{id=..., name=...}', with no list items) with at most
+** LUAI_MAXSHAPEKEYS fields gets a shaped table, with room for its
+** fields in 'slots'.
+*/
+void luaH_presize (lua_State *L, Table *t, unsigned int nasize,
+                                           unsigned int nhsize) {
+  global_State *g = G(L);
+  if (shapable(g, nasize, nhsize)) {
+    unsigned int i;
+    if (g->rootshape == NULL)
+      g->rootshape = newshape(L, NULL, NULL);
+    if (nhsize <= t->sizeinline) {  /* slots fit in the header? */
+      nhsize = t->sizeinline;  /* use all the room */
+      t->slots = inlineroom(t);
+    }
+    else
+      t->slots = luaM_newvector(L, nhsize, TValue);
+    for (i = 0; i < nhsize; i++)
+      setnilvalue(&t->slots[i]);
+    t->sizeslots = cast_byte(nhsize);
+    t->shape = g->rootshape;
+  }
+  else
+    luaH_resize(L, t, nasize, nhsize);
+}
+
+
+/*
+** Add short string 'key' to shaped table 't', moving it to the child
+** shape for that key. Returns the key's (empty) slot, or NULL if no
+** shape can describe the new key set.
+*/
+static TValue *shapeadd (lua_State *L, Table *t, TString *key) {
+  Shape *s = t->shape;
+  Shape *c;
+  int n = s->nkeys;
+  int nchildren = 0;
+  if (n >= LUAI_MAXSHAPEKEYS)
+    return NULL;
+  for (c = s->child; c != NULL && c->keys[n] != key; c = c->sibling)
+    nchildren++;
+  if (c == NULL) {  /* no table got this key set before? */
+    if (nchildren >= MAXSHAPECHILDREN || G(L)->nshapes >= LUAI_MAXSHAPES)
+      return NULL;  /* too many key sets; use an ordinary hash part */
+    c = newshape(L, s, key);
+  }
+  if (n >= t->sizeslots) {  /* no room for another value? */
+    int i;
+    int size = (n > 0) ? 2 * n : 1;
+    if (size > LUAI_MAXSHAPEKEYS)
+      size = LUAI_MAXSHAPEKEYS;
+    if (hasinlineslots(t)) {  /* move slots out of the header */
+      TValue *slots = luaM_newvector(L, size, TValue);
+      for (i = 0; i < t->sizeslots; i++)
+        setobj(L, &slots[i], &t->slots[i]);
+      t->slots = slots;
+    }
+    else
+      luaM_reallocvector(L, t->slots, t->sizeslots, size, TValue);
+    for (i = t->sizeslots; i < size; i++)
+      setnilvalue(&t->slots[i]);
+    t->sizeslots = cast_byte(size);
+  }
+  t->shape = c;
+  return &t->slots[n];
+}
+
+
+/*
+** Move the entries of shaped table 't' to an ordinary hash part, just
+** large enough for them. Returns their number. Slots kept in the header
+** are copied aside when the new node vector fits there too: then nothing
+** is allocated, so no collection can miss the values being moved.
+*/
+static unsigned int unshape (lua_State *L, Table *t) {
+  Shape *s = t->shape;
+  TValue *slots = t->slots;
+  TValue saved[MAXINLINEROOM + 1];
+  int inlined = hasinlineslots(t);
+  unsigned int n = 0;
+  int i;
+  lua_assert(isdummy(t) && t->oldnode == NULL);
+  for (i = 0; i < s->nkeys; i++) {
+    if (!ttisnil(&slots[i]))
+      n++;
+  }
+  if (inlined && (n == 0 || cast(size_t, twoto(luaO_ceillog2(n))) <=
+                            sizeinlinenodes(t))) {
+    for (i = 0; i < s->nkeys; i++)
+      setobj(L, &saved[i], &slots[i]);
+    slots = saved;
+    t->slots = NULL;  /* free the room for the node vector */
+  }
+  setnodevector(L, t, n);
+  t->shape = NULL;
+  t->slots = NULL;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!ttisnil(&slots[i])) {
+      TValue k;
+      setsvalue(L, &k, s->keys[i]);
+      /* no barrier needed: shape keys are always marked */
+      setobjt2t(L, insertkey(L, t, &k), &slots[i]);
+    }
+  }
+  if (!inlined)  /* slots not in the header? */
+    luaM_freearray(L, slots, t->sizeslots);
+  t->sizeslots = 0;
+  return n;
+}
+
+/* }============================================================= */
+
+
+/*添加新的节点到hash表中*/
+TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
+  TValue aux;
+  TValue *slot;
+  if (isfrozen(t)) luaG_frozenerror(L);
+  if (ttisnil(key)) luaG_runerror(L, "table index is nil");
+  /*float类型*/
+  else if (ttisfloat(key)) {
+    lua_Integer k;
+    if (luaV_tointeger(key, &k, 0)) {  /* does index fit in an integer? */
+      setivalue(&aux, k);
+      key = &aux;  /* insert it as an integer */
+    }
+    else if (luai_numisnan(fltvalue(key)))
+      luaG_runerror(L, "table index is NaN");
+  }
+  if (isshaped(t)) {
+    if (ttisshrstring(key) && (slot = shapeadd(L, t, tsvalue(key))) != NULL)
+      return slot;  /* no barrier needed: shape keys are always marked */
+    unshape(L, t);
+  }
+  if (t->oldnode == NULL || migrate(L, t, LUAI_HASHMIGRATESTEP))
+    slot = insertkey(L, t, key);
+  else
+    slot = NULL;  /* no room to migrate old entries */
+  if (slot == NULL) {  /* cannot find a free place? */
+    rehash(L, t, key);  /* grow table */
+    /* whatever called 'newkey' takes care of TM cache */
+    return luaH_set(L, t, key);  /* insert key into grown table */
+  }
+  luaC_barrierback(L, t, key);
+  return slot;
+}
+
+
 /*
 ** search function for integers
 */
@@ -581,6 +1084,11 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
         n += nx;
       }
     }
+    if (t->oldnode != NULL) {  /* table being migrated? */
+      TValue k;
+      setivalue(&k, key);
+      return getold(t, &k);
+    }
     return luaO_nilobject;
   }
 }
@@ -590,16 +1098,32 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
 ** search function for short strings
 */
 const TValue *luaH_getshortstr (Table *t, TString *key) {
-  Node *n = hashstr(t, key);
+  Node *n;
   lua_assert(key->tt == LUA_TSHRSTR);
+  if (isshaped(t)) {
+    Shape *s = t->shape;
+    int i;
+    for (i = 0; i < s->nkeys; i++) {
+      if (eqshrstr(s->keys[i], key))
+        return &t->slots[i];
+    }
+    return luaO_nilobject;
+  }
+  n = hashstr(t, key);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
     const TValue *k = gkey(n);
     if (ttisshrstring(k) && eqshrstr(tsvalue(k), key))
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
-      if (nx == 0)
+      if (nx == 0) {
+        if (t->oldnode != NULL) {  /* table being migrated? */
+          TValue ko;
+          setsvalue(cast(lua_State *, NULL), &ko, key);
+          return getold(t, &ko);
+        }
         return luaO_nilobject;  /* not found */
+      }
       n += nx;
     }
   }
@@ -620,8 +1144,8 @@ static const TValue *getgeneric (Table *t, const TValue *key) {
 	/*匹配下一个节点*/
     else {
       int nx = gnext(n);
-      if (nx == 0)
-        return luaO_nilobject;  /* not found */
+      if (nx == 0)  /* not found (maybe not migrated yet) */
+        return (t->oldnode != NULL) ? getold(t, key) : luaO_nilobject;
       n += nx;
     }
   }
@@ -719,21 +1243,42 @@ static int unbound_search (Table *t, unsigned int j) {
 }
 
 
+/*
+** Check whether 'b' is a boundary inside the array part of 't'
+** (assuming 'b' < 'sizearray', so that t[b + 1] is in the array).
+*/
+#define isborder(t,b)	(ttisnil(&(t)->array[b]) && \
+                         ((b) == 0 || !ttisnil(&(t)->array[(b) - 1])))
+
+
 /*
 ** Try to find a boundary in table 't'. A 'boundary' is an integer index
 ** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
+** The last boundary found in the array part is kept in 't->border'. It
+** is only a hint, validated on each call: when it is still a boundary,
+** or when its neighbor is (after an append 't[#t + 1] = v' or after
+** 't[#t] = nil'), the result comes in constant time.
 */
 int luaH_getn (Table *t) {
   unsigned int j = t->sizearray;
   if (j > 0 && ttisnil(&t->array[j - 1])) {
-    /* there is a boundary in the array part: (binary) search for it */
+    /* there is a boundary in the array part */
+    unsigned int b = t->border;
     unsigned int i = 0;
-    while (j - i > 1) {
+    if (b < j) {  /* try the hint and its neighbors */
+      if (isborder(t, b))
+        return b;
+      else if (b + 1 < j && isborder(t, b + 1))
+        return (t->border = b + 1);
+      else if (b > 0 && isborder(t, b - 1))
+        return (t->border = b - 1);
+    }
+    while (j - i > 1) {  /* (binary) search for it */
       unsigned int m = (i+j)/2;
       if (ttisnil(&t->array[m - 1])) j = m;
       else i = m;
     }
-    return i;
+    return (t->border = i);
   }
   /* else must find a boundary in hash part */
   else if (isdummy(t))  /* hash part is empty? */
@@ -743,6 +1288,212 @@ int luaH_getn (Table *t) {
 
 
 
+
+/*
+** {======================================================
+** Sorting the array part
+** =======================================================
+*/
+
+/* arrays up to this size are sorted by insertion */
+#if !defined(LUAI_SORTCUTOFF)
+#define LUAI_SORTCUTOFF		16
+#endif
+
+/* integer arrays at least this big are sorted by radix */
+#if !defined(LUAI_RADIXMIN)
+#define LUAI_RADIXMIN		256
+#endif
+
+
+typedef int (*SortLT) (lua_State *L, const TValue *a, const TValue *b);
+
+
+static int intlt (lua_State *L, const TValue *a, const TValue *b) {
+  UNUSED(L);
+  return ivalue(a) < ivalue(b);
+}
+
+
+static int fltlt (lua_State *L, const TValue *a, const TValue *b) {
+  UNUSED(L);
+  return luai_numlt(fltvalue(a), fltvalue(b));
+}
+
+
+#define swapobj(L,a,b)	{ TValue temp_; setobj(L, &temp_, a); \
+                          setobj(L, a, b); setobj(L, b, &temp_); }
+
+
+static void insertionsort (lua_State *L, TValue *a, unsigned int n,
+                           SortLT lt) {
+  unsigned int i, j;
+  for (i = 1; i < n; i++) {
+    TValue v;
+    setobj(L, &v, &a[i]);
+    for (j = i; j > 0 && lt(L, &v, &a[j - 1]); j--)
+      setobj(L, &a[j], &a[j - 1]);
+    setobj(L, &a[j], &v);
+  }
+}
+
+
+static void siftdown (lua_State *L, TValue *a, unsigned int i,
+                      unsigned int n, SortLT lt) {
+  TValue v;
+  setobj(L, &v, &a[i]);
+  for (;;) {
+    unsigned int c = 2 * i + 1;  /* left child */
+    if (c >= n) break;
+    if (c + 1 < n && lt(L, &a[c], &a[c + 1]))
+      c++;  /* use larger child */
+    if (!lt(L, &v, &a[c])) break;
+    setobj(L, &a[i], &a[c]);
+    i = c;
+  }
+  setobj(L, &a[i], &v);
+}
+
+
+static void heapsort (lua_State *L, TValue *a, unsigned int n, SortLT lt) {
+  unsigned int i;
+  for (i = n / 2; i-- > 0; )
+    siftdown(L, a, i, n, lt);
+  for (i = n; i-- > 1; ) {
+    swapobj(L, &a[0], &a[i]);
+    siftdown(L, a, 0, i, lt);
+  }
+}
+
+
+/*
+** Quicksort with median-of-three pivot and Hoare partition; when
+** recursion gets too deep (bad pivots) it switches to heapsort, so
+** worst case is O(n log n). Recurses on the smaller half only.
+*/
+static void introsort (lua_State *L, TValue *a, unsigned int n, int depth,
+                       SortLT lt) {
+  while (n > LUAI_SORTCUTOFF) {
+    unsigned int mid = (n - 1) / 2;
+    unsigned int i, j;
+    TValue p;
+    if (depth-- == 0) {
+      heapsort(L, a, n, lt);
+      return;
+    }
+    if (lt(L, &a[mid], &a[0])) swapobj(L, &a[mid], &a[0]);
+    if (lt(L, &a[n - 1], &a[mid])) {
+      swapobj(L, &a[n - 1], &a[mid]);
+      if (lt(L, &a[mid], &a[0])) swapobj(L, &a[mid], &a[0]);
+    }
+    setobj(L, &p, &a[mid]);  /* pivot */
+    i = 0; j = n - 1;
+    for (;;) {  /* invariant: a[0..i) <= p <= a(j..n) */
+      while (lt(L, &a[i], &p)) i++;
+      while (lt(L, &p, &a[j])) j--;
+      if (i >= j) break;
+      swapobj(L, &a[i], &a[j]);
+      i++; j--;
+    }
+    /* now a[0..j] <= p <= a[j+1..n) */
+    if (j + 1 < n - (j + 1)) {
+      introsort(L, a, j + 1, depth, lt);
+      a += j + 1; n -= j + 1;
+    }
+    else {
+      introsort(L, a + j + 1, n - (j + 1), depth, lt);
+      n = j + 1;
+    }
+  }
+  insertionsort(L, a, n, lt);
+}
+
+
+/*
+** LSD radix sort on bytes, for integer arrays. Integers are biased
+** (sign bit flipped) so that unsigned order matches signed order;
+** passes where all keys share the same byte are skipped.
+*/
+static void radixsort (lua_State *L, TValue *a, unsigned int n) {
+  const lua_Unsigned bias = ~((~(lua_Unsigned)0) >> 1);
+  lua_Unsigned *buff = luaM_newvector(L, 2 * cast(size_t, n), lua_Unsigned);
+  lua_Unsigned *src = buff;
+  lua_Unsigned *dst = buff + n;
+  unsigned int count[256];
+  unsigned int i;
+  int shift;
+  for (i = 0; i < n; i++)
+    src[i] = l_castS2U(ivalue(&a[i])) ^ bias;
+  for (shift = 0; shift < cast_int(sizeof(lua_Unsigned) * CHAR_BIT);
+       shift += 8) {
+    unsigned int sum = 0;
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+      count[(src[i] >> shift) & 0xff]++;
+    if (count[(src[0] >> shift) & 0xff] == n)
+      continue;  /* all keys equal in this byte */
+    for (i = 0; i < 256; i++) {  /* compute starting positions */
+      unsigned int c = count[i];
+      count[i] = sum;
+      sum += c;
+    }
+    for (i = 0; i < n; i++)
+      dst[count[(src[i] >> shift) & 0xff]++] = src[i];
+    { lua_Unsigned *aux = src; src = dst; dst = aux; }
+  }
+  for (i = 0; i < n; i++)
+    setivalue(&a[i], l_castU2S(src[i] ^ bias));
+  luaM_freearray(L, buff, 2 * cast(size_t, n));
+}
+
+
+/*
+** Sort in place, with the standard '<' order, elements 1..n of table
+** 't', if the table has no metatable and these elements are all in its
+** array part and are all integers, all floats (no NaN), or all strings.
+** Returns 0 without touching the table otherwise, so that the caller
+** falls back to the generic sort. (Moving values inside the same table
+** does not need GC barriers.)
+*/
+int luaH_sort (lua_State *L, Table *t, lua_Integer n) {
+  TValue *a = t->array;
+  unsigned int i, size;
+  int depth = 0;
+  SortLT lt;
+  if (t->metatable != NULL || isfrozen(t) ||
+      n < 2 || l_castS2U(n) > t->sizearray)
+    return 0;
+  size = cast(unsigned int, n);
+  if (ttisinteger(&a[0])) {
+    for (i = 1; i < size; i++)
+      if (!ttisinteger(&a[i])) return 0;
+    if (size >= LUAI_RADIXMIN) {
+      radixsort(L, a, size);
+      return 1;
+    }
+    lt = intlt;
+  }
+  else if (ttisfloat(&a[0])) {
+    for (i = 0; i < size; i++)
+      if (!ttisfloat(&a[i]) || luai_numisnan(fltvalue(&a[i]))) return 0;
+    lt = fltlt;
+  }
+  else if (ttisstring(&a[0])) {
+    for (i = 1; i < size; i++)
+      if (!ttisstring(&a[i])) return 0;
+    lt = luaV_lessthan;
+  }
+  else return 0;
+  for (i = size; i > 1; i >>= 1)
+    depth += 2;  /* 2 * log2(size) */
+  introsort(L, a, size, depth, lt);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
@@ -28,6 +28,14 @@
 #define invalidateTMcache(t)	((t)->flags = 0)
 
 
+/* true when 't' was frozen by 'lua_freeze' */
+#define isfrozen(t)		((t)->frozen)
+
+
+/* true when 't' keeps its string keys in a shape (see ltable.c) */
+#define isshaped(t)		((t)->shape != NULL)
+
+
 /* true when 't' is using 'dummynode' as its hash part */
 #define isdummy(t)		((t)->lastfree == NULL)
 
@@ -36,6 +44,24 @@
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
 
 
+/*
+** Room for 't->sizeinline' TValues allocated with the header of 't'
+** (see 'luaH_newsized'); it holds either the node vector or the slots
+** of a shaped table.
+*/
+#define inlineroom(t)		cast(TValue *, (t) + 1)
+#define inlinenodes(t)		cast(Node *, inlineroom(t))
+#define sizeinlinenodes(t)	((t)->sizeinline * sizeof(TValue) / sizeof(Node))
+#define hasinlinenodes(t)	((t)->sizeinline > 0 && \
+                                 (t)->node == inlinenodes(t))
+#define hasinlineslots(t)	((t)->sizeinline > 0 && \
+                                 (t)->slots == inlineroom(t))
+
+/* size of the allocation holding the header of 't' */
+#define sizetable(t)	(sizeof(Table) + \
+                         sizeof(TValue) * cast(size_t, (t)->sizeinline))
+
+
 /* returns the key, given the value of a table entry */
 #define keyfromval(v) \
   (gkey(cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))))
@@ -50,12 +76,19 @@ LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
 LUAI_FUNC Table *luaH_new (lua_State *L);
+LUAI_FUNC Table *luaH_newsized (lua_State *L, unsigned int nasize,
+                                unsigned int nhsize, int record);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
+LUAI_FUNC void luaH_presize (lua_State *L, Table *t, unsigned int nasize,
+                                                     unsigned int nhsize);
+LUAI_FUNC void luaH_freeshapes (lua_State *L, Shape *s);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+LUAI_FUNC void luaH_clear (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
+LUAI_FUNC int luaH_sort (lua_State *L, Table *t, lua_Integer n);
 
 
 #if defined(LUA_DEBUG)
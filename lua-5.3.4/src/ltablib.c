@@ -173,6 +173,8 @@ static int tconcat (lua_State *L) {
   const char *sep = luaL_optlstring(L, 2, "", &lsep);
   lua_Integer i = luaL_optinteger(L, 3, 1);
   last = luaL_optinteger(L, 4, last);
+  if (lua_concatarray(L, 1, sep, lsep, i, last))
+    return 1;  /* done directly over the array part */
   luaL_buffinit(L, &b);
   for (; i < last; i++) {
     addfield(L, &b, i);
@@ -223,6 +225,56 @@ static int unpack (lua_State *L) {
 
 
 
+/*
+** {======================================================
+** Preallocation and reuse
+** =======================================================
+*/
+
+static int tnew (lua_State *L) {
+  lua_Integer narr = luaL_optinteger(L, 1, 0);
+  lua_Integer nrec = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, 0 <= narr && narr < INT_MAX, 1, "out of range");
+  luaL_argcheck(L, 0 <= nrec && nrec < INT_MAX, 2, "out of range");
+  lua_createtable(L, (int)narr, (int)nrec);
+  return 1;
+}
+
+
+static int tclear (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_cleartable(L, 1);
+  return 0;
+}
+
+/* }====================================================== */
+
+
+
+/*
+** {======================================================
+** Freeze
+** =======================================================
+*/
+
+static int freeze (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_freeze(L, 1, lua_toboolean(L, 2));
+  lua_settop(L, 1);
+  return 1;  /* return the table */
+}
+
+
+static int isfrozen (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_pushboolean(L, lua_isfrozen(L, 1));
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** Quicksort
@@ -415,7 +467,8 @@ static int sort (lua_State *L) {
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
     lua_settop(L, 2);  /* make sure there are two arguments */
-    auxsort(L, 1, (IdxT)n, 0);
+    if (!lua_isnil(L, 2) || !lua_sortarray(L, 1, n))  /* no fast path? */
+      auxsort(L, 1, (IdxT)n, 0);
   }
   return 0;
 }
@@ -424,7 +477,10 @@ static int sort (lua_State *L) {
 
 
 static const luaL_Reg tab_funcs[] = {
+  {"clear", tclear},
   {"concat", tconcat},
+  {"freeze", freeze},
+  {"isfrozen", isfrozen},
 #if defined(LUA_COMPAT_MAXN)
   {"maxn", maxn},
 #endif
@@ -433,6 +489,7 @@ static const luaL_Reg tab_funcs[] = {
   {"unpack", unpack},
   {"remove", tremove},
   {"move", tmove},
+  {"new", tnew},
   {"sort", sort},
   {NULL, NULL}
 };
@@ -0,0 +1,627 @@
+/*
+** $Id: lthreadlib.c $
+** Thread pool library: Lua tasks run by worker states on OS threads
+** See Copyright Notice in lua.h
+*/
+
+#define lthreadlib_c
+#define LUA_LIB
+
+#include "lprefix.h"
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+#if defined(LUA_USE_LINUX)		/* { */
+
+#include <pthread.h>
+
+
+/* maximum number of workers in a pool */
+#if !defined(LUA_MAXWORKERS)
+#define LUA_MAXWORKERS		1024
+#endif
+
+
+#define POOLHANDLE	"threadpool.pool"
+#define FUTUREHANDLE	"threadpool.future"
+
+
+/* copy a string to a block from 'malloc'; NULL on failure */
+static char *copybytes (const char *s, size_t l) {
+  char *p = (char *)malloc(l + 1);
+  if (p != NULL) {
+    memcpy(p, s, l);
+    p[l] = '\0';
+  }
+  return p;
+}
+
+
+/*
+** {======================================================
+** Pool structures. They live outside any Lua state, in memory from
+** 'malloc', as they are shared by the submitting state and all
+** workers.
+** =======================================================
+*/
+
+#define F_PENDING	0
+#define F_OK		1
+#define F_ERROR		2
+
+
+typedef struct Future {
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int state;  /* F_PENDING, F_OK, or F_ERROR */
+  char *data;  /* serialized results (or error message) */
+  size_t size;
+  int refs;  /* owners: the task and the Lua userdata */
+} Future;
+
+
+typedef struct Task {
+  char *code;  /* chunk (source or binary) */
+  size_t codesize;
+  char *args;  /* serialized arguments */
+  size_t argssize;
+  Future *fut;
+} Task;
+
+
+/*
+** Work-stealing deque: its worker takes tasks from the bottom (most
+** recent first), other workers steal from the top (oldest first).
+*/
+typedef struct Deque {
+  pthread_mutex_t lock;
+  Task **items;  /* circular buffer */
+  unsigned int top, bottom;  /* 'bottom - top' is the number of tasks */
+  unsigned int size;  /* always a power of 2 */
+} Deque;
+
+
+struct Pool;
+
+typedef struct Worker {
+  pthread_t th;
+  struct Pool *pool;
+  int id;
+  int started;  /* thread was created */
+  Deque dq;
+} Worker;
+
+
+typedef struct Pool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;  /* signals new tasks (or shutdown) to workers */
+  pthread_cond_t ready;  /* signals end of worker initialization */
+  int pending;  /* tasks queued and not yet taken by a worker */
+  int shutdown;
+  int ninit;  /* workers that finished initialization */
+  char *initerr;  /* first initialization error, if any */
+  const char *init;  /* initialization chunk (only during creation) */
+  size_t initsize;
+  unsigned int next;  /* next worker to receive a submitted task */
+  int nworkers;
+  Worker *workers;
+} Pool;
+
+
+static void releasefuture (Future *f) {
+  int refs;
+  pthread_mutex_lock(&f->lock);
+  refs = --f->refs;
+  pthread_mutex_unlock(&f->lock);
+  if (refs == 0) {
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->done);
+    free(f->data);
+    free(f);
+  }
+}
+
+
+static void freetask (Task *t) {
+  free(t->code);
+  free(t->args);
+  releasefuture(t->fut);
+  free(t);
+}
+
+
+static int dq_push (Deque *dq, Task *t) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom - dq->top == dq->size) {  /* full? */
+    unsigned int i, nsize = (dq->size > 0) ? 2 * dq->size : 64;
+    Task **items = (Task **)malloc(nsize * sizeof(Task *));
+    if (items == NULL) {
+      pthread_mutex_unlock(&dq->lock);
+      return 0;
+    }
+    for (i = dq->top; i != dq->bottom; i++)
+      items[i & (nsize - 1)] = dq->items[i & (dq->size - 1)];
+    free(dq->items);
+    dq->items = items;
+    dq->size = nsize;
+  }
+  dq->items[dq->bottom++ & (dq->size - 1)] = t;
+  pthread_mutex_unlock(&dq->lock);
+  return 1;
+}
+
+
+static Task *dq_take (Deque *dq, int steal) {
+  Task *t = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->bottom != dq->top) {
+    if (steal)
+      t = dq->items[dq->top++ & (dq->size - 1)];
+    else
+      t = dq->items[--dq->bottom & (dq->size - 1)];
+  }
+  pthread_mutex_unlock(&dq->lock);
+  return t;
+}
+
+
+/*
+** Get a task for worker 'w': first from its own deque, then stealing
+** from the others. Blocks while there is nothing to do; returns NULL
+** when the pool is shut down and all tasks are done.
+*/
+static Task *gettask (Worker *w) {
+  Pool *p = w->pool;
+  for (;;) {
+    Task *t = dq_take(&w->dq, 0);
+    int i;
+    for (i = 1; t == NULL && i < p->nworkers; i++)
+      t = dq_take(&p->workers[(w->id + i) % p->nworkers].dq, 1);
+    pthread_mutex_lock(&p->lock);
+    if (t != NULL) {
+      p->pending--;
+      pthread_mutex_unlock(&p->lock);
+      return t;
+    }
+    while (p->pending == 0 && !p->shutdown)
+      pthread_cond_wait(&p->wake, &p->lock);
+    if (p->pending == 0) {  /* shut down and nothing left? */
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Workers
+** =======================================================
+*/
+
+/* copy the error message at the top of 'L' to 'malloc' */
+static char *copymessage (lua_State *L, size_t *l) {
+  const char *msg = lua_tolstring(L, -1, l);
+  char *m;
+  if (msg == NULL) {
+    msg = "(error object is not a string)";
+    *l = strlen(msg);
+  }
+  if ((m = copybytes(msg, *l)) == NULL)
+    *l = 0;
+  return m;
+}
+
+
+static int runtask (lua_State *L) {
+  Task *t = (Task *)lua_touserdata(L, 1);
+  int nargs;
+  Future *f = t->fut;
+  const char *res;
+  lua_settop(L, 0);
+  if (luaL_loadbufferx(L, t->code, t->codesize, "=task", NULL) != LUA_OK)
+    return lua_error(L);
+  nargs = luaL_deserialize(L, t->args, t->argssize);
+  lua_call(L, nargs, LUA_MULTRET);
+  luaL_serialize(L, 1, lua_gettop(L));
+  res = lua_tolstring(L, -1, &f->size);
+  if ((f->data = copybytes(res, f->size)) == NULL)
+    return luaL_error(L, "not enough memory");
+  return 0;
+}
+
+
+static void dotask (lua_State *L, Task *t) {
+  Future *f = t->fut;
+  int state;
+  lua_pushcfunction(L, runtask);
+  lua_pushlightuserdata(L, t);
+  if (lua_pcall(L, 1, 0, 0) == LUA_OK)
+    state = F_OK;
+  else {
+    free(f->data);
+    f->data = copymessage(L, &f->size);
+    state = F_ERROR;
+  }
+  lua_settop(L, 0);
+  pthread_mutex_lock(&f->lock);
+  f->state = state;
+  pthread_cond_broadcast(&f->done);
+  pthread_mutex_unlock(&f->lock);
+  freetask(t);
+}
+
+
+static void *workermain (void *ud) {
+  Worker *w = (Worker *)ud;
+  Pool *p = w->pool;
+  lua_State *L = luaL_newstate();
+  char *err = NULL;
+  size_t l;
+  if (L == NULL) {
+    static const char msg[] = "cannot create worker state";
+    if ((err = (char *)malloc(sizeof(msg))) != NULL)
+      memcpy(err, msg, sizeof(msg));
+  }
+  else {
+    luaL_openlibs(L);
+    if (p->init != NULL &&
+        (luaL_loadbufferx(L, p->init, p->initsize, "=init", NULL) != LUA_OK ||
+         lua_pcall(L, 0, 0, 0) != LUA_OK))
+      err = copymessage(L, &l);
+    lua_settop(L, 0);
+  }
+  pthread_mutex_lock(&p->lock);
+  if (err != NULL && p->initerr == NULL) p->initerr = err;
+  else free(err);
+  p->ninit++;
+  pthread_cond_signal(&p->ready);
+  pthread_mutex_unlock(&p->lock);
+  if (L != NULL) {
+    Task *t;
+    while ((t = gettask(w)) != NULL)
+      dotask(L, t);
+    lua_close(L);
+  }
+  return NULL;
+}
+
+
+/* stop all workers (after they finish pending tasks) and free 'p' */
+static void destroypool (Pool *p) {
+  int i;
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (i = 0; i < p->nworkers; i++) {
+    if (p->workers[i].started)
+      pthread_join(p->workers[i].th, NULL);
+  }
+  for (i = 0; i < p->nworkers; i++) {
+    Deque *dq = &p->workers[i].dq;
+    lua_assert(dq->top == dq->bottom);
+    free(dq->items);
+    pthread_mutex_destroy(&dq->lock);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  pthread_cond_destroy(&p->ready);
+  free(p->initerr);
+  free(p->workers);
+  free(p);
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Lua interface
+** =======================================================
+*/
+
+static Pool **topool (lua_State *L) {
+  Pool **pp = (Pool **)luaL_checkudata(L, 1, POOLHANDLE);
+  if (*pp == NULL)
+    luaL_error(L, "attempt to use a closed pool");
+  return pp;
+}
+
+
+/*
+** threadpool.new(n [, init]): create a pool with 'n' workers, each one a
+** new state with the standard libraries, where the (optional) chunk
+** 'init' runs before any task.
+*/
+static int tp_new (lua_State *L) {
+  lua_Integer n = luaL_checkinteger(L, 1);
+  size_t initsize;
+  const char *init = luaL_optlstring(L, 2, NULL, &initsize);
+  Pool **pp;
+  Pool *p;
+  int i, nstarted = 0;
+  luaL_argcheck(L, 0 < n && n <= LUA_MAXWORKERS, 1, "invalid number of workers");
+  pp = (Pool **)lua_newuserdata(L, sizeof(Pool *));
+  *pp = NULL;
+  luaL_setmetatable(L, POOLHANDLE);
+  p = (Pool *)calloc(1, sizeof(Pool));
+  if (p == NULL ||
+      (p->workers = (Worker *)calloc((size_t)n, sizeof(Worker))) == NULL) {
+    free(p);
+    return luaL_error(L, "not enough memory");
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->ready, NULL);
+  p->nworkers = (int)n;
+  p->init = init;
+  p->initsize = initsize;
+  for (i = 0; i < p->nworkers; i++) {
+    Worker *w = &p->workers[i];
+    w->pool = p;
+    w->id = i;
+    pthread_mutex_init(&w->dq.lock, NULL);
+  }
+  for (i = 0; i < p->nworkers; i++) {
+    Worker *w = &p->workers[i];
+    if (pthread_create(&w->th, NULL, workermain, w) != 0) break;
+    w->started = 1;
+    nstarted++;
+  }
+  pthread_mutex_lock(&p->lock);
+  while (p->ninit < nstarted)  /* wait for initialization of workers */
+    pthread_cond_wait(&p->ready, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+  p->init = NULL;  /* string may be collected from now on */
+  if (nstarted < p->nworkers || p->initerr != NULL) {
+    lua_pushstring(L, (p->initerr != NULL) ? p->initerr
+                                           : "cannot create worker thread");
+    destroypool(p);
+    return lua_error(L);
+  }
+  *pp = p;
+  return 1;
+}
+
+
+static int writer (lua_State *L, const void *b, size_t size, void *B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)B, (const char *)b, size);
+  return 0;
+}
+
+
+/*
+** A function is sent to a worker as a binary chunk, which the worker
+** loads with its own globals as first upvalue and nil in any other one.
+** So, only functions whose sole upvalue (if any) is '_ENV' are accepted:
+** a function that refers to outer locals would silently see nil there.
+** (Upvalues of functions without debug information have no names, so
+** such functions are refused too.)
+*/
+static void checkupvalues (lua_State *L, int arg) {
+  const char *name;
+  int n;
+  for (n = 1; (name = lua_getupvalue(L, arg, n)) != NULL; n++) {
+    lua_pop(L, 1);
+    if (n > 1 || strcmp(name, "_ENV") != 0)
+      luaL_argerror(L, arg, lua_pushfstring(L,
+                    "function has upvalue '%s' (only _ENV is allowed;"
+                    " pass values as arguments)", name));
+  }
+}
+
+
+/*
+** pool:submit(f, ...): run 'f' with the given arguments in some worker.
+** 'f' is either a chunk or a Lua function with no upvalues other than
+** '_ENV', which in the worker is its globals table. Returns a future for
+** its results.
+*/
+static int tp_submit (lua_State *L) {
+  Pool *p = *topool(L);
+  int nargs = lua_gettop(L) - 2;
+  size_t codesize, argssize;
+  const char *code, *args;
+  Future **fp;
+  Future *f;
+  Task *t;
+  Worker *w;
+  if (lua_type(L, 2) != LUA_TSTRING) {  /* not a chunk? */
+    luaL_Buffer b;
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    checkupvalues(L, 2);
+    lua_pushvalue(L, 2);
+    luaL_buffinit(L, &b);
+    if (lua_dump(L, writer, &b, 0) != 0)
+      return luaL_error(L, "unable to dump given function");
+    luaL_pushresult(&b);
+    lua_replace(L, 2);  /* binary chunk in place of the function */
+    lua_pop(L, 1);
+  }
+  code = lua_tolstring(L, 2, &codesize);
+  luaL_serialize(L, 3, nargs);
+  args = lua_tolstring(L, -1, &argssize);
+  fp = (Future **)lua_newuserdata(L, sizeof(Future *));
+  *fp = NULL;
+  luaL_setmetatable(L, FUTUREHANDLE);
+  t = (Task *)calloc(1, sizeof(Task));
+  f = (Future *)calloc(1, sizeof(Future));
+  if (t == NULL || f == NULL ||
+      (t->code = copybytes(code, codesize)) == NULL ||
+      (t->args = copybytes(args, argssize)) == NULL) {
+    if (t != NULL) {
+      free(t->code);
+      free(t);
+    }
+    free(f);
+    return luaL_error(L, "not enough memory");
+  }
+  t->codesize = codesize;
+  t->argssize = argssize;
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->done, NULL);
+  f->state = F_PENDING;
+  f->refs = 2;  /* the task and the userdata */
+  *fp = f;
+  t->fut = f;
+  w = &p->workers[p->next++ % (unsigned int)p->nworkers];
+  if (!dq_push(&w->dq, t)) {
+    freetask(t);
+    return luaL_error(L, "not enough memory");
+  }
+  pthread_mutex_lock(&p->lock);
+  p->pending++;
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  return 1;  /* return future */
+}
+
+
+static int tp_size (lua_State *L) {
+  lua_pushinteger(L, (*topool(L))->nworkers);
+  return 1;
+}
+
+
+/* pool:close(): wait for all submitted tasks and stop the workers */
+static int tp_close (lua_State *L) {
+  Pool **pp = topool(L);
+  destroypool(*pp);
+  *pp = NULL;
+  return 0;
+}
+
+
+static int tp_gc (lua_State *L) {
+  Pool **pp = (Pool **)luaL_checkudata(L, 1, POOLHANDLE);
+  if (*pp != NULL) {
+    destroypool(*pp);
+    *pp = NULL;
+  }
+  return 0;
+}
+
+
+static int tp_tostring (lua_State *L) {
+  Pool **pp = (Pool **)luaL_checkudata(L, 1, POOLHANDLE);
+  if (*pp == NULL)
+    lua_pushliteral(L, "pool (closed)");
+  else
+    lua_pushfstring(L, "pool (%p)", *pp);
+  return 1;
+}
+
+
+static Future *tofuture (lua_State *L) {
+  Future *f = *(Future **)luaL_checkudata(L, 1, FUTUREHANDLE);
+  if (f == NULL)  /* e.g., in a state made by 'lua_clonestate' */
+    luaL_error(L, "attempt to use a released future");
+  return f;
+}
+
+
+/*
+** future:get(): wait for the task to finish and return its results,
+** or raise its error.
+*/
+static int fut_get (lua_State *L) {
+  Future *f = tofuture(L);
+  pthread_mutex_lock(&f->lock);
+  while (f->state == F_PENDING)
+    pthread_cond_wait(&f->done, &f->lock);
+  pthread_mutex_unlock(&f->lock);
+  lua_settop(L, 0);
+  if (f->state == F_ERROR) {
+    lua_pushlstring(L, f->data, f->size);
+    return lua_error(L);
+  }
+  return luaL_deserialize(L, f->data, f->size);
+}
+
+
+static int fut_ready (lua_State *L) {
+  Future *f = tofuture(L);
+  int state;
+  pthread_mutex_lock(&f->lock);
+  state = f->state;
+  pthread_mutex_unlock(&f->lock);
+  lua_pushboolean(L, state != F_PENDING);
+  return 1;
+}
+
+
+static int fut_gc (lua_State *L) {
+  Future **fp = (Future **)luaL_checkudata(L, 1, FUTUREHANDLE);
+  if (*fp != NULL) {
+    releasefuture(*fp);
+    *fp = NULL;
+  }
+  return 0;
+}
+
+
+static const luaL_Reg pool_meths[] = {
+  {"close", tp_close},
+  {"size", tp_size},
+  {"submit", tp_submit},
+  {"__gc", tp_gc},
+  {"__tostring", tp_tostring},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg future_meths[] = {
+  {"get", fut_get},
+  {"ready", fut_ready},
+  {"__gc", fut_gc},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg tp_funcs[] = {
+  {"new", tp_new},
+  {NULL, NULL}
+};
+
+
+static void createmeta (lua_State *L, const char *name, const luaL_Reg *l) {
+  luaL_newmetatable(L, name);
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, l, 0);
+  lua_pop(L, 1);  /* pop new metatable */
+}
+
+
+LUAMOD_API int luaopen_threadpool (lua_State *L) {
+  luaL_newlib(L, tp_funcs);
+  createmeta(L, POOLHANDLE, pool_meths);
+  createmeta(L, FUTUREHANDLE, future_meths);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+#else					/* }{ */
+
+
+LUAMOD_API int luaopen_threadpool (lua_State *L) {
+  return luaL_error(L, "library 'threadpool' needs POSIX threads (Linux only)");
+}
+
+#endif					/* } */
+
@@ -129,7 +129,8 @@ static void laction (int i) {
 
 static void print_usage (const char *badoption) {
   lua_writestringerror("%s: ", progname);
-  if (badoption[1] == 'e' || badoption[1] == 'l')
+  if (badoption[1] == 'e' || badoption[1] == 'l' ||
+      badoption[1] == 'I' || badoption[1] == 'S')
     lua_writestringerror("'%s' needs argument\n", badoption);
   else
     lua_writestringerror("unrecognized option '%s'\n", badoption);
@@ -141,6 +142,8 @@ static void print_usage (const char *badoption) {
   "  -l name  require library 'name'\n"
   "  -v       show version information\n"
   "  -E       ignore environment variables\n"
+  "  -I file  load heap image 'file' before running any code\n"
+  "  -S file  save heap image to 'file'\n"
   "  --       stop handling options\n"
   "  -        stop handling options and execute stdin\n"
   ,
@@ -501,7 +504,7 @@ static int collectargs (char **argv, int *first) {
         break;
       case 'e':
         args |= has_e;  /* FALLTHROUGH */
-      case 'l':  /* both options need an argument */
+      case 'l': case 'I': case 'S':  /* options that need an argument */
         if (argv[i][2] == '\0') {  /* no concatenated argument? */
           i++;  /* try next 'argv' */
           if (argv[i] == NULL || argv[i][0] == '-')
@@ -518,30 +521,51 @@ static int collectargs (char **argv, int *first) {
 
 
 /*
-** Processes options 'e' and 'l', which involve running Lua code.
-** Returns 0 if some code raises an error.
+** Processes options 'e', 'l', and 'S', which involve running Lua code
+** (or saving what it built). Returns 0 if some code raises an error.
 */
 static int runargs (lua_State *L, char **argv, int n) {
   int i;
   for (i = 1; i < n; i++) {
     int option = argv[i][1];
     lua_assert(argv[i][0] == '-');  /* already checked */
-    if (option == 'e' || option == 'l') {
+    if (option == 'e' || option == 'l' || option == 'S') {
       int status;
-      const char *extra = argv[i] + 2;  /* both options need an argument */
+      const char *extra = argv[i] + 2;  /* all options need an argument */
       if (*extra == '\0') extra = argv[++i];
       lua_assert(extra != NULL);
-      status = (option == 'e')
-               ? dostring(L, extra, "=(command line)")
-               : dolibrary(L, extra);
+      if (option == 'e')
+        status = dostring(L, extra, "=(command line)");
+      else if (option == 'l')
+        status = dolibrary(L, extra);
+      else
+        status = report(L, luaL_dumpimage(L, extra));
       if (status != LUA_OK) return 0;
     }
+    else if (option == 'I' && argv[i][2] == '\0')
+      i++;  /* skip its argument */
   }
   return 1;
 }
 
 
 
+/*
+** Loads the heap image given by the last option 'I' (if any), so that
+** the state starts with what the code that saved the image built.
+** Returns 0 if the image cannot be loaded.
+*/
+static int loadimage (lua_State *L, char **argv, int n) {
+  const char *image = NULL;
+  int i;
+  for (i = 1; i < n; i++) {
+    if (argv[i][0] == '-' && argv[i][1] == 'I')
+      image = (argv[i][2] != '\0') ? argv[i] + 2 : argv[++i];
+  }
+  return (image == NULL || report(L, luaL_loadimage(L, image)) == LUA_OK);
+}
+
+
 static int handle_luainit (lua_State *L) {
   const char *name = "=" LUA_INITVARVERSION;
   const char *init = getenv(name + 1);
@@ -599,6 +623,8 @@ static int pmain (lua_State *L) {
   }
   /*加载lua标准模块到table中，相当于注册命令关键字和命令处理函数*/
   luaL_openlibs(L);  /* open standard libraries */
+  if (!loadimage(L, argv, script))  /* option '-I' */
+    return 0;
   /*创建参数表，使用"arg"做为key可以找到该表*/
   createargtable(L, argv, argc, script);  /* create table 'arg' */
   if (!(args & has_E)) {  /* no option '-E'? */
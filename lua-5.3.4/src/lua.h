@@ -146,6 +146,8 @@ extern const char lua_ident[];
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
+LUA_API lua_State *(lua_clonestate) (lua_State *L);
+LUA_API int        (lua_resetthread) (lua_State *L);
 
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
 
@@ -184,6 +186,7 @@ LUA_API lua_Integer     (lua_tointegerx) (lua_State *L, int idx, int *isnum);
 LUA_API int             (lua_toboolean) (lua_State *L, int idx);
 LUA_API const char     *(lua_tolstring) (lua_State *L, int idx, size_t *len);
 LUA_API size_t          (lua_rawlen) (lua_State *L, int idx);
+LUA_API int             (lua_isfrozen) (lua_State *L, int idx);
 LUA_API lua_CFunction   (lua_tocfunction) (lua_State *L, int idx);
 LUA_API void	       *(lua_touserdata) (lua_State *L, int idx);
 LUA_API lua_State      *(lua_tothread) (lua_State *L, int idx);
@@ -248,6 +251,7 @@ LUA_API int (lua_rawgeti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
+LUA_API void  (lua_cleartable) (lua_State *L, int idx);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
 LUA_API int  (lua_getuservalue) (lua_State *L, int idx);
@@ -265,6 +269,7 @@ LUA_API void  (lua_rawseti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawsetp) (lua_State *L, int idx, const void *p);
 LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
+LUA_API void  (lua_freeze) (lua_State *L, int idx, int permanent);
 
 
 /*
@@ -283,6 +288,8 @@ LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                           const char *chunkname, const char *mode);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data, int strip);
+LUA_API int (lua_dumpimage) (lua_State *L, lua_Writer writer, void *data);
+LUA_API int (lua_loadimage) (lua_State *L, lua_Reader reader, void *data);
 
 
 /*
@@ -310,6 +317,12 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCSETSTEPTIME	10
+#define LUA_GCSETCPUSHARE	11
+#define LUA_GCSETMARKTHREADS	12
+#define LUA_GCSETLIMIT		13
+#define LUA_GCPEAK		14
+#define LUA_GCPEAKB		15
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -323,7 +336,10 @@ LUA_API int   (lua_error) (lua_State *L);
 LUA_API int   (lua_next) (lua_State *L, int idx);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
+LUA_API int   (lua_concatarray) (lua_State *L, int idx, const char *sep,
+                                 size_t lsep, lua_Integer i, lua_Integer j);
 LUA_API void  (lua_len)    (lua_State *L, int idx);
+LUA_API int   (lua_sortarray) (lua_State *L, int idx, lua_Integer n);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 
@@ -36,6 +36,16 @@
 /* #define LUA_32BITS */
 
 
+/*
+@@ LUA_NANBOXING packs each value in 8 bytes instead of 16, encoding
+** values that are not floats as NaNs. It needs C99, 'double' floats,
+** and pointers (to objects, light userdata, and C functions) that
+** fit in 47 bits, as in user space on current 64-bit systems.
+** Integers are limited to 32 bits.
+*/
+/* #define LUA_NANBOXING */
+
+
 /*
 @@ LUA_USE_C89 controls the use of non-ISO-C89 features.
 ** Define it if you want Lua to avoid the use of a few C99 features
@@ -126,6 +136,13 @@
 #endif
 #define LUA_FLOAT_TYPE	LUA_FLOAT_FLOAT
 
+#elif defined(LUA_NANBOXING)	/* }{ */
+/*
+** 32-bit integers (boxed in NaNs) and 'double'
+*/
+#define LUA_INT_TYPE	LUA_INT_INT
+#define LUA_FLOAT_TYPE	LUA_FLOAT_DOUBLE
+
 #elif defined(LUA_C89_NUMBERS)	/* }{ */
 /*
 ** largest types available for C89 ('long' and 'double')
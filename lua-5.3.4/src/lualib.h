@@ -47,11 +47,28 @@ LUAMOD_API int (luaopen_debug) (lua_State *L);
 #define LUA_LOADLIBNAME	"package"
 LUAMOD_API int (luaopen_package) (lua_State *L);
 
+#define LUA_SERLIBNAME	"serialize"
+LUAMOD_API int (luaopen_serialize) (lua_State *L);
+
+#define LUA_EVLIBNAME	"event"
+LUAMOD_API int (luaopen_event) (lua_State *L);
+
+#define LUA_THREADLIBNAME	"threadpool"
+LUAMOD_API int (luaopen_threadpool) (lua_State *L);
+
+#define LUA_ARRAYLIBNAME	"array"
+LUAMOD_API int (luaopen_array) (lua_State *L);
+
 
 /* open all previous libraries */
 LUALIB_API void (luaL_openlibs) (lua_State *L);
 
 
+/* binary serialization of values (see lserlib.c) */
+LUALIB_API void (luaL_serialize) (lua_State *L, int idx, int n);
+LUALIB_API int (luaL_deserialize) (lua_State *L, const char *s, size_t l);
+
+
 
 #if !defined(lua_assert)
 #define lua_assert(x)	((void)0)
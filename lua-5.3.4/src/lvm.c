@@ -198,7 +198,7 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
 ** If 'slot' is NULL, 't' is not a table.  Otherwise, 'slot' points
 ** to the entry 't[key]', or to 'luaO_nilobject' if there is no such
 ** entry.  (The value at 'slot' must be nil, otherwise 'luaV_fastset'
-** would have done the job.)
+** would have done the job, unless the table is frozen.)
 */
 /*把key/value添加到table t中*/
 void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
@@ -209,8 +209,10 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
     if (slot != NULL) {  /* is 't' a table? */
 	  /*获取table*/
       Table *h = hvalue(t);  /* save 't' table */
-      lua_assert(ttisnil(slot));  /* old value must be nil */
       tm = fasttm(L, h->metatable, TM_NEWINDEX);  /* get metamethod */
+      if (isfrozen(h) && (tm == NULL || !ttisnil(slot)))
+        luaG_frozenerror(L);  /* cannot add or change an entry */
+      lua_assert(ttisnil(slot));  /* old value must be nil */
       if (tm == NULL) {  /* no metamethod? */
         if (slot == luaO_nilobject)  /* no previous entry? */
 		  /*添加新的节点到hash表h中*/
@@ -516,6 +518,77 @@ void luaV_concat (lua_State *L, int total) {
 }
 
 
+/*
+** Copy elements i..j of array 'a' (all strings or numbers), separated
+** by 'sep', to buffer 'buff'.
+*/
+static void copyarray (const TValue *a, lua_Integer i, lua_Integer j,
+                       const char *sep, size_t lsep, char *buff) {
+  for (; i <= j; i++) {
+    const TValue *o = &a[i - 1];
+    if (ttisstring(o)) {
+      size_t l = vslen(o);
+      memcpy(buff, svalue(o), l * sizeof(char));
+      buff += l;
+    }
+    else
+      buff += luaO_tostringbuff(o, buff);
+    if (i < j) {
+      memcpy(buff, sep, lsep * sizeof(char));
+      buff += lsep;
+    }
+  }
+}
+
+
+/*
+** Concatenate elements i..j of table 't' separated by 'sep' (as in
+** 'table.concat') when all of them are strings or numbers in its array
+** part: the total length is computed first, so the result is built
+** directly in its final string. Returns NULL (doing nothing) otherwise.
+*/
+TString *luaV_concatarray (lua_State *L, Table *t, const char *sep,
+                           size_t lsep, lua_Integer i, lua_Integer j) {
+  const TValue *a = t->array;
+  size_t tl = 0;
+  lua_Integer k;
+  TString *ts;
+  if (i > j)
+    return luaS_newliteral(L, "");  /* empty interval */
+  if (i < 1 || l_castS2U(j) > t->sizearray)
+    return NULL;  /* not all in the array part */
+  for (k = i; k <= j; k++) {  /* collect total length */
+    const TValue *o = &a[k - 1];
+    size_t l;
+    if (ttisstring(o))
+      l = vslen(o);
+    else if (cvt2str(o)) {
+      char buff[MAXNUMBER2STR];
+      l = luaO_tostringbuff(o, buff);
+    }
+    else return NULL;  /* invalid value; let generic path complain */
+    if (k < j) {
+      if (lsep >= (MAX_SIZE/sizeof(char)) - l)
+        luaG_runerror(L, "string length overflow");
+      l += lsep;
+    }
+    if (l >= (MAX_SIZE/sizeof(char)) - tl)
+      luaG_runerror(L, "string length overflow");
+    tl += l;
+  }
+  if (tl <= LUAI_MAXSHORTLEN) {  /* is result a short string? */
+    char buff[LUAI_MAXSHORTLEN + MAXNUMBER2STR];  /* room for a last number */
+    copyarray(a, i, j, sep, lsep, buff);
+    ts = luaS_newlstr(L, buff, tl);
+  }
+  else {  /* long string; copy elements directly to final result */
+    ts = luaS_createlngstrobj(L, tl);
+    copyarray(a, i, j, sep, lsep, getstr(ts));
+  }
+  return ts;
+}
+
+
 /*
 ** Main operation 'ra' = #rb'.
 */
@@ -881,10 +954,10 @@ void luaV_execute (lua_State *L) {
       vmcase(OP_NEWTABLE) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
-        Table *t = luaH_new(L);
+        Table *t = luaH_newsized(L, luaO_fb2int(b), luaO_fb2int(c), 1);
         sethvalue(L, ra, t);
         if (b != 0 || c != 0)
-          luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));
+          luaH_presize(L, t, luaO_fb2int(b), luaO_fb2int(c));
         checkGC(L, ra + 1);
         vmbreak;
       }
@@ -78,18 +78,19 @@
 ** return false with 'slot' equal to NULL (if 't' is not a table) or
 ** 'nil'. (This is needed by 'luaV_finishget'.) Note that, if the macro
 ** returns true, there is no need to 'invalidateTMcache', because the
-** call is not creating a new entry.
+** call is not creating a new entry. Frozen tables always go through
+** 'luaV_finishset', which raises the error.
 */
 /*判断t是否是table类型
  * 如果是非table类型，则slot为NULL
  * 如果是table类型，调用函数f，传递参数table t和key k，返回结果保存到slot
  * 如果slot不为空则把v设置到slot中，即设置到table t中，相当于t[k]=v
- * /
+ */
 #define luaV_fastset(L,t,k,slot,f,v) \
   (!ttistable(t) \
    ? (slot = NULL, 0) \
    : (slot = f(hvalue(t), k), \
-     ttisnil(slot) ? 0 \
+     (ttisnil(slot) || hvalue(t)->frozen) ? 0 \
      : (luaC_barrierback(L, hvalue(t), v), \
         setobj2t(L, cast(TValue *,slot), v), \
         1)))
@@ -113,6 +114,8 @@ LUAI_FUNC void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
 LUAI_FUNC void luaV_finishOp (lua_State *L);
 LUAI_FUNC void luaV_execute (lua_State *L);
 LUAI_FUNC void luaV_concat (lua_State *L, int total);
+LUAI_FUNC TString *luaV_concatarray (lua_State *L, Table *t, const char *sep,
+                                     size_t lsep, lua_Integer i, lua_Integer j);
 LUAI_FUNC lua_Integer luaV_div (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_mod (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_shiftl (lua_Integer x, lua_Integer y);
@@ -0,0 +1,58 @@
+-- Collision resistance of the string hash. Interns sets of strings
+-- that only differ in bytes a sampling hash skips (same prefix, same
+-- stride) and checks that they cost about as much as strings that
+-- differ everywhere: if a set collided, every new string would walk
+-- one long bucket chain and the set would take quadratic time.
+-- Usage: lua strhash.lua [strings]
+
+print "testing string hash collisions"
+
+local N = tonumber(arg and arg[1]) or 20000
+local MAXRATIO = 10   -- colliding sets are 20 times slower or worse
+
+local clock, fmt = os.clock, string.format
+
+-- intern N strings built by 'f' as table keys; return the time taken
+local function intern (f)
+  collectgarbage()
+  local t = {}
+  local t0 = clock()
+  for i = 0, N - 1 do
+    local a, b, c = i % 32 + 64, i // 32 % 32 + 64, i // 1024 % 32 + 64
+    t[f(a, b, c)] = i
+  end
+  local e = clock() - t0
+  local n = 0
+  for _ in pairs(t) do n = n + 1 end
+  assert(n == N)   -- all strings distinct
+  return e
+end
+
+local function check (name, e, base)
+  print(fmt("  %-28s %.3fs (%.1fx)", name, e, e / base))
+  assert(e / base < MAXRATIO, name .. " strings collide")
+end
+
+-- short strings (40 bytes, the longest interned length): 'intern'
+-- goes through the string table
+local pad = string.rep("x", 34)
+local base = intern(function (a, b, c)
+  return fmt("%c%c%c%s", a, b, c, pad .. "...") end)
+-- differing only at even positions (a stride of 2)
+check("short, same stride", intern(function (a, b, c)
+  return fmt("%c.%c.%c.%s", a, b, c, pad) end), base)
+-- a common prefix, differing in the first bytes of the last word
+check("short, same prefix", intern(function (a, b, c)
+  return fmt("%s%c.%c.%c.", pad, a, b, c) end), base)
+
+-- long strings (1024 bytes) are hashed when used as keys; a sampling
+-- hash would look only at every 33rd byte, from the last one
+local function y (n) return string.rep("y", n) end
+base = intern(function (a, b, c)
+  return fmt("%c%s%c%s%c%s", a, y(32), b, y(32), c, y(957)) end)
+check("long, same prefix", intern(function (a, b, c)
+  return fmt("%s%c%c%cy", y(1020), a, b, c) end), base)
+check("long, same stride", intern(function (a, b, c)
+  return fmt("y%c%s%c%s%c%s", a, y(32), b, y(32), c, y(956)) end), base)
+
+print "OK"